@@ -0,0 +1,495 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#ifndef _WIN32
+#include <pthread.h>
+#include <sys/resource.h>
+#endif
+
+/* Count every allocation sxml.h makes, switched off while threads are parsing */
+size_t bench_allocations;
+bool bench_counting = true;
+
+void* bench_malloc(size_t size) {
+    if (bench_counting)
+        bench_allocations++;
+    return malloc(size);
+}
+
+void* bench_calloc(size_t count, size_t size) {
+    if (bench_counting)
+        bench_allocations++;
+    return calloc(count, size);
+}
+
+void* bench_realloc(void* pointer, size_t size) {
+    if (bench_counting)
+        bench_allocations++;
+    return realloc(pointer, size);
+}
+
+char* bench_strdup(const char* string) {
+    size_t length = strlen(string) + 1;
+    return memcpy(bench_malloc(length), string, length);
+}
+
+#define malloc(size) bench_malloc(size)
+#define calloc(count, size) bench_calloc(count, size)
+#define realloc(pointer, size) bench_realloc(pointer, size)
+#define _strdup(string) bench_strdup(string)
+#include "sxml.h"
+
+#define CORPUS_FILE "bench_corpus.xml"
+#define BENCH_RUNS 5
+#define MESSAGE_FILE "bench_message.xml"
+#define MESSAGE_WINDOWS 50
+#define MESSAGE_COUNT 2000
+#define MAX_THREADS 16
+#define DEEP_DEPTH 200
+
+/* CORPORA */
+
+/* tests/example.xml scaled up to the given amount of windows */
+void write_config(FILE* file, int windows) {
+    fprintf(file, "<?xml version='1.0' encoding=\"UTF-8\"?>\n<DOC title=\"document\">\n");
+    for (int i = 0; i < windows; i++) {
+        fprintf(file,
+            "    <!-- Window %d -->\n"
+            "    <window title=\"Window %d\" width=\"400\" height=\"200\" x=\"%d\" y=\"0\">\n"
+            "        <p>Lorem ipsum dolor sit amet, consectet </p>\n"
+            "        <br/>\n"
+            "        <layout rows=\"2\" widths=\"46,-1\">\n"
+            "            <label>Red</label><slider min=\"0\" max=\"255\" step=\"1\" value=\"42\"></slider>\n"
+            "            <label>Green</label><slider min=\"0\" max=\"255\" step=\"1\" value=\"69\"></slider>\n"
+            "            <label>Blue</label><slider min=\"0\" max=\"255\" step=\"1\" value=\"128\"></slider>\n"
+            "        </layout>\n"
+            "    </window>\n", i, i, i);
+    }
+    fprintf(file, "</DOC>\n");
+}
+
+/* Chains of DEEP_DEPTH nested elements */
+void write_deep(FILE* file, int chains) {
+    fprintf(file, "<root>\n");
+    for (int i = 0; i < chains; i++) {
+        for (int depth = 0; depth < DEEP_DEPTH; depth++)
+            fprintf(file, "<node depth=\"%d\">", depth);
+        fprintf(file, "leaf %d", i);
+        for (int depth = 0; depth < DEEP_DEPTH; depth++)
+            fprintf(file, "</node>");
+        fprintf(file, "\n");
+    }
+    fprintf(file, "</root>\n");
+}
+
+/* One element with many leaf children that have at most one attribute */
+void write_wide(FILE* file, int items) {
+    fprintf(file, "<items>\n");
+    for (int i = 0; i < items; i++)
+        fprintf(file, "    <item id=\"%d\"/><flag/><name>Item</name>\n", i);
+    fprintf(file, "</items>\n");
+}
+
+/* Records with sixteen attributes each */
+void write_attributes(FILE* file, int records) {
+    fprintf(file, "<records>\n");
+    for (int i = 0; i < records; i++) {
+        fprintf(file, "    <record");
+        for (int j = 0; j < 16; j++)
+            fprintf(file, " field%d=\"value %d of %d\"", j, j, i);
+        fprintf(file, "/>\n");
+    }
+    fprintf(file, "</records>\n");
+}
+
+/* Long paragraphs of text with whitespace runs */
+void write_text(FILE* file, int paragraphs) {
+    fprintf(file, "<book>\n");
+    for (int i = 0; i < paragraphs; i++) {
+        fprintf(file, "    <para id=\"%d\">\n", i);
+        for (int j = 0; j < 8; j++)
+            fprintf(file, "        Lorem ipsum dolor sit amet, consectetur adipiscing elit, sed do eiusmod tempor\n"
+                "        incididunt ut labore et dolore magna aliqua &amp; ut enim ad minim veniam.\n");
+        fprintf(file, "    </para>\n");
+    }
+    fprintf(file, "</book>\n");
+}
+
+/* Entries buried in comments, processing instructions and CDATA sections */
+void write_comments(FILE* file, int entries) {
+    fprintf(file, "<?xml version=\"1.0\"?>\n<!DOCTYPE log [ <!ENTITY app \"bench\"> ]>\n<log>\n");
+    for (int i = 0; i < entries; i++) {
+        fprintf(file,
+            "    <!-- Entry %d was written by the benchmark, <entry> tags in here are skipped -->\n"
+            "    <?trace id=\"%d\" level=\"debug\"?>\n"
+            "    <entry id=\"%d\"><![CDATA[if (a < b && c > d) { return <entry>; }]]></entry>\n", i, i, i);
+    }
+    fprintf(file, "</log>\n");
+}
+
+typedef struct BenchCorpus {
+    const char* name;
+    void (*write)(FILE* file, int count);
+    int count;              /* Scale of the corpus, each is a few MB */
+} BenchCorpus;
+
+BenchCorpus bench_corpora[] = {
+    { "config", write_config, 20000 },
+    { "deep", write_deep, 500 },
+    { "wide", write_wide, 100000 },
+    { "attributes", write_attributes, 20000 },
+    { "text", write_text, 3000 },
+    { "comments", write_comments, 20000 },
+};
+
+bool write_corpus(const BenchCorpus* corpus, const char* filename, int count) {
+    FILE* file = fopen(filename, "w");
+    if (!file)
+        return false;
+    corpus->write(file, count);
+    fclose(file);
+    return true;
+}
+
+
+/* MEASURING */
+
+double wall_seconds(void) {
+#ifdef _WIN32
+    return (double)clock() / CLOCKS_PER_SEC;
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+#endif
+}
+
+/* Restarts the peak resident set size of the process, only possible on Linux */
+void reset_peak_rss(void) {
+#ifdef __linux__
+    FILE* file = fopen("/proc/self/clear_refs", "w");
+    if (file) {
+        fputs("5", file);
+        fclose(file);
+    }
+#endif
+}
+
+/* Returns the peak resident set size in KiB since the last reset, or since start up */
+long peak_rss(void) {
+#ifdef __linux__
+    char line[128];
+    long peak = -1;
+    FILE* file = fopen("/proc/self/status", "r");
+    while (file && fgets(line, sizeof(line), file)) {
+        if (!strncmp(line, "VmHWM:", 6))
+            peak = strtol(line + 6, NULL, 10);
+    }
+    if (file)
+        fclose(file);
+    return peak;
+#elif !defined(_WIN32)
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+#else
+    return -1;
+#endif
+}
+
+size_t count_XMLNodes(XMLNode* node) {
+    size_t count = 1;
+    for (size_t i = 0; i < node->children->count; i++)
+        count += count_XMLNodes(node->children->items[i]);
+    return count;
+}
+
+/* The fastest time of every phase, with the sizes of the run */
+typedef struct BenchResult {
+    size_t bytes;
+    size_t nodes;
+    size_t allocations;
+    double load;
+    double parse;
+    double free;
+    long peak_rss;
+} BenchResult;
+
+void print_header(void) {
+    printf("benchmark,corpus,mode,threads,bytes,nodes,allocations,load_ms,parse_ms,free_ms,parse_mb_s,nodes_s,peak_rss_kb\n");
+}
+
+/* Prints one result as a CSV row, phases that were not measured are left empty */
+void print_result(const char* benchmark, const char* corpus, const char* mode, int threads, const BenchResult* result) {
+    printf("%s,%s,%s,%d,%zu,%zu,%zu,", benchmark, corpus, mode, threads, result->bytes, result->nodes, result->allocations);
+    if (result->load >= 0)
+        printf("%.3f", result->load * 1000.0);
+    printf(",%.3f,", result->parse * 1000.0);
+    if (result->free >= 0)
+        printf("%.3f", result->free * 1000.0);
+    printf(",%.2f,%.0f,%ld\n", result->bytes / (1024.0 * 1024.0) / result->parse, result->nodes / result->parse, result->peak_rss);
+    fflush(stdout);
+}
+
+void keep_fastest(double* best, double seconds) {
+    if (*best < 0 || seconds < *best)
+        *best = seconds;
+}
+
+
+/* BENCHMARKS */
+
+enum BenchKind {
+    BenchTree,              /* parse_xml */
+    BenchFlat,              /* parse_xml_flat */
+    BenchSax                /* parse_xml_sax */
+};
+
+typedef struct BenchMode {
+    const char* name;
+    bool (*load)(XMLDocument*, const char*);
+    unsigned int options;
+    enum BenchKind kind;
+} BenchMode;
+
+BenchMode bench_modes[] = {
+    { "heap", load_file, 0, BenchTree },
+    { "intern", load_file, XMLOptionIntern, BenchTree },
+    { "arena", load_file, XMLOptionArena, BenchTree },
+    { "in-situ", load_file, XMLOptionInSitu, BenchTree },
+    { "mapped", map_file, XMLOptionInSitu, BenchTree },
+    { "flat", load_file, 0, BenchFlat },
+    { "sax", load_file, 0, BenchSax },
+};
+
+/* Counts elements so the SAX callbacks do some work */
+void count_element(void* user, const char* tag, XMLAttribute* attributes, size_t count) {
+    (void)tag;
+    (void)attributes;
+    (void)count;
+    (*(size_t*)user)++;
+}
+
+/* Loads, parses and frees a file BENCH_RUNS times and reports the fastest time of every phase */
+void bench_parse(const BenchCorpus* corpus, const char* filename, const BenchMode* mode) {
+    BenchResult result = { 0, 0, 0, -1, -1, -1, 0 };
+    reset_peak_rss();
+
+    for (int run = 0; run < BENCH_RUNS; run++) {
+        XMLDocument* doc = new_XMLDocument();
+        doc->options = mode->options;
+
+        double start = wall_seconds();
+        if (!mode->load(doc, filename)) {
+            free_XMLDocument(doc);
+            return;
+        }
+        keep_fastest(&result.load, wall_seconds() - start);
+        result.bytes = doc->file_size - 1;
+
+        size_t elements = 0;
+        bool success;
+        bench_allocations = 0;
+        start = wall_seconds();
+        if (mode->kind == BenchTree) {
+            XMLNode* root = parse_xml(doc);
+            keep_fastest(&result.parse, wall_seconds() - start);
+            success = root != NULL;
+            if (root)
+                result.nodes = count_XMLNodes(root);
+        }
+        else if (mode->kind == BenchFlat) {
+            XMLFlatTree* tree = parse_xml_flat(doc);
+            keep_fastest(&result.parse, wall_seconds() - start);
+            success = tree != NULL;
+            result.nodes = 0;
+            for (size_t i = 0; tree && i < tree->node_count; i++)
+                result.nodes += tree->nodes[i].type == XMLTypeNode;
+        }
+        else {
+            XMLHandler handler = { &elements, count_element, NULL, NULL, NULL, NULL };
+            success = parse_xml_sax(doc, &handler);
+            keep_fastest(&result.parse, wall_seconds() - start);
+            result.nodes = elements;
+        }
+        result.allocations = bench_allocations;
+
+        start = wall_seconds();
+        free_XMLDocument(doc);
+        keep_fastest(&result.free, wall_seconds() - start);
+
+        if (!success) {
+            fprintf(stderr, "%s %s: parse failed\n", corpus->name, mode->name);
+            return;
+        }
+    }
+
+    result.peak_rss = peak_rss();
+    print_result("parse", corpus->name, mode->name, 1, &result);
+}
+
+#ifndef _WIN32
+/* A worker parsing its share of the messages */
+typedef struct BenchWorker {
+    pthread_t thread;
+    const XMLDocument* message;
+    int count;
+    bool success;
+} BenchWorker;
+
+void* parse_messages(void* argument) {
+    BenchWorker* worker = argument;
+    worker->success = true;
+    for (int i = 0; i < worker->count; i++) {
+        /* Every message gets its own buffer like one read from a socket */
+        XMLDocument* doc = new_XMLDocument();
+        doc->file_size = worker->message->file_size;
+        doc->buffer = malloc(doc->file_size);
+        memcpy(doc->buffer, worker->message->buffer, doc->file_size);
+        if (!parse_xml(doc))
+            worker->success = false;
+        free_XMLDocument(doc);
+    }
+    return NULL;
+}
+
+long bench_cores(void) {
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cores < 1)
+        cores = 1;
+    if (cores > MAX_THREADS)
+        cores = MAX_THREADS;
+    return cores;
+}
+
+/* Parses MESSAGE_COUNT small documents spread over 1, 2, 4 ... threads, up to one per core */
+void bench_threads(void) {
+    if (!write_corpus(&bench_corpora[0], MESSAGE_FILE, MESSAGE_WINDOWS))
+        return;
+    XMLDocument* message = new_XMLDocument();
+    if (!load_file(message, MESSAGE_FILE)) {
+        free_XMLDocument(message);
+        return;
+    }
+    remove(MESSAGE_FILE);
+    XMLDocument* counted = new_XMLDocument();
+    counted->file_size = message->file_size;
+    counted->buffer = _strdup(message->buffer);
+    size_t nodes = count_XMLNodes(parse_xml(counted));
+    free_XMLDocument(counted);
+
+    long cores = bench_cores();
+    bench_counting = false;
+    for (int threads = 1;; threads *= 2) {
+        if (threads > cores)
+            threads = cores;
+        BenchWorker workers[MAX_THREADS];
+        reset_peak_rss();
+        double start = wall_seconds();
+        for (int i = 0; i < threads; i++) {
+            workers[i].message = message;
+            workers[i].count = MESSAGE_COUNT / threads + (i < MESSAGE_COUNT % threads);
+            pthread_create(&workers[i].thread, NULL, parse_messages, &workers[i]);
+        }
+        bool success = true;
+        for (int i = 0; i < threads; i++) {
+            pthread_join(workers[i].thread, NULL);
+            success &= workers[i].success;
+        }
+        double seconds = wall_seconds() - start;
+
+        if (!success) {
+            fprintf(stderr, "threads: parse failed\n");
+            break;
+        }
+        /* Parsing and freeing every message together */
+        BenchResult result = { (message->file_size - 1) * MESSAGE_COUNT, nodes * MESSAGE_COUNT, 0, -1, seconds, -1, peak_rss() };
+        print_result("threads", "messages", "heap", threads, &result);
+        if (threads == cores)
+            break;
+    }
+    bench_counting = true;
+    free_XMLDocument(message);
+}
+
+/* Parses a corpus with parse_xml_parallel on 1, 2, 4 ... threads, up to one per core */
+void bench_parallel(const BenchCorpus* corpus, const char* filename) {
+    XMLDocument* source = new_XMLDocument();
+    if (!load_file(source, filename)) {
+        free_XMLDocument(source);
+        return;
+    }
+
+    long cores = bench_cores();
+    bench_counting = false;
+    for (int threads = 1;; threads *= 2) {
+        if (threads > cores)
+            threads = cores;
+
+        BenchResult result = { source->file_size - 1, 0, 0, -1, -1, -1, 0 };
+        reset_peak_rss();
+        for (int run = 0; run < BENCH_RUNS; run++) {
+            XMLDocument* doc = new_XMLDocument();
+            doc->file_size = source->file_size;
+            doc->buffer = malloc(doc->file_size);
+            memcpy(doc->buffer, source->buffer, doc->file_size);
+            doc->options = XMLOptionInSitu;
+
+            double start = wall_seconds();
+            XMLNode* root = parse_xml_parallel(doc, threads);
+            keep_fastest(&result.parse, wall_seconds() - start);
+            if (root)
+                result.nodes = count_XMLNodes(root);
+            start = wall_seconds();
+            free_XMLDocument(doc);
+            keep_fastest(&result.free, wall_seconds() - start);
+            if (!root) {
+                fprintf(stderr, "parallel: parse failed\n");
+                bench_counting = true;
+                free_XMLDocument(source);
+                return;
+            }
+        }
+
+        result.peak_rss = peak_rss();
+        print_result("parallel", corpus->name, "in-situ", threads, &result);
+        if (threads == cores)
+            break;
+    }
+    bench_counting = true;
+    free_XMLDocument(source);
+}
+#endif
+
+/* Runs every benchmark, or only those of the corpora named on the command line */
+int main(int argc, char** argv) {
+    print_header();
+    for (size_t i = 0; i < sizeof(bench_corpora) / sizeof(bench_corpora[0]); i++) {
+        const BenchCorpus* corpus = &bench_corpora[i];
+        bool selected = argc < 2;
+        for (int j = 1; j < argc; j++)
+            selected |= !strcmp(argv[j], corpus->name);
+        if (!selected)
+            continue;
+
+        if (!write_corpus(corpus, CORPUS_FILE, corpus->count)) {
+            fprintf(stderr, "Could not write '%s'\n", CORPUS_FILE);
+            return 1;
+        }
+        for (size_t j = 0; j < sizeof(bench_modes) / sizeof(bench_modes[0]); j++)
+            bench_parse(corpus, CORPUS_FILE, &bench_modes[j]);
+#ifndef _WIN32
+        if (i == 0)
+            bench_parallel(corpus, CORPUS_FILE);
+#endif
+        remove(CORPUS_FILE);
+    }
+
+#ifndef _WIN32
+    if (argc < 2)
+        bench_threads();
+#endif
+    return 0;
+}
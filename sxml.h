@@ -2,20 +2,134 @@
 #define SXML_H
 
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#else
+#include <io.h>
+#endif
+
+/* parse_xml_parallel uses POSIX threads unless SXML_NO_THREADS is defined */
+#if !defined(SXML_NO_THREADS) && !defined(_WIN32)
+#define SXML_THREADS
+#include <pthread.h>
+#endif
+
+/* Delimiters are scanned with SSE2 or AVX2 on x86 unless SXML_NO_SIMD is defined */
+#if !defined(SXML_NO_SIMD) && (defined(__SSE2__) || defined(_M_X64) || defined(_M_AMD64))
+#define SXML_SIMD
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+
+/* Parsers fill doc->parse when SXML_STATS is defined, otherwise the counters compile away */
+#ifdef SXML_STATS
+#include <time.h>
+#define SXML_COUNT(doc, field, amount) ((doc)->parse.field += (amount))
+#define SXML_LAP(doc, field) lap_XMLParseStats(doc, &(doc)->parse.field)
+#define SXML_START(doc) start_XMLParseStats(doc)
+#define SXML_STOP(doc) stop_XMLParseStats(doc)
+#else
+#define SXML_COUNT(doc, field, amount) ((void)0)
+#define SXML_LAP(doc, field) ((void)0)
+#define SXML_START(doc) ((void)0)
+#define SXML_STOP(doc) ((void)0)
+#endif
+
+#if defined(__GNUC__)
+#define SXML_AVX2 __attribute__((target("avx2")))
+#else
+#define SXML_AVX2
+#endif
+
 /* GLOBALS */
 #define EXPAND_LEXER_SIZE 1024
-#define NODE_SIZE 2
+#define NODE_SIZE 2         /* Items a list holds before it allocates */
+#define ARENA_BLOCK_SIZE 65536
+#define ARENA_ALIGNMENT 8
+#define SAX_STACK_SIZE 16
+#define MAX_PARSE_THREADS 64
+#define SKELETON_DEPTH 64
+#define ATTRIBUTE_INDEX_SIZE 8
+#define SYMBOL_TABLE_SIZE 64
+#define TAG_INDEX_SIZE 32
+#define FLAT_NONE 0xffffffffu
+#define QUERY_PREDICATES 4
+#define PROJECTION_PATHS 63 /* One bit per path, the last bit marks elements whose whole subtree is built */
+#define PROJECTION_STACK_SIZE 16
+#define BLOB_VERSION 3
+#define WRITER_BUFFER_SIZE 65536
+
+
+/* XML ALLOCATOR */
+
+/* Memory of a document is routed through these functions, NULL ones fall back to malloc, realloc and free */
+typedef struct XMLAllocator {
+    void* (*alloc)(void* user, size_t size);
+    void* (*realloc)(void* user, void* pointer, size_t size);
+    void (*free)(void* user, void* pointer);
+    void* user;
+} XMLAllocator;
+
+enum XMLMemory {
+    XMLMemoryNode,
+    XMLMemoryList,          /* Items of lists and the values of inner_xml */
+    XMLMemoryAttribute,
+    XMLMemoryText,          /* Tags, keys, values and inner text */
+    XMLMemoryOther,         /* Buffers, indices and stacks */
+    XMLMemoryCount
+};
+
+typedef struct XMLStats {
+    size_t calls[XMLMemoryCount];   /* Allocations by category, from the arena or from the allocator */
+    size_t bytes[XMLMemoryCount];
+    size_t heap_calls;      /* Calls into the allocator, arena blocks and reallocations included */
+    size_t heap_bytes;
+    size_t failures;
+} XMLStats;
+
+
+/* XML ARENA */
+typedef struct XMLArenaBlock {
+    struct XMLArenaBlock* next;
+    size_t size;
+    size_t used;
+} XMLArenaBlock;
+
+typedef struct XMLArena {
+    XMLArenaBlock* block;
+    XMLAllocator allocator; /* Where the blocks come from */
+    XMLStats* stats;        /* Counts the blocks, NULL if nobody is interested */
+} XMLArena;
+
+
+/* XML OPTION */
+enum XMLOption {
+    XMLOptionArena = 1 << 0,
+    XMLOptionInSitu = 1 << 1,
+    XMLOptionPreserveWhitespace = 1 << 2,
+    XMLOptionIntern = 1 << 3,
+    XMLOptionTagIndex = 1 << 4,
+    XMLOptionLazyAttributes = 1 << 5,
+    XMLOptionLazyChildren = 1 << 6
+};
 
 
 /* XML LIST */
 typedef struct XMLList {
-    int heap_size;
-    int count;
-    void** items;
+    size_t heap_size;       /* Room in items */
+    size_t count;
+    void** items;           /* Points to inline_items until more than NODE_SIZE items are added */
+    void* inline_items[NODE_SIZE];
 } XMLList;
 
 
@@ -25,6 +139,24 @@ typedef struct XMLAttribute {
     char* value;
 } XMLAttribute;
 
+/* Attribute key with its hash computed once, for repeated lookups */
+typedef struct XMLKey {
+    const char* key;
+    uint32_t hash;
+} XMLKey;
+
+/* Open addressing table over the attributes of a wide node */
+typedef struct XMLAttributeSlot {
+    uint32_t hash;
+    uint32_t item;          /* Index into node->attributes plus one, 0 marks an empty slot */
+} XMLAttributeSlot;
+
+typedef struct XMLAttributeIndex {
+    uint32_t mask;          /* Slot count minus one, the slot count is a power of two */
+    size_t count;           /* Attributes indexed, a node with more attributes is searched linearly */
+    XMLAttributeSlot slots[];
+} XMLAttributeIndex;
+
 
 /* XML VALUE */
 enum XMLType {
@@ -38,6 +170,43 @@ typedef struct XMLValue {
 } XMLValue;
 
 
+/* XML VIEW */
+typedef struct XMLView {
+    char* data;
+    size_t length;
+} XMLView;
+
+
+/* XML TOKEN */
+enum XMLTokenType {
+    XMLTokenNone,
+    XMLTokenError,
+    XMLTokenText,
+    XMLTokenStartElement,
+    XMLTokenEndElement,
+    XMLTokenAttribute,
+    XMLTokenComment,
+    XMLTokenDeclaration,
+    XMLTokenCData
+};
+
+typedef struct XMLToken {
+    enum XMLTokenType type;
+    XMLView name;   /* Tag, attribute key or declaration name */
+    XMLView value;  /* Text, CDATA, comment or attribute value (NULL data for attributes without a value) */
+    bool escaped;   /* The value contains '\' escapes */
+} XMLToken;
+
+/* Where the tokenizer is in the markup */
+enum XMLState {
+    XMLStateContent,
+    XMLStateTag,        /* After '<' */
+    XMLStateAttributes, /* After the name of a start tag or declaration */
+    XMLStateInline,     /* After "/>", the end element is still owed */
+    XMLStateError
+};
+
+
 /* XML NODE */
 typedef struct XMLNode {
     char* tag;
@@ -45,259 +214,1374 @@ typedef struct XMLNode {
     XMLList* inner_xml;
     XMLList* attributes;
     XMLList* children;
+    XMLAttributeIndex* attribute_index; /* Only built for nodes with ATTRIBUTE_INDEX_SIZE or more attributes */
+    struct XMLPending* pending; /* Attributes or content not parsed yet with XMLOptionLazyAttributes or XMLOptionLazyChildren */
 } XMLNode;
 
 
+/* XML HANDLER */
+typedef struct XMLHandler {
+    void* user;
+    void (*start_element)(void* user, const char* tag, XMLAttribute* attributes, size_t count);
+    void (*end_element)(void* user, const char* tag);
+    void (*text)(void* user, const char* text);
+    void (*comment)(void* user, const char* comment);
+    void (*declaration)(void* user, XMLAttribute* attributes, size_t count);
+} XMLHandler;
+
+
+/* Open elements and attributes of the SAX parser, reused for every element */
+typedef struct XMLEvents {
+    XMLAttribute* attributes;
+    size_t attributes_size;
+    char* tags;             /* Names of the open elements, each NUL terminated */
+    size_t tags_size;
+    size_t tags_length;
+    size_t depth;
+    bool done;              /* An end tag closed the document */
+} XMLEvents;
+
+/* Where the push parser stopped in the fed input */
+enum XMLScan {
+    XMLScanText,
+    XMLScanOpen,            /* After '<' */
+    XMLScanTag,
+    XMLScanValue,
+    XMLScanComment,
+    XMLScanCData,
+    XMLScanInstruction,
+    XMLScanSpecial,
+    XMLScanSubset,          /* Inside the '[' ']' of a DOCTYPE */
+    XMLScanLiteral,         /* Inside a quoted literal of a DOCTYPE, closed by scan_quote */
+    XMLScanSubsetLiteral,
+    XMLScanSubsetComment
+};
+
+
+/* XML SYMBOLS */
+typedef struct XMLSymbolSlot {
+    uint32_t hash;
+    uint32_t length;
+    const char* string;     /* NULL marks an empty slot */
+} XMLSymbolSlot;
+
+/* Interned tags and keys, every distinct string is stored once */
+typedef struct XMLSymbols {
+    XMLSymbolSlot* slots;
+    uint32_t mask;          /* Slot count minus one, the slot count is a power of two */
+    uint32_t count;
+    XMLArena* strings;
+    struct XMLSymbols* parent;  /* Table the strings are interned in, this one only caches them */
+    struct XMLDocument* doc;    /* Whose allocator and stats the table uses, NULL for the heap */
+    bool shared;            /* Used by several documents or threads and freed by the user */
+#ifdef SXML_THREADS
+    pthread_mutex_t lock;
+#endif
+} XMLSymbols;
+
+
+/* XML TAG INDEX */
+
+/* Elements with one tag in document order */
+typedef struct XMLTagEntry {
+    uint32_t hash;
+    const char* tag;        /* NULL marks an empty entry */
+    XMLNode** nodes;
+    size_t count;
+    size_t size;
+} XMLTagEntry;
+
+/* Elements of a document by tag, filled while parsing with XMLOptionTagIndex */
+typedef struct XMLTagIndex {
+    XMLTagEntry* entries;
+    uint32_t mask;          /* Entry count minus one, the entry count is a power of two */
+    uint32_t count;
+    XMLNode* root;          /* Set once parsing is done */
+    bool stale;             /* The tree was edited, rebuilt by the next lookup */
+} XMLTagIndex;
+
+
+/* XML FLAT TREE */
+
+/* Element or text of a flat tree, linked by indices into tree->nodes */
+typedef struct XMLFlatNode {
+    enum XMLType type;
+    uint32_t parent;        /* FLAT_NONE for top level nodes */
+    uint32_t first_child;   /* First element or text inside, FLAT_NONE if empty */
+    uint32_t next_sibling;  /* FLAT_NONE for the last node */
+    uint32_t attributes;    /* Index of the first attribute in tree->attributes */
+    uint32_t attribute_count;
+    const char* value;      /* Tag of an element, or the text */
+} XMLFlatNode;
+
+/* Nodes in document order and their attributes packed in two arrays */
+typedef struct XMLFlatTree {
+    XMLFlatNode* nodes;
+    size_t node_count;
+    size_t node_size;
+    XMLAttribute* attributes;
+    size_t attribute_count;
+    size_t attribute_size;
+} XMLFlatTree;
+
+
+/* XML QUERY */
+enum XMLPredicateType {
+    XMLPredicatePosition,   /* [2] */
+    XMLPredicateAttribute   /* [@key] or [@key='value'] */
+};
+
+typedef struct XMLPredicate {
+    enum XMLPredicateType type;
+    size_t position;        /* 1 based */
+    XMLKey key;
+    const char* value;      /* NULL if any value matches */
+} XMLPredicate;
+
+typedef struct XMLQueryStep {
+    bool descendant;        /* Step after '//' instead of '/' */
+    const char* tag;        /* NULL for '*' */
+    XMLPredicate predicates[QUERY_PREDICATES];
+    size_t predicate_count;
+} XMLQueryStep;
+
+/* Compiled path expression, the tags, keys and values point into strings */
+typedef struct XMLQuery {
+    XMLQueryStep* steps;
+    size_t step_count;
+    bool absolute;          /* Starts at the top of the tree instead of at the given node */
+    char* strings;
+} XMLQuery;
+
+/* Context node of a child step whose children are matched up to next */
+typedef struct XMLQueryFrame {
+    XMLNode* parent;
+    size_t next;
+    size_t positions[QUERY_PREDICATES];
+} XMLQueryFrame;
+
+/* Nodes matched by run_XMLQuery, reused between runs so matching allocates nothing once warm */
+typedef struct XMLQueryResult {
+    XMLNode** nodes;
+    size_t count;
+    size_t size;
+    XMLNode** context;      /* Nodes matched by the previous step */
+    size_t context_size;
+    XMLQueryFrame* frames;
+    size_t frames_size;
+    const char** tags;      /* Tags of the steps interned in the symbol table */
+    size_t tags_size;
+    bool failed;            /* The last run ran out of memory, its nodes are incomplete */
+} XMLQueryResult;
+
+
+/* XML PROJECTION */
+/* Paths from the document element down that parse_xml builds, everything off them is skipped */
+typedef struct XMLProjection {
+    XMLQuery** paths;
+    size_t count;
+} XMLProjection;
+
+
+/* XML BLOB */
+
+/* Precompiled tree, all links are indices and all strings are offsets so it can be mapped anywhere */
+typedef struct XMLBlobHeader {
+    char magic[4];          /* "SXMB" */
+    uint32_t version;       /* BLOB_VERSION */
+    uint32_t checksum;      /* Of the whole blob with the checksum set to 0 */
+    uint32_t node_count;
+    uint32_t attribute_count;
+    uint32_t strings_size;
+} XMLBlobHeader;
+
+/* Element or text, linked like an XMLFlatNode */
+typedef struct XMLBlobNode {
+    uint32_t type;          /* enum XMLType */
+    uint32_t parent;
+    uint32_t first_child;
+    uint32_t next_sibling;
+    uint32_t attributes;
+    uint32_t attribute_count;
+    uint32_t value;         /* Offset of the tag or text in the strings */
+} XMLBlobNode;
+
+typedef struct XMLBlobAttribute {
+    uint32_t key;
+    uint32_t value;         /* FLAT_NONE for attributes without value */
+} XMLBlobAttribute;
+
+/* A blob loaded by load_XMLBlob, the arrays point into the mapped file */
+typedef struct XMLBlob {
+    const char* data;
+    size_t size;
+    bool mapped;
+    const XMLBlobNode* nodes;
+    uint32_t node_count;
+    const XMLBlobAttribute* attributes;
+    uint32_t attribute_count;
+    const char* strings;
+} XMLBlob;
+
+
+/* XML WRITER */
+enum XMLFormat {
+    XMLFormatCompact,       /* No whitespace between tags */
+    XMLFormatPretty         /* Elements on their own line, indented by four spaces */
+};
+
+/* Buffer a tree is serialized into, flushed to fd when it is set */
+typedef struct XMLWriter {
+    char* buffer;
+    size_t length;
+    size_t size;
+    int fd;                 /* -1 keeps everything in the buffer */
+    enum XMLFormat format;
+    bool failed;
+} XMLWriter;
+
+
+/* XML PARSE STATS */
+/* What the last parse_xml or parse_xml_parallel of a document did, filled with SXML_STATS */
+typedef struct XMLParseStats {
+    size_t bytes;           /* Bytes of the buffer the parse moved over */
+    size_t elements;
+    size_t attributes;
+    size_t texts;           /* Text and CDATA added to the tree */
+    size_t max_depth;       /* The document element is at depth 1 */
+    size_t skipped;         /* Bytes of comments, DOCTYPE and processing instructions */
+    size_t lexer_growths;   /* Reallocations of the lexer by feed_xml */
+    size_t list_growths;    /* Reallocations in append_XMLItem */
+    uint64_t tokenize_ns;   /* Time in next_XMLToken, summed over the threads of parse_xml_parallel */
+    uint64_t build_ns;      /* Time building the tree, attributes are scanned while building */
+    size_t depth;           /* Open elements while parsing */
+    size_t start;           /* Index the parse started at */
+    uint64_t lap;           /* Clock at the end of the last lap */
+} XMLParseStats;
+
+
 /* XML DOCUMENT */
 typedef struct XMLDocument {
     char* buffer;
     char* lexer;
     XMLList* info;
+    XMLArena* arena;        /* Owns the tree when parsing into an arena */
+    XMLList* nodes;         /* Heap nodes, attributes and text of the tree, freed with the document */
+    XMLList* attributes;
+    XMLList* text;
+    XMLSymbols* symbols;    /* Tags and keys are interned here with XMLOptionIntern */
+    XMLFlatTree* flat;      /* Tree of parse_xml_flat */
+    XMLTagIndex* tag_index; /* Elements by tag with XMLOptionTagIndex */
+    unsigned int options;
+    enum XMLState state;
+    XMLView tag;
+    XMLEvents* events;
+    enum XMLScan scan;
+    char scan_quote;
+    size_t scan_index;
     size_t lexer_size;
     size_t lexer_index;
     size_t index;
     size_t file_size;
+    size_t mapped_size;
+    XMLAllocator allocator; /* Every allocation of the document goes through it */
+    XMLStats stats;         /* What the document allocated so far */
+    struct XMLDocument* parent; /* Document a chunk of parse_xml_parallel parses for */
+    const XMLProjection* projection; /* parse_xml only builds the elements on its paths, NULL builds everything */
+    uint64_t* projected;    /* Paths each open element is on while parsing with a projection */
+    size_t projected_count;
+    size_t projected_size;
+#ifdef SXML_STATS
+    XMLParseStats parse;
+#endif
 } XMLDocument;
 
+/* Regions of a node parsed lazily, each is parsed on first access */
+typedef struct XMLPending {
+    XMLDocument* doc;       /* Owns the buffer the regions are in */
+    size_t attributes;      /* Index after the tag name, the region ends with the tag. 0 once decoded */
+    size_t content;         /* Index after the start tag, the region ends with the end tag. 0 once expanded */
+} XMLPending;
 
-/* NODE & ATTRIBUTE STACK */
-XMLList* SXML_NODES;
-XMLList* SXML_ATTRIBUTES;
-XMLList* SXML_TEXT;
 
+/* Pull reader over the tokens of a document */
+typedef struct XMLReader {
+    XMLDocument* doc;
+    XMLToken token;         /* The token returned last */
+    XMLView* tags;          /* Names of the open elements */
+    size_t tags_size;
+    size_t depth;
+} XMLReader;
 
-/* LIST IMPLEMENTATION */
-XMLList* new_XMLList() {
-    XMLList* list = malloc(sizeof(XMLList));
-    if (!list) {
-        printf("cannot allocate list\n");
-        exit(1);
+
+/* ALLOCATOR IMPLEMENTATION */
+/* The hooks are called through pointers so malloc style macros of the including file leave them alone */
+void* alloc_XMLAllocator(const XMLAllocator* allocator, size_t size) {
+    return allocator && allocator->alloc ? (*allocator->alloc)(allocator->user, size) : malloc(size);
+}
+
+void* realloc_XMLAllocator(const XMLAllocator* allocator, void* pointer, size_t size) {
+    return allocator && allocator->realloc ? (*allocator->realloc)(allocator->user, pointer, size) : realloc(pointer, size);
+}
+
+void release_XMLAllocator(const XMLAllocator* allocator, void* pointer) {
+    if (!pointer)
+        return;
+    if (allocator && allocator->free)
+        (*allocator->free)(allocator->user, pointer);
+    else
+        free(pointer);
+}
+
+/* Counts an allocation the document asked for, wherever it was served from. */
+void count_XMLMemory(XMLDocument* doc, size_t size, enum XMLMemory kind) {
+    doc->stats.calls[kind]++;
+    doc->stats.bytes[kind] += size;
+}
+
+/* Reports an allocation that failed and stops the parser. Returns NULL for the caller to pass on. */
+void* fail_XMLMemory(XMLDocument* doc) {
+    fprintf(stderr, "Out of memory\n");
+    if (doc) {
+        doc->stats.failures++;
+        doc->state = XMLStateError;
+    }
+    return NULL;
+}
+
+/* Allocates from the allocator of the document, or from the heap when doc is NULL. A failure is left to the caller to report. */
+void* try_XMLHeap(XMLDocument* doc, size_t size, enum XMLMemory kind) {
+    if (!doc)
+        return malloc(size);
+
+    count_XMLMemory(doc, size, kind);
+    doc->stats.heap_calls++;
+    doc->stats.heap_bytes += size;
+    return alloc_XMLAllocator(&doc->allocator, size);
+}
+
+/* Allocates from the allocator of the document, or from the heap when doc is NULL. */
+void* alloc_XMLHeap(XMLDocument* doc, size_t size, enum XMLMemory kind) {
+    void* memory = try_XMLHeap(doc, size, kind);
+    return memory ? memory : fail_XMLMemory(doc);
+}
+
+/* Resizes memory of alloc_XMLHeap. On failure NULL is returned and the memory is left as it was. */
+void* realloc_XMLHeap(XMLDocument* doc, void* pointer, size_t size, enum XMLMemory kind) {
+    if (!doc) {
+        void* memory = realloc(pointer, size);
+        return memory ? memory : fail_XMLMemory(NULL);
+    }
+
+    count_XMLMemory(doc, size, kind);
+    doc->stats.heap_calls++;
+    doc->stats.heap_bytes += size;
+    void* memory = realloc_XMLAllocator(&doc->allocator, pointer, size);
+    return memory ? memory : fail_XMLMemory(doc);
+}
+
+void free_XMLHeap(XMLDocument* doc, void* pointer) {
+    release_XMLAllocator(doc ? &doc->allocator : NULL, pointer);
+}
+
+
+/* ARENA IMPLEMENTATION */
+
+/* Creates an arena taking its blocks from allocator (NULL for the heap), counted in stats unless it is NULL. */
+XMLArena* new_XMLArena(const XMLAllocator* allocator, XMLStats* stats) {
+    XMLArena* arena = alloc_XMLAllocator(allocator, sizeof(XMLArena));
+    if (stats) {
+        stats->heap_calls++;
+        stats->heap_bytes += sizeof(XMLArena);
+    }
+    if (!arena)
+        return NULL;
+    arena->block = NULL;
+    if (allocator)
+        arena->allocator = *allocator;
+    else
+        memset(&arena->allocator, 0, sizeof(XMLAllocator));
+    arena->stats = stats;
+    return arena;
+}
+
+/* Returns size bytes from the current block, or NULL if a new block cannot be allocated. */
+void* alloc_XMLArena(XMLArena* arena, size_t size) {
+    /* Round up so every allocation stays aligned for pointers and size_t */
+    size = (size + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1);
+
+    XMLArenaBlock* block = arena->block;
+    if (!block || block->used + size > block->size) {
+        /* Oversized requests get a block of their own */
+        size_t block_size = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+        block = alloc_XMLAllocator(&arena->allocator, sizeof(XMLArenaBlock) + block_size);
+        if (arena->stats) {
+            arena->stats->heap_calls++;
+            arena->stats->heap_bytes += sizeof(XMLArenaBlock) + block_size;
+        }
+        if (!block)
+            return NULL;
+        block->size = block_size;
+        block->used = 0;
+        block->next = arena->block;
+        arena->block = block;
+    }
+
+    /* Data starts directly after the block header */
+    void* memory = (char*)(block + 1) + block->used;
+    block->used += size;
+    return memory;
+}
+
+/* Moves the blocks of from behind the current block of into and frees from, both use the same allocator. */
+void merge_XMLArena(XMLArena* into, XMLArena* from) {
+    if (!from->block) {
+        release_XMLAllocator(&from->allocator, from);
+        return;
+    }
+
+    XMLArenaBlock* last = from->block;
+    while (last->next)
+        last = last->next;
+
+    /* The current block of into stays in front so allocation continues where it was */
+    if (into->block) {
+        last->next = into->block->next;
+        into->block->next = from->block;
+    }
+    else into->block = from->block;
+    release_XMLAllocator(&from->allocator, from);
+}
+
+void free_XMLArena(XMLArena* arena) {
+    if (arena) {
+        XMLArenaBlock* block = arena->block;
+        while (block) {
+            XMLArenaBlock* next = block->next;
+            release_XMLAllocator(&arena->allocator, block);
+            block = next;
+        }
+        release_XMLAllocator(&arena->allocator, arena);
+    }
+}
+
+
+/* ALLOCATION HELPERS */
+
+/* Allocates from the arena of the document when it has one, otherwise from its allocator. Returns NULL on failure. */
+void* alloc_XMLMemory(XMLDocument* doc, size_t size, enum XMLMemory kind) {
+    if (doc && doc->arena) {
+        count_XMLMemory(doc, size, kind);
+        void* memory = alloc_XMLArena(doc->arena, size);
+        return memory ? memory : fail_XMLMemory(doc);
     }
+    return alloc_XMLHeap(doc, size, kind);
+}
+
+/* Like alloc_XMLMemory, but a failure leaves the document as it was. For memory the parse can do without. */
+void* try_XMLMemory(XMLDocument* doc, size_t size, enum XMLMemory kind) {
+    if (doc && doc->arena) {
+        void* memory = alloc_XMLArena(doc->arena, size);
+        if (memory)
+            count_XMLMemory(doc, size, kind);
+        return memory;
+    }
+    return try_XMLHeap(doc, size, kind);
+}
+
+/* Frees memory of alloc_XMLMemory, which only has to be done when it did not come from an arena. */
+void free_XMLMemory(XMLDocument* doc, void* pointer) {
+    if (!(doc && doc->arena))
+        free_XMLHeap(doc, pointer);
+}
+
+/* Duplicates a string into the arena of the document or onto the heap. Returns NULL on failure. */
+char* copy_XMLString(XMLDocument* doc, const char* string) {
+    size_t length = strlen(string) + 1;
+    char* copy = alloc_XMLMemory(doc, length, XMLMemoryText);
+    return copy ? memcpy(copy, string, length) : NULL;
+}
+
+
+/* LIST IMPLEMENTATION */
+
+/* Empties a list that lives inside another allocation. */
+void init_XMLList(XMLList* list) {
     list->count = 0;
     list->heap_size = NODE_SIZE;
-    list->items = malloc(sizeof(void*) * list->heap_size);
+    list->items = list->inline_items;
+}
+
+XMLList* new_XMLList(XMLDocument* doc) {
+    XMLList* list = alloc_XMLMemory(doc, sizeof(XMLList), XMLMemoryList);
+    if (list)
+        init_XMLList(list);
     return list;
 }
 
-void append_XMLItem(XMLList* list, void* item) {
-    if (list->count >= list->heap_size) {
-        list->heap_size *= 2;
-        list->items = realloc(list->items, sizeof(void*) * list->heap_size);
-        if (list->items == NULL) {
-            printf("Unable to reallocate list\n");
-        }
+/* Makes room for count more items. Returns false when out of memory, the list is left as it was. */
+bool reserve_XMLList(XMLDocument* doc, XMLList* list, size_t count) {
+    if (list->count + count <= list->heap_size)
+        return true;
+
+    size_t size = list->heap_size * 2;
+    while (size < list->count + count)
+        size *= 2;
+    void** items;
+    if ((doc && doc->arena) || list->items == list->inline_items) {
+        /* Inline and arena items cannot be resized, move them to a larger block */
+        items = alloc_XMLMemory(doc, sizeof(void*) * size, XMLMemoryList);
+        if (items)
+            memcpy(items, list->items, sizeof(void*) * list->count);
     }
+    else items = realloc_XMLHeap(doc, list->items, sizeof(void*) * size, XMLMemoryList);
+    if (!items)
+        return false;
+    list->items = items;
+    list->heap_size = size;
+    if (doc)
+        SXML_COUNT(doc, list_growths, 1);
+    return true;
+}
+
+/* Appends an item, returns false if the list could not grow. */
+bool append_XMLItem(XMLDocument* doc, XMLList* list, void* item) {
+    if (!reserve_XMLList(doc, list, 1))
+        return false;
     list->items[list->count++] = item;
+    return true;
+}
+
+/* Frees the items of a list of the document once they outgrew the inline ones. */
+void release_XMLList(XMLDocument* doc, XMLList* list) {
+    if (list->items != list->inline_items)
+        free_XMLMemory(doc, list->items);
+    init_XMLList(list);
 }
 
-void free_XMLList(XMLList* list) {
+/* Frees the items of a list once they outgrew the inline ones. */
+void clear_XMLList(XMLList* list) {
+    release_XMLList(NULL, list);
+}
+
+/* Frees a list of new_XMLList through the document that made it, lists of an arena go with the arena. */
+void free_XMLList(XMLDocument* doc, XMLList* list) {
     if (list) {
-        free(list->items);
-        free(list);
+        release_XMLList(doc, list);
+        free_XMLMemory(doc, list);
     }
 }
 
 
 /* VALUE IMPLEMENTATION */
-XMLValue* new_XMLValue(void* item, enum XMLType type) {
-    XMLValue* value = malloc(sizeof(XMLValue));
-    if (!value) {
-        printf("Unable to allocate value\n");
-        exit(1);
-    }
-    value->type = type;
-    value->value = item;
+XMLValue* new_XMLValue(XMLDocument* doc, void* item, enum XMLType type) {
+    XMLValue* value = alloc_XMLMemory(doc, sizeof(XMLValue), XMLMemoryList);
+    if (value) {
+        value->type = type;
+        value->value = item;
+    }
     return value;
 }
 
 
 /* NODE IMPLEMENTATION */
-XMLNode* new_XMLNode(XMLNode* parent) {
-    XMLNode* node = malloc(sizeof(XMLNode));
-    if (!node) {
-        printf("Unable to allocate node\n");
-        exit(1);
-    }
+/* Defined with the parser, everything that reads the attributes or content of a node parses them first */
+bool decode_XMLAttributes(XMLNode* node);
+bool expand_XMLNode(XMLNode* node);
+
+/* Creates a node owned by the document, or by the caller when doc is NULL. */
+XMLNode* new_XMLNode(XMLDocument* doc, XMLNode* parent) {
+    /* The lists live in the same allocation directly after the node */
+    XMLNode* node = alloc_XMLMemory(doc, sizeof(XMLNode) + sizeof(XMLList) * 3, XMLMemoryNode);
+    if (!node)
+        return NULL;
     node->parent = parent;
 
-    node->inner_xml = new_XMLList();
-    node->children = new_XMLList();
-    node->attributes = new_XMLList();
+    XMLList* lists = (XMLList*)(node + 1);
+    node->inner_xml = &lists[0];
+    node->children = &lists[1];
+    node->attributes = &lists[2];
+    init_XMLList(node->inner_xml);
+    init_XMLList(node->children);
+    init_XMLList(node->attributes);
 
     node->tag = NULL;
-    if (parent != NULL) {
-        append_XMLItem(parent->inner_xml, new_XMLValue(node, XMLTypeNode));
-        append_XMLItem(parent->children, node);
+    node->attribute_index = NULL;
+    node->pending = NULL;
+
+    /* Everything is allocated before the node is linked, so a failure leaves the parent and the document as they were */
+    XMLValue* value = parent ? new_XMLValue(doc, node, XMLTypeNode) : NULL;
+    bool tracked = doc && !doc->arena;
+    if ((parent && (!value || !reserve_XMLList(doc, parent->inner_xml, 1) || !reserve_XMLList(doc, parent->children, 1)))
+        || (tracked && !reserve_XMLList(doc, doc->nodes, 1))) {
+        free_XMLMemory(doc, value);
+        free_XMLMemory(doc, node);
+        return NULL;
+    }
+
+    /* Arena nodes are released with their arena and need no tracking */
+    if (tracked)
+        append_XMLItem(doc, doc->nodes, node);
+    if (parent) {
+        append_XMLItem(doc, parent->inner_xml, value);
+        append_XMLItem(doc, parent->children, node);
     }
-    append_XMLItem(SXML_NODES, node);
+
+    /* Nodes made by hand after parsing have no tag yet, the index catches up on the next lookup */
+    if (doc && doc->tag_index && doc->tag_index->root)
+        doc->tag_index->stale = true;
     return node;
 }
 
 void print_XMLNode(XMLNode *node, int indent) {
     printf("%*s%s", 4 * indent, " ", node->tag);
-    for (int i = 0; i < node->attributes->count; i++) {
+    decode_XMLAttributes(node);
+    for (size_t i = 0; i < node->attributes->count; i++) {
         XMLAttribute* attribute = node->attributes->items[i];
         printf(" %s=\"%s\"", attribute->key, attribute->value);
     }
     printf("\n");
-    for (int i = 0; i < node->children->count; i++) {
+    expand_XMLNode(node);
+    for (size_t i = 0; i < node->children->count; i++) {
         print_XMLNode(node->children->items[i], indent + 1);
     }
 }
 
-void free_XMLNode(XMLNode* node) {
+/* Frees a heap node through the allocator of the document that made it. */
+void release_XMLNode(XMLDocument* doc, XMLNode* node) {
     /* Free tag & text */
     if (node) {
         if (node->tag) {
-            free(node->tag);
+            free_XMLHeap(doc, node->tag);
         }
-        for (int i = 0; i < node->inner_xml->count; i++) {
-            free(node->inner_xml->items[i]);
+        for (size_t i = 0; i < node->inner_xml->count; i++) {
+            free_XMLHeap(doc, node->inner_xml->items[i]);
         }
-        free_XMLList(node->inner_xml);
-        free_XMLList(node->children);
-        free_XMLList(node->attributes);
+        release_XMLList(doc, node->inner_xml);
+        release_XMLList(doc, node->children);
+        release_XMLList(doc, node->attributes);
+        free_XMLHeap(doc, node->attribute_index);
+        free_XMLHeap(doc, node->pending);
 
-        free(node);
+        free_XMLHeap(doc, node);
         node = NULL;
     }
 }
 
+void free_XMLNode(XMLNode* node) {
+    release_XMLNode(NULL, node);
+}
+
 
 /* ATTRIBUTE IMPLEMENTATION */
-XMLAttribute* new_XMLAttribute(void) {
-    XMLAttribute* attribute = malloc(sizeof(XMLAttribute));
-    if (!attribute) {
-        printf("Unable to allocate attribute\n");
-        exit(1);
-    }
+/* Creates an attribute owned by the document, or by the caller when doc is NULL. */
+XMLAttribute* new_XMLAttribute(XMLDocument* doc) {
+    XMLAttribute* attribute = alloc_XMLMemory(doc, sizeof(XMLAttribute), XMLMemoryAttribute);
+    if (!attribute)
+        return NULL;
     attribute->key = NULL;
     attribute->value = NULL;
 
-    append_XMLItem(SXML_ATTRIBUTES, attribute);
+    if (doc && !doc->arena && !append_XMLItem(doc, doc->attributes, attribute)) {
+        free_XMLMemory(doc, attribute);
+        return NULL;
+    }
     return attribute;
 }
 
-XMLAttribute* get_XMLAttribute(XMLNode* node, char* key) {
-    for (int i = 0; i < node->attributes->count; i++) {
-        XMLAttribute* attribute = node->attributes->items[i];
-        if (!strcmp(attribute->key, key)) {
-            return attribute;
+/* Continues an FNV-1a hash over length more bytes. */
+uint32_t mix_XMLHash(uint32_t hash, const char* data, size_t length) {
+    for (size_t i = 0; i < length; i++) {
+        hash ^= (unsigned char)data[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/* Returns the FNV-1a hash of length bytes. */
+uint32_t hash_XMLString(const char* data, size_t length) {
+    return mix_XMLHash(2166136261u, data, length);
+}
+
+/* Returns the FNV-1a hash of a key. */
+uint32_t hash_XMLKey(const char* key) {
+    return hash_XMLString(key, strlen(key));
+}
+
+/* Returns a key handle for find_XMLAttribute, the key must outlive the handle. */
+XMLKey make_XMLKey(const char* key) {
+    XMLKey handle;
+    handle.key = key;
+    handle.hash = hash_XMLKey(key);
+    return handle;
+}
+
+/*
+ * Builds the hash index of a node once its attributes are complete. Keys keep their source order
+ * in node->attributes, the index only points into it. Nodes with few attributes are left unindexed.
+ */
+void index_XMLAttributes(XMLDocument* doc, XMLNode* node) {
+    size_t count = node->attributes->count;
+    if (count < ATTRIBUTE_INDEX_SIZE)
+        return;
+
+    /* Keep the table at most half full */
+    uint32_t size = 1;
+    while (size < (uint32_t)count * 2)
+        size *= 2;
+
+    /* Lookups fall back to a linear scan, so running out of memory here is not an error */
+    XMLAttributeIndex* index = try_XMLMemory(doc, sizeof(XMLAttributeIndex) + sizeof(XMLAttributeSlot) * size, XMLMemoryAttribute);
+    if (!index)
+        return;
+    index->mask = size - 1;
+    index->count = count;
+    memset(index->slots, 0, sizeof(XMLAttributeSlot) * size);
+
+    /* Linear probing keeps the first of duplicate keys in front */
+    for (size_t i = 0; i < count; i++) {
+        uint32_t hash = hash_XMLKey(((XMLAttribute*)node->attributes->items[i])->key);
+        uint32_t slot = hash & index->mask;
+        while (index->slots[slot].item)
+            slot = (slot + 1) & index->mask;
+        index->slots[slot].hash = hash;
+        index->slots[slot].item = (uint32_t)i + 1;
+    }
+
+    free_XMLMemory(doc, node->attribute_index);
+    node->attribute_index = index;
+}
+
+/* Returns the first attribute with the key of the handle, or NULL. */
+XMLAttribute* find_XMLAttribute(XMLNode* node, const XMLKey* key) {
+    decode_XMLAttributes(node);
+    XMLAttributeIndex* index = node->attribute_index;
+
+    /* Attributes added after indexing are not in the table */
+    if (!index || index->count != node->attributes->count) {
+        for (size_t i = 0; i < node->attributes->count; i++) {
+            XMLAttribute* attribute = node->attributes->items[i];
+            if (!strcmp(attribute->key, key->key)) {
+                return attribute;
+            }
         }
+        return NULL;
+    }
+
+    for (uint32_t slot = key->hash & index->mask; index->slots[slot].item; slot = (slot + 1) & index->mask) {
+        if (index->slots[slot].hash != key->hash)
+            continue;
+        XMLAttribute* attribute = node->attributes->items[index->slots[slot].item - 1];
+        if (!strcmp(attribute->key, key->key))
+            return attribute;
     }
     return NULL;
 }
 
-void free_XMLAttribute(XMLAttribute* attribute) {
+XMLAttribute* get_XMLAttribute(XMLNode* node, char* key) {
+    decode_XMLAttributes(node);
+
+    /* Hashing only pays off for wide nodes */
+    if (!node->attribute_index) {
+        for (size_t i = 0; i < node->attributes->count; i++) {
+            XMLAttribute* attribute = node->attributes->items[i];
+            if (!strcmp(attribute->key, key)) {
+                return attribute;
+            }
+        }
+        return NULL;
+    }
+
+    XMLKey handle = make_XMLKey(key);
+    return find_XMLAttribute(node, &handle);
+}
+
+/* Returns the attributes of a node in source order, decoded first when they were parsed lazily. */
+XMLList* get_XMLAttributes(XMLNode* node) {
+    decode_XMLAttributes(node);
+    return node->attributes;
+}
+
+/* Frees a heap attribute through the allocator of the document that made it. */
+void release_XMLAttribute(XMLDocument* doc, XMLAttribute* attribute) {
     if (attribute) {
         if (attribute->key)
-            free(attribute->key);
+            free_XMLHeap(doc, attribute->key);
         if (attribute->value)
-            free(attribute->value);
-        free(attribute);
+            free_XMLHeap(doc, attribute->value);
+        free_XMLHeap(doc, attribute);
     }
 }
 
+void free_XMLAttribute(XMLAttribute* attribute) {
+    release_XMLAttribute(NULL, attribute);
+}
 
-/* DOCUMENT IMPLEMENTATION */
-XMLDocument* new_XMLDocument() {
-    XMLDocument* doc = malloc(sizeof(XMLDocument));
-    if (doc) {
-        doc->lexer_size = EXPAND_LEXER_SIZE;
-        doc->lexer_index = 0;
-        doc->index = 0;
-        doc->buffer = NULL;
-        doc->lexer = malloc(sizeof(char) * doc->lexer_size);
-        doc->info = NULL;
+
+/* SYMBOL TABLE IMPLEMENTATION */
+
+/*
+ * Creates an empty symbol table in the allocator of doc, which has to outlive it, or on the heap when doc is NULL.
+ * A shared table may be set as doc->symbols of several documents, also on different threads, and has to be
+ * freed with free_XMLSymbols once they are freed. Returns NULL when out of memory, for the caller to report.
+ */
+XMLSymbols* new_XMLSymbols(XMLDocument* doc, bool shared) {
+    XMLSymbols* symbols = try_XMLHeap(doc, sizeof(XMLSymbols), XMLMemoryOther);
+    if (!symbols)
+        return NULL;
+    symbols->slots = try_XMLHeap(doc, sizeof(XMLSymbolSlot) * SYMBOL_TABLE_SIZE, XMLMemoryOther);
+    symbols->strings = new_XMLArena(doc ? &doc->allocator : NULL, doc ? &doc->stats : NULL);
+    if (!symbols->slots || !symbols->strings) {
+        free_XMLHeap(doc, symbols->slots);
+        free_XMLArena(symbols->strings);
+        free_XMLHeap(doc, symbols);
+        return NULL;
     }
-    return doc;
+    memset(symbols->slots, 0, sizeof(XMLSymbolSlot) * SYMBOL_TABLE_SIZE);
+    symbols->mask = SYMBOL_TABLE_SIZE - 1;
+    symbols->count = 0;
+    symbols->parent = NULL;
+    symbols->doc = doc;
+    symbols->shared = shared;
+#ifdef SXML_THREADS
+    pthread_mutex_init(&symbols->lock, NULL);
+#endif
+    return symbols;
 }
 
-bool load_file(XMLDocument* doc, const char* filename) {
-    /* Check if file opened successfully */
-    FILE* file = fopen(filename, "r");
-    if (!file) {
-        fprintf(stderr, "Could not load file from '%s'\n", filename);
+/* Returns the slot holding the string, or the empty slot it belongs in. */
+XMLSymbolSlot* find_XMLSymbolSlot(XMLSymbols* symbols, const char* data, size_t length, uint32_t hash) {
+    uint32_t slot = hash & symbols->mask;
+    for (;;) {
+        XMLSymbolSlot* entry = &symbols->slots[slot];
+        if (!entry->string || (entry->hash == hash && entry->length == length && !memcmp(entry->string, data, length)))
+            return entry;
+        slot = (slot + 1) & symbols->mask;
+    }
+}
+
+/* Doubles the slots of a table, returns false if they cannot be allocated. */
+bool grow_XMLSymbols(XMLSymbols* symbols) {
+    uint32_t size = (symbols->mask + 1) * 2;
+    XMLSymbolSlot* slots = try_XMLHeap(symbols->doc, sizeof(XMLSymbolSlot) * size, XMLMemoryOther);
+    if (!slots)
         return false;
+    memset(slots, 0, sizeof(XMLSymbolSlot) * size);
+
+    for (uint32_t i = 0; i <= symbols->mask; i++) {
+        XMLSymbolSlot* entry = &symbols->slots[i];
+        if (!entry->string)
+            continue;
+        uint32_t slot = entry->hash & (size - 1);
+        while (slots[slot].string)
+            slot = (slot + 1) & (size - 1);
+        slots[slot] = *entry;
     }
+    free_XMLHeap(symbols->doc, symbols->slots);
+    symbols->slots = slots;
+    symbols->mask = size - 1;
+    return true;
+}
 
-    /* Get the size of the file */
-    fseek(file, 0, SEEK_END);
-    size_t size = ftell(file);
-    fseek(file, 0, SEEK_SET);
-    if (size > 0) {
+/* Interns without taking the lock of the table. Returns NULL when out of memory. */
+const char* insert_XMLSymbol(XMLSymbols* symbols, const char* data, size_t length, uint32_t hash) {
+    XMLSymbolSlot* entry = find_XMLSymbolSlot(symbols, data, length, hash);
+    if (entry->string)
+        return entry->string;
 
-        /* Initialise buffer and ensure it is null terminated */
-        doc->file_size = size+1;
-        doc->buffer = (char*)calloc(sizeof(char), doc->file_size);
+    /* Keep the table at most half full */
+    if ((symbols->count + 1) * 2 > symbols->mask + 1) {
+        if (!grow_XMLSymbols(symbols))
+            return NULL;
+        entry = find_XMLSymbolSlot(symbols, data, length, hash);
+    }
 
-        /* Read file into the buffer */
-        fread(doc->buffer, 1, size, file);
-        fclose(file);
-        return true;
+    /* A cache takes the string of its parent, a table keeps its own copy */
+    const char* string;
+    if (symbols->parent) {
+        /* The caches of parse_xml_parallel share their parent */
+#ifdef SXML_THREADS
+        pthread_mutex_lock(&symbols->parent->lock);
+        string = insert_XMLSymbol(symbols->parent, data, length, hash);
+        pthread_mutex_unlock(&symbols->parent->lock);
+#else
+        string = insert_XMLSymbol(symbols->parent, data, length, hash);
+#endif
     }
-    return false;
+    else {
+        char* copy = alloc_XMLArena(symbols->strings, length + 1);
+        if (!copy)
+            return NULL;
+        memcpy(copy, data, length);
+        copy[length] = '\0';
+        string = copy;
+    }
+    if (!string)
+        return NULL;
+
+    entry->hash = hash;
+    entry->length = (uint32_t)length;
+    entry->string = string;
+    symbols->count++;
+    return string;
 }
 
-void free_file(XMLDocument* doc) {
-    if (doc) {
-        free(doc->buffer);
-        free(doc->lexer);
-        doc->buffer = NULL;
-        doc->lexer = NULL;
-        doc->index = 0;
-        doc->lexer_index = 0;
-        doc->file_size = 0;
+/*
+ * Returns the interned copy of length bytes of data. Equal strings interned in the same table
+ * return the same pointer, so they can be compared with ==. Returns NULL when out of memory.
+ */
+const char* intern_XMLSymbol(XMLSymbols* symbols, const char* data, size_t length) {
+    uint32_t hash = hash_XMLString(data, length);
+#ifdef SXML_THREADS
+    if (symbols->shared) {
+        pthread_mutex_lock(&symbols->lock);
+        const char* string = insert_XMLSymbol(symbols, data, length, hash);
+        pthread_mutex_unlock(&symbols->lock);
+        return string;
     }
+#endif
+    return insert_XMLSymbol(symbols, data, length, hash);
 }
 
-void free_XMLDocument(XMLDocument* doc) {
-    if(doc){
-        if (doc->lexer)
-            free(doc->lexer);
-        if (doc->buffer)
-            free(doc->buffer);
-        free(doc);
+/* Returns the interned copy of a string, or NULL if it was never interned. */
+const char* find_XMLSymbol(XMLSymbols* symbols, const char* string) {
+    size_t length = strlen(string);
+    uint32_t hash = hash_XMLString(string, length);
+#ifdef SXML_THREADS
+    if (symbols->shared)
+        pthread_mutex_lock(&symbols->lock);
+#endif
+    const char* found = find_XMLSymbolSlot(symbols, string, length, hash)->string;
+#ifdef SXML_THREADS
+    if (symbols->shared)
+        pthread_mutex_unlock(&symbols->lock);
+#endif
+    return found;
+}
+
+void free_XMLSymbols(XMLSymbols* symbols) {
+    if (symbols) {
+#ifdef SXML_THREADS
+        pthread_mutex_destroy(&symbols->lock);
+#endif
+        free_XMLHeap(symbols->doc, symbols->slots);
+        free_XMLArena(symbols->strings);
+        free_XMLHeap(symbols->doc, symbols);
     }
 }
 
 
-/* FREE STACKS */
-void free_XMLStacks(void) {
-    /* Free XMLNodes */
-    if (SXML_NODES) {
-        for (int i = 0; i < SXML_NODES->count; i++) {
-            free_XMLNode(SXML_NODES->items[i]);
-        }
-        free(SXML_NODES->items);
-        free(SXML_NODES);
-        SXML_NODES = NULL;
+/* TAG INDEX IMPLEMENTATION */
+/* The tag index of a document lives in the allocator of the document. */
+XMLTagIndex* new_XMLTagIndex(XMLDocument* doc) {
+    XMLTagIndex* index = alloc_XMLHeap(doc, sizeof(XMLTagIndex), XMLMemoryOther);
+    if (!index)
+        return NULL;
+    index->entries = alloc_XMLHeap(doc, sizeof(XMLTagEntry) * TAG_INDEX_SIZE, XMLMemoryOther);
+    if (!index->entries) {
+        free_XMLHeap(doc, index);
+        return NULL;
     }
+    memset(index->entries, 0, sizeof(XMLTagEntry) * TAG_INDEX_SIZE);
+    index->mask = TAG_INDEX_SIZE - 1;
+    index->count = 0;
+    index->root = NULL;
+    index->stale = false;
+    return index;
+}
 
-    /* Free XMLAttributes */
-    if (SXML_ATTRIBUTES) {
-        for (int i = 0; i < SXML_ATTRIBUTES->count; i++) {
-            free_XMLAttribute(SXML_ATTRIBUTES->items[i]);
-        }
-        free(SXML_ATTRIBUTES->items);
-        free(SXML_ATTRIBUTES);
-        SXML_ATTRIBUTES = NULL;
+void free_XMLTagIndex(XMLDocument* doc, XMLTagIndex* index) {
+    if (index) {
+        for (uint32_t i = 0; i <= index->mask; i++)
+            free_XMLHeap(doc, index->entries[i].nodes);
+        free_XMLHeap(doc, index->entries);
+        free_XMLHeap(doc, index);
     }
+}
 
-    /* Free XML inner text */
-    if (SXML_TEXT) {
-        for (int i = 0; i < SXML_TEXT->count; i++) {
-            free(SXML_TEXT->items[i]);
-        }
-        free(SXML_TEXT->items);
-        free(SXML_TEXT);
-        SXML_TEXT = NULL;
+/* Returns the entry of a tag, or the empty entry it belongs in. */
+XMLTagEntry* find_XMLTagEntry(XMLTagIndex* index, const char* tag, uint32_t hash) {
+    uint32_t slot = hash & index->mask;
+    for (;;) {
+        XMLTagEntry* entry = &index->entries[slot];
+        /* Interned tags are found by pointer */
+        if (!entry->tag || (entry->hash == hash && (entry->tag == tag || !strcmp(entry->tag, tag))))
+            return entry;
+        slot = (slot + 1) & index->mask;
     }
 }
 
+/* Doubles the entries of a tag index once it is half full. */
+bool grow_XMLTagIndex(XMLDocument* doc, XMLTagIndex* index) {
+    uint32_t size = (index->mask + 1) * 2;
+    XMLTagEntry* entries = index->entries;
+    uint32_t old_size = index->mask + 1;
+
+    index->entries = alloc_XMLHeap(doc, sizeof(XMLTagEntry) * size, XMLMemoryOther);
+    if (!index->entries) {
+        index->entries = entries;
+        return false;
+    }
+    memset(index->entries, 0, sizeof(XMLTagEntry) * size);
+    index->mask = size - 1;
+    for (uint32_t i = 0; i < old_size; i++) {
+        if (entries[i].tag)
+            *find_XMLTagEntry(index, entries[i].tag, entries[i].hash) = entries[i];
+    }
+    free_XMLHeap(doc, entries);
+    return true;
+}
+
+/* Returns the entry of a tag, adding an empty one if the tag is new. Returns NULL when out of memory. */
+XMLTagEntry* add_XMLTagEntry(XMLDocument* doc, XMLTagIndex* index, const char* tag, uint32_t hash) {
+    XMLTagEntry* entry = find_XMLTagEntry(index, tag, hash);
+    if (entry->tag)
+        return entry;
+
+    if ((index->count + 1) * 2 > index->mask + 1) {
+        if (!grow_XMLTagIndex(doc, index))
+            return NULL;
+        entry = find_XMLTagEntry(index, tag, hash);
+    }
+    entry->hash = hash;
+    entry->tag = tag;
+    index->count++;
+    return entry;
+}
+
+/* Appends the nodes of a tag, growing its array by doubling. */
+bool append_XMLTagNodes(XMLDocument* doc, XMLTagEntry* entry, XMLNode** nodes, size_t count) {
+    if (entry->count + count > entry->size) {
+        size_t size = entry->size ? entry->size : SAX_STACK_SIZE;
+        while (size < entry->count + count)
+            size *= 2;
+        XMLNode** grown = realloc_XMLHeap(doc, entry->nodes, sizeof(XMLNode*) * size, XMLMemoryOther);
+        if (!grown)
+            return false;
+        entry->nodes = grown;
+        entry->size = size;
+    }
+    memcpy(entry->nodes + entry->count, nodes, sizeof(XMLNode*) * count);
+    entry->count += count;
+    return true;
+}
+
+/* Adds a node after every node with its tag, length is the length of the tag. */
+bool add_XMLTagNode(XMLDocument* doc, XMLTagIndex* index, XMLNode* node, size_t length) {
+    XMLTagEntry* entry = add_XMLTagEntry(doc, index, node->tag, hash_XMLString(node->tag, length));
+    if (!entry)
+        return false;
+    if (entry->count < entry->size) {
+        entry->nodes[entry->count++] = node;
+        return true;
+    }
+    return append_XMLTagNodes(doc, entry, &node, 1);
+}
+
+/* Appends every entry of from to the entries of the same tags in index. */
+bool merge_XMLTagIndex(XMLDocument* doc, XMLTagIndex* index, XMLTagIndex* from) {
+    for (uint32_t i = 0; i <= from->mask; i++) {
+        XMLTagEntry* entry = &from->entries[i];
+        if (!entry->tag)
+            continue;
+        XMLTagEntry* into = add_XMLTagEntry(doc, index, entry->tag, entry->hash);
+        if (!into || !append_XMLTagNodes(doc, into, entry->nodes, entry->count))
+            return false;
+    }
+    return true;
+}
+
+/* Adds node and every element below it in document order, expanding lazy children on the way. */
+bool add_XMLTagTree(XMLDocument* doc, XMLTagIndex* index, XMLNode* node) {
+    if (node->tag && !add_XMLTagNode(doc, index, node, strlen(node->tag)))
+        return false;
+    if (!expand_XMLNode(node))
+        return false;
+    for (size_t i = 0; i < node->children->count; i++) {
+        if (!add_XMLTagTree(doc, index, node->children->items[i]))
+            return false;
+    }
+    return true;
+}
+
+/* Marks the tag index of a document as out of date after tags were changed by hand. */
+void invalidate_XMLTagIndex(XMLDocument* doc) {
+    if (doc->tag_index)
+        doc->tag_index->stale = true;
+}
+
+/*
+ * Returns the elements with a tag in document order and sets count to their amount, or NULL if there are none.
+ * Needs XMLOptionTagIndex, the array is valid until the tree is edited or the document is freed.
+ */
+XMLNode** get_XMLNodesByTag(XMLDocument* doc, const char* tag, size_t* count) {
+    XMLTagIndex* index = doc->tag_index;
+    *count = 0;
+    if (!index)
+        return NULL;
+
+    /* Edited trees are indexed again, the old tags may be gone */
+    if (index->stale && index->root) {
+        for (uint32_t i = 0; i <= index->mask; i++)
+            free_XMLHeap(doc, index->entries[i].nodes);
+        memset(index->entries, 0, sizeof(XMLTagEntry) * (index->mask + 1));
+        index->count = 0;
+        /* Expanded nodes would add themselves out of order, so the index is taken off the document meanwhile */
+        doc->tag_index = NULL;
+        bool success = add_XMLTagTree(doc, index, index->root);
+        doc->tag_index = index;
+        /* A partial index stays stale and is built again on the next lookup */
+        if (!success)
+            return NULL;
+        index->stale = false;
+    }
+
+    XMLTagEntry* entry = find_XMLTagEntry(index, tag, hash_XMLKey(tag));
+    if (!entry->tag || !entry->count)
+        return NULL;
+    *count = entry->count;
+    return entry->nodes;
+}
+
+
+/* DOCUMENT IMPLEMENTATION */
+/*
+ * Creates a document allocating through allocator, which is copied. NULL or NULL functions use the heap.
+ * Returns NULL if the document cannot be allocated.
+ */
+XMLDocument* new_XMLDocumentAllocator(const XMLAllocator* allocator) {
+    XMLDocument* doc = alloc_XMLAllocator(allocator, sizeof(XMLDocument));
+    if (doc) {
+        if (allocator)
+            doc->allocator = *allocator;
+        else
+            memset(&doc->allocator, 0, sizeof(XMLAllocator));
+        memset(&doc->stats, 0, sizeof(XMLStats));
+        doc->parent = NULL;
+        doc->projection = NULL;
+        doc->projected = NULL;
+        doc->projected_count = 0;
+        doc->projected_size = 0;
+#ifdef SXML_STATS
+        memset(&doc->parse, 0, sizeof(XMLParseStats));
+#endif
+        doc->stats.calls[XMLMemoryOther] = 1;
+        doc->stats.bytes[XMLMemoryOther] = sizeof(XMLDocument);
+        doc->stats.heap_calls = 1;
+        doc->stats.heap_bytes = sizeof(XMLDocument);
+
+        doc->lexer_size = EXPAND_LEXER_SIZE;
+        doc->lexer_index = 0;
+        doc->index = 0;
+        doc->buffer = NULL;
+        doc->mapped_size = 0;
+        doc->lexer = alloc_XMLHeap(doc, sizeof(char) * doc->lexer_size, XMLMemoryOther);
+        if (!doc->lexer) {
+            release_XMLAllocator(allocator, doc);
+            return NULL;
+        }
+        doc->info = NULL;
+        doc->arena = NULL;
+        doc->nodes = NULL;
+        doc->attributes = NULL;
+        doc->text = NULL;
+        doc->symbols = NULL;
+        doc->flat = NULL;
+        doc->tag_index = NULL;
+        doc->options = 0;
+        doc->state = XMLStateContent;
+        doc->tag.data = NULL;
+        doc->tag.length = 0;
+        doc->events = NULL;
+        doc->scan = XMLScanText;
+        doc->scan_index = 0;
+    }
+    return doc;
+}
+
+XMLDocument* new_XMLDocument() {
+    return new_XMLDocumentAllocator(NULL);
+}
+
+bool load_file(XMLDocument* doc, const char* filename) {
+    /* Check if file opened successfully */
+    FILE* file = fopen(filename, "r");
+    if (!file) {
+        fprintf(stderr, "Could not load file from '%s'\n", filename);
+        return false;
+    }
+
+    /* Get the size of the file */
+    fseek(file, 0, SEEK_END);
+    size_t size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    if (size > 0) {
+
+        /* Initialise buffer and ensure it is null terminated */
+        char* buffer = alloc_XMLHeap(doc, size + 1, XMLMemoryOther);
+        if (!buffer) {
+            fclose(file);
+            return false;
+        }
+        doc->file_size = size+1;
+        doc->buffer = buffer;
+
+        /* Read file into the buffer */
+        size_t read = fread(doc->buffer, 1, size, file);
+        memset(doc->buffer + read, 0, doc->file_size - read);
+        fclose(file);
+        return true;
+    }
+    fclose(file);
+    return false;
+}
+
+/*
+ * Maps the file instead of reading it. The mapping is followed by a zero filled sentinel page,
+ * so the buffer is NUL terminated like the one of load_file. Falls back to load_file on Windows.
+ */
+bool map_file(XMLDocument* doc, const char* filename) {
+#ifdef _WIN32
+    return load_file(doc, filename);
+#else
+    int file = open(filename, O_RDONLY);
+    if (file < 0) {
+        fprintf(stderr, "Could not load file from '%s'\n", filename);
+        return false;
+    }
+
+    /* Get the size of the file */
+    struct stat info;
+    if (fstat(file, &info) != 0 || info.st_size <= 0) {
+        close(file);
+        return false;
+    }
+    size_t size = (size_t)info.st_size;
+    size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+
+    /* Reserve the whole pages of the file plus the sentinel page */
+    size_t mapped_size = (size + page_size - 1) / page_size * page_size + page_size;
+    char* region = mmap(NULL, mapped_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (region == MAP_FAILED) {
+        close(file);
+        fprintf(stderr, "Could not map file '%s'\n", filename);
+        return false;
+    }
+
+    /* Map the file over the start of the reservation, private so in situ parsing can write to it */
+    char* buffer = mmap(region, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, file, 0);
+    close(file);
+    if (buffer == MAP_FAILED) {
+        munmap(region, mapped_size);
+        fprintf(stderr, "Could not map file '%s'\n", filename);
+        return false;
+    }
+    madvise(buffer, size, MADV_SEQUENTIAL);
+
+    doc->buffer = buffer;
+    doc->file_size = size + 1;
+    doc->mapped_size = mapped_size;
+    return true;
+#endif
+}
+
+/* Releases the buffer of load_file or map_file, a buffer set by hand has to come from the allocator of the document. */
+void free_XMLBuffer(XMLDocument* doc) {
+#ifndef _WIN32
+    if (doc->mapped_size) {
+        munmap(doc->buffer, doc->mapped_size);
+        doc->mapped_size = 0;
+        doc->buffer = NULL;
+        return;
+    }
+#endif
+    free_XMLHeap(doc, doc->buffer);
+    doc->buffer = NULL;
+}
+
+void free_file(XMLDocument* doc) {
+    if (doc) {
+        free_XMLBuffer(doc);
+        free_XMLHeap(doc, doc->lexer);
+        doc->buffer = NULL;
+        doc->lexer = NULL;
+        doc->index = 0;
+        doc->lexer_index = 0;
+        doc->file_size = 0;
+    }
+}
+
+/* Frees the heap nodes, attributes and text the document tracks. */
+void free_XMLTree(XMLDocument* doc) {
+    /* Interned tags and keys belong to the symbol table */
+    bool interned = doc->symbols != NULL;
+
+    /* Free XMLNodes */
+    if (doc->nodes) {
+        for (size_t i = 0; i < doc->nodes->count; i++) {
+            if (interned)
+                ((XMLNode*)doc->nodes->items[i])->tag = NULL;
+            release_XMLNode(doc, doc->nodes->items[i]);
+        }
+        release_XMLList(doc, doc->nodes);
+        free_XMLHeap(doc, doc->nodes);
+        doc->nodes = NULL;
+    }
+
+    /* Free XMLAttributes */
+    if (doc->attributes) {
+        for (size_t i = 0; i < doc->attributes->count; i++) {
+            if (interned)
+                ((XMLAttribute*)doc->attributes->items[i])->key = NULL;
+            release_XMLAttribute(doc, doc->attributes->items[i]);
+        }
+        release_XMLList(doc, doc->attributes);
+        free_XMLHeap(doc, doc->attributes);
+        doc->attributes = NULL;
+    }
+
+    /* Free XML inner text */
+    if (doc->text) {
+        for (size_t i = 0; i < doc->text->count; i++) {
+            free_XMLHeap(doc, doc->text->items[i]);
+        }
+        release_XMLList(doc, doc->text);
+        free_XMLHeap(doc, doc->text);
+        doc->text = NULL;
+    }
+}
+
+void free_XMLDocument(XMLDocument* doc) {
+    if(doc){
+        if (doc->lexer)
+            free_XMLHeap(doc, doc->lexer);
+        if (doc->buffer)
+            free_XMLBuffer(doc);
+        /* Every node, attribute and string of an arena document goes with the arena */
+        free_XMLArena(doc->arena);
+        free_XMLTree(doc);
+        if (doc->symbols && !doc->symbols->shared)
+            free_XMLSymbols(doc->symbols);
+        free_XMLTagIndex(doc, doc->tag_index);
+        if (doc->flat) {
+            free_XMLHeap(doc, doc->flat->nodes);
+            free_XMLHeap(doc, doc->flat->attributes);
+            free_XMLHeap(doc, doc->flat);
+        }
+        free_XMLHeap(doc, doc->projected);
+        if (doc->events) {
+            free_XMLHeap(doc, doc->events->attributes);
+            free_XMLHeap(doc, doc->events->tags);
+            free_XMLHeap(doc, doc->events);
+        }
+        XMLAllocator allocator = doc->allocator;
+        release_XMLAllocator(&allocator, doc);
+    }
+}
+
+
+/* HELPER FUNCTION */
 
-/* HELPER FUNCTION */
-
 /* Returns true if the end of a string is equal to a given suffix. */
 bool ends_with(const char* string, const char* suffix) {
     size_t string_length = strlen(string);
@@ -341,291 +1625,3338 @@ char* trim_string(char* string) {
     return (string == start) ? string : memmove(start, string, length + 1);
 }
 
-/* Returns true if a given node is inline. It also adds attributes to the node. */
-bool parse_XMLAttributes(XMLDocument* doc, XMLNode* node) {
-    XMLAttribute* attribute = 0;
-    while (doc->buffer[doc->index] != '>') {
-        doc->lexer[doc->lexer_index++] = doc->buffer[doc->index++];
-
-        /* Tag name */
-        if (doc->buffer[doc->index] == ' ' && !node->tag) {
-            doc->lexer[doc->lexer_index] = '\0';
-            node->tag = _strdup(doc->lexer);
-            doc->lexer_index = 0;
-            doc->index++;
-            continue;
-        }
+/* TOKENIZER IMPLEMENTATION */
 
-        /* Ignore whitespace */
-        if (is_whitespace(doc->lexer[doc->lexer_index - 1])) {
-            doc->lexer_index--;
-        }
+/* Stops the tokenizer and reports why. */
+enum XMLTokenType error_XMLToken(XMLDocument* doc, const char* message) {
+    fprintf(stderr, "%s at %zu\n", message, doc->index);
+    doc->state = XMLStateError;
+    return XMLTokenError;
+}
 
-        /* Attribute Key */
-        if (doc->buffer[doc->index] == '=') {
+/* Returns the index of the next '<' or the terminating NUL, or size when there is none before it. */
+size_t scan_XMLText_scalar(const char* buffer, size_t index, size_t size) {
+    while (index < size && buffer[index] != '<' && buffer[index] != '\0')
+        index++;
+    return index;
+}
 
-            attribute = new_XMLAttribute();
+/* Returns the index of the next quote, '\' or the terminating NUL, or size when there is none before it. */
+size_t scan_XMLValue_scalar(const char* buffer, size_t index, size_t size) {
+    while (index < size && buffer[index] != '"' && buffer[index] != '\'' && buffer[index] != '\\' && buffer[index] != '\0')
+        index++;
+    return index;
+}
 
-            /* NULL terminate string then copy it to the attribute */
-            doc->lexer[doc->lexer_index] = '\0';
-            attribute->key = _strdup(doc->lexer);
+#ifdef SXML_SIMD
+/* Returns the position of the lowest set bit of a non zero mask. */
+unsigned int first_XMLBit(unsigned int mask) {
+#ifdef _MSC_VER
+    unsigned long index;
+    _BitScanForward(&index, mask);
+    return (unsigned int)index;
+#else
+    return (unsigned int)__builtin_ctz(mask);
+#endif
+}
 
-            /* Reset lexer */
-            doc->lexer_index = 0;
-            continue;
-        }
+/* Returns the position of the highest set bit of a non zero mask. */
+unsigned int last_XMLBit(unsigned int mask) {
+#ifdef _MSC_VER
+    unsigned long index;
+    _BitScanReverse(&index, mask);
+    return (unsigned int)index;
+#else
+    return 31 - (unsigned int)__builtin_clz(mask);
+#endif
+}
 
-        /* Attribute Value */
-        if (doc->buffer[doc->index] == '"' || doc->buffer[doc->index] == '\'') {
-            if (!attribute->key) {
-                fprintf(stderr, "Value has no key\n");
-                return false;
-            }
+/* Returns a bit for every byte that is 0x20 or 0x09-0x0d, like is_whitespace. */
+unsigned int whitespace_XMLBits(__m128i bytes) {
+    __m128i control = _mm_sub_epi8(bytes, _mm_set1_epi8(0x09));
+    __m128i is_control = _mm_cmpeq_epi8(_mm_min_epu8(control, _mm_set1_epi8(0x04)), control);
+    __m128i is_space = _mm_cmpeq_epi8(bytes, _mm_set1_epi8(0x20));
+    return (unsigned int)_mm_movemask_epi8(_mm_or_si128(is_control, is_space));
+}
 
-            doc->lexer_index = 0;
-            doc->index++;
+/*
+ * The SIMD scanners never read at or after size. Whole blocks are compared while they fit and the
+ * rest is finished by the scalar scanners, so a chunk parsed on another thread is not read either.
+ */
+size_t scan_XMLText_sse2(const char* buffer, size_t index, size_t size) {
+    const __m128i tag = _mm_set1_epi8('<');
+    const __m128i zero = _mm_setzero_si128();
 
-            /* Copy attribute value by looking for end of string either a '"'  or '\'' */
-            while (doc->buffer[doc->index] != '"' && doc->buffer[doc->index] != '\'') {
-                /* Check if the next char is escaped */
-                if (doc->buffer[doc->index] == '\\') {
+    for (; index + 16 <= size; index += 16) {
+        __m128i bytes = _mm_loadu_si128((const __m128i*)(buffer + index));
+        unsigned int mask = (unsigned int)_mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(bytes, tag), _mm_cmpeq_epi8(bytes, zero)));
+        if (mask)
+            return index + first_XMLBit(mask);
+    }
+    return scan_XMLText_scalar(buffer, index, size);
+}
 
-                    /* Copy the escaped character instead of the '\' */
-                    doc->lexer[doc->lexer_index++] = doc->buffer[doc->index + 1];
+size_t scan_XMLValue_sse2(const char* buffer, size_t index, size_t size) {
+    const __m128i double_quote = _mm_set1_epi8('"');
+    const __m128i single_quote = _mm_set1_epi8('\'');
+    const __m128i backslash = _mm_set1_epi8('\\');
+    const __m128i zero = _mm_setzero_si128();
 
-                    /* Skip over the '\' and the escaped character */
-                    doc->index += 2;
-                }
-                else {
-                    doc->lexer[doc->lexer_index++] = doc->buffer[doc->index++];
-                }
-            }
+    for (; index + 16 <= size; index += 16) {
+        __m128i bytes = _mm_loadu_si128((const __m128i*)(buffer + index));
+        unsigned int mask = (unsigned int)_mm_movemask_epi8(_mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi8(bytes, double_quote), _mm_cmpeq_epi8(bytes, single_quote)),
+            _mm_or_si128(_mm_cmpeq_epi8(bytes, backslash), _mm_cmpeq_epi8(bytes, zero))));
+        if (mask)
+            return index + first_XMLBit(mask);
+    }
+    return scan_XMLValue_scalar(buffer, index, size);
+}
 
-            /* NULL terminate and add value to attribute */
-            doc->lexer[doc->lexer_index++] = '\0';
-            attribute->value = _strdup(doc->lexer);
+SXML_AVX2
+size_t scan_XMLText_avx2(const char* buffer, size_t index, size_t size) {
+    const __m256i tag = _mm256_set1_epi8('<');
+    const __m256i zero = _mm256_setzero_si256();
 
-            /* Append attribute to node and reset */
-            append_XMLItem(node->attributes, attribute);
-            doc->lexer_index = 0;
-            doc->index++;
-            continue;
-        }
+    for (; index + 32 <= size; index += 32) {
+        __m256i bytes = _mm256_loadu_si256((const __m256i*)(buffer + index));
+        unsigned int mask = (unsigned int)_mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(bytes, tag), _mm256_cmpeq_epi8(bytes, zero)));
+        if (mask)
+            return index + first_XMLBit(mask);
+    }
+    return scan_XMLText_sse2(buffer, index, size);
+}
+
+SXML_AVX2
+size_t scan_XMLValue_avx2(const char* buffer, size_t index, size_t size) {
+    const __m256i double_quote = _mm256_set1_epi8('"');
+    const __m256i single_quote = _mm256_set1_epi8('\'');
+    const __m256i backslash = _mm256_set1_epi8('\\');
+    const __m256i zero = _mm256_setzero_si256();
+
+    for (; index + 32 <= size; index += 32) {
+        __m256i bytes = _mm256_loadu_si256((const __m256i*)(buffer + index));
+        unsigned int mask = (unsigned int)_mm256_movemask_epi8(_mm256_or_si256(
+            _mm256_or_si256(_mm256_cmpeq_epi8(bytes, double_quote), _mm256_cmpeq_epi8(bytes, single_quote)),
+            _mm256_or_si256(_mm256_cmpeq_epi8(bytes, backslash), _mm256_cmpeq_epi8(bytes, zero))));
+        if (mask)
+            return index + first_XMLBit(mask);
+    }
+    return scan_XMLValue_sse2(buffer, index, size);
+}
 
-        /* In case attribute does not have a value */
-        char previous = doc->buffer[doc->index];
-        char current = doc->buffer[doc->index + 1];
+/* Returns true if the CPU and the OS support AVX2. */
+bool has_XMLAvx2(void) {
+#ifdef _MSC_VER
+    int info[4];
+    __cpuid(info, 0);
+    if (info[0] < 7)
+        return false;
 
-        if ((previous == ' ' || current == '>' || current == '/')
-            && node->tag && doc->lexer_index > 0) {
+    /* AVX with OSXSAVE, and the OS saves the ymm registers */
+    __cpuid(info, 1);
+    if (!(info[2] & (1 << 27)) || !(info[2] & (1 << 28)) || (_xgetbv(0) & 6) != 6)
+        return false;
 
-            attribute = new_XMLAttribute();
+    __cpuidex(info, 7, 0);
+    return (info[1] & (1 << 5)) != 0;
+#else
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+#endif
+}
+#endif
 
-            /* Copy the last character in cases where the attribute is at the end of the node */
-            if (current == '>' || current == '/') {
-                doc->lexer[doc->lexer_index] = doc->buffer[doc->index];
-                doc->lexer[doc->lexer_index + 1] = '\0';
-            }
-            else doc->lexer[doc->lexer_index] = '\0';
+/* Scanners for the running CPU, picked once by select_XMLScanners */
+size_t (*SXML_SCAN_TEXT)(const char* buffer, size_t index, size_t size);
+size_t (*SXML_SCAN_VALUE)(const char* buffer, size_t index, size_t size);
+#ifdef SXML_THREADS
+pthread_once_t SXML_SCANNERS_ONCE = PTHREAD_ONCE_INIT;
+#endif
 
-            /* Set attribute key */
-            attribute->key = _strdup(doc->lexer);
+void pick_XMLScanners(void) {
+#ifdef SXML_SIMD
+    if (has_XMLAvx2()) {
+        SXML_SCAN_VALUE = scan_XMLValue_avx2;
+        SXML_SCAN_TEXT = scan_XMLText_avx2;
+        return;
+    }
+    SXML_SCAN_VALUE = scan_XMLValue_sse2;
+    SXML_SCAN_TEXT = scan_XMLText_sse2;
+#else
+    SXML_SCAN_VALUE = scan_XMLValue_scalar;
+    SXML_SCAN_TEXT = scan_XMLText_scalar;
+#endif
+}
 
-            /* Append attribute to node and reset */
-            append_XMLItem(node->attributes, attribute);
-            doc->lexer_index = 0;
-            doc->index++;
-            continue;
-        }
+/*
+ * Picks the scanners once, every scan calls it first. Without SXML_THREADS there is no lock,
+ * call it once by hand before parsing from several threads.
+ */
+void select_XMLScanners(void) {
+#ifdef SXML_THREADS
+    pthread_once(&SXML_SCANNERS_ONCE, pick_XMLScanners);
+#else
+    if (!SXML_SCAN_TEXT || !SXML_SCAN_VALUE)
+        pick_XMLScanners();
+#endif
+}
+
+/* Returns the index of the next '<' or the terminating NUL, reading no further than size. */
+size_t scan_XMLText(const char* buffer, size_t index, size_t size) {
+    select_XMLScanners();
+    return SXML_SCAN_TEXT(buffer, index, size);
+}
+
+/* Returns the index of the next quote, '\' or the terminating NUL, reading no further than size. */
+size_t scan_XMLValue(const char* buffer, size_t index, size_t size) {
+    select_XMLScanners();
+    return SXML_SCAN_VALUE(buffer, index, size);
+}
+
+/* Returns the index of the first character after a tag name or attribute key. */
+size_t scan_XMLName(const char* buffer, size_t index) {
+    while (!is_whitespace(buffer[index]) && buffer[index] != '=' && buffer[index] != '/'
+        && buffer[index] != '>' && buffer[index] != '?' && buffer[index] != '\0')
+        index++;
+    return index;
+}
 
-        /* Inline node */
-        if (doc->buffer[doc->index - 1] == '/' && doc->buffer[doc->index] == '>') {
-            /* Terminate the tag index-1 since we don't want '/' in the tag */
-            doc->lexer[doc->lexer_index - 1] = '\0';
+/* Returns the first occurrence of marker in the first length bytes of data, or NULL. */
+char* find_XMLString(const char* data, size_t length, const char* marker) {
+    size_t marker_length = strlen(marker);
+    const char* end = data + length;
 
-            /* Ensure the tag is not already set */
-            if (!node->tag)
-                node->tag = _strdup(doc->lexer);
+    while ((size_t)(end - data) >= marker_length) {
+        data = memchr(data, marker[0], (size_t)(end - data) - marker_length + 1);
+        if (!data)
+            return NULL;
+        if (!memcmp(data, marker, marker_length))
+            return (char*)data;
+        data++;
+    }
+    return NULL;
+}
+
+/*
+ * Moves index past a "<!" node that is not a comment or CDATA, like <!DOCTYPE>, including quoted literals and an internal subset in '[' ']'.
+ * index points after '<'. Returns false if the node is unterminated.
+ */
+bool skip_XMLDoctype(const char* buffer, size_t* index, size_t size) {
+    size_t i = *index;
+    bool subset = false;
+    for (;;) {
+        i += strcspn(buffer + i, subset ? "\"'<]" : "\"'[>");
+        if (buffer[i] == '\0')
+            return false;
 
-            /* Reset lexer and return */
-            doc->index++;
-            doc->lexer_index = 0;
+        /* Quoted literals may contain '[', ']' and '>' */
+        if (buffer[i] == '"' || buffer[i] == '\'') {
+            const char* end = memchr(buffer + i + 1, buffer[i], size - i - 1);
+            if (!end)
+                return false;
+            i = (size_t)(end - buffer) + 1;
+        }
+        /* Comments of the internal subset may contain quotes */
+        else if (buffer[i] == '<') {
+            if (strncmp(buffer + i, "<!--", 4) != 0) {
+                i++;
+                continue;
+            }
+            const char* end = find_XMLString(buffer + i + 4, size - i - 4, "-->");
+            if (!end)
+                return false;
+            i = (size_t)(end - buffer) + 3;
+        }
+        else if (buffer[i] == '[' || buffer[i] == ']') {
+            subset = buffer[i] == '[';
+            i++;
+        }
+        else {
+            *index = i + 1;
             return true;
         }
     }
-    return false;
 }
 
-/* Returns root node on success, on failure NULL ptr is returned */
-XMLNode* parse_xml(XMLDocument* doc) {
-    SXML_NODES = new_XMLList();
-    SXML_ATTRIBUTES = new_XMLList();
-    SXML_TEXT = new_XMLList();
+/* Consumes the delimiter after a name so the name can be NUL terminated in place. */
+bool skip_XMLDelimiter(XMLDocument* doc, size_t index) {
+    char* buffer = doc->buffer;
+    if (is_whitespace(buffer[index])) {
+        doc->index = index + 1;
+        doc->state = XMLStateAttributes;
+    }
+    else if (buffer[index] == '>') {
+        doc->index = index + 1;
+        doc->state = XMLStateContent;
+    }
+    else if ((buffer[index] == '/' || buffer[index] == '?') && buffer[index + 1] == '>') {
+        /* Inline nodes still owe their end element */
+        doc->state = buffer[index] == '/' ? XMLStateInline : XMLStateContent;
+        doc->index = index + 2;
+    }
+    else return false;
+    return true;
+}
 
-    XMLNode* root = new_XMLNode(NULL);
-    XMLNode* node = root;
-    while (doc->buffer[doc->index] != '\0' && doc->index < doc->file_size) {
+/* Reads the next attribute of the current tag. Returns XMLTokenNone when the tag is closed. */
+enum XMLTokenType scan_XMLAttribute(XMLDocument* doc, XMLToken* token) {
+    char* buffer = doc->buffer;
+    size_t index = doc->index;
 
-        /* Tag start */
-        if (doc->buffer[doc->index] == '<') {
+    while (is_whitespace(buffer[index]))
+        index++;
 
-            /* Append inner_text to XMLNode OK */
-            if (doc->lexer_index > 0) {
-                if (!node) {
-                    fprintf(stderr, "Text outside of document\n");
-                    return NULL;
-                }
+    /* End of tag */
+    if ((buffer[index] == '>' || buffer[index] == '/' || buffer[index] == '?') && skip_XMLDelimiter(doc, index))
+        return XMLTokenNone;
 
-                doc->lexer[doc->lexer_index] = '\0';
-                char* string = trim_string(doc->lexer);
+    /* Attribute key */
+    size_t start = index;
+    index = scan_XMLName(buffer, index);
+    if (index == start) {
+        doc->index = index;
+        return error_XMLToken(doc, buffer[index] == '\0' ? "Unterminated tag" : "Value has no key");
+    }
 
-                if (strlen(string) > 0) {
-                    XMLValue* text = new_XMLValue(_strdup(string), XMLTypeText);
-                    append_XMLItem(node->inner_xml, text);
-                    append_XMLItem(SXML_TEXT, text->value);
-                }
-                doc->lexer_index = 0;
-            }
+    token->type = XMLTokenAttribute;
+    token->name.data = buffer + start;
+    token->name.length = index - start;
+    token->value.data = NULL;
+    token->value.length = 0;
+    token->escaped = false;
 
-            /* End of node */
-            if (doc->buffer[doc->index + 1] == '/') {
+    /* In case attribute does not have a value */
+    size_t end = index;
+    while (is_whitespace(buffer[index]))
+        index++;
+    if (buffer[index] != '=') {
+        doc->index = index;
+        if (index == end && !skip_XMLDelimiter(doc, index))
+            return error_XMLToken(doc, "Unterminated tag");
+        return XMLTokenAttribute;
+    }
 
-                /* skip /> */
-                doc->index += 2;
+    /* Attribute value either in '"' or '\'' */
+    index++;
+    while (is_whitespace(buffer[index]))
+        index++;
+    if (buffer[index] != '"' && buffer[index] != '\'') {
+        doc->index = index;
+        return error_XMLToken(doc, "Attribute value is not quoted");
+    }
 
-                /* Get tag name */
-                while (doc->buffer[doc->index] != '>')
-                    doc->lexer[doc->lexer_index++] = doc->buffer[doc->index++];
-                doc->lexer[doc->lexer_index] = '\0';
+    /* Look for the end of string and skip over escaped characters */
+    start = ++index;
+    for (;;) {
+        index = scan_XMLValue(buffer, index, doc->file_size);
+        if (buffer[index] != '\\' || buffer[index + 1] == '\0')
+            break;
+        token->escaped = true;
+        index += 2;
+    }
+    if (buffer[index] != '"' && buffer[index] != '\'') {
+        doc->index = index;
+        return error_XMLToken(doc, "Unterminated attribute value");
+    }
 
-                /* Reached root. Free file and return root */
-                if (node == root) {
-                    free_file(doc);
-                    if (root->children->count > 0) {
-                        ((XMLNode*)root->children->items[0])->parent = NULL;
-                        return root->children->items[0];
-                    }
-                    return node;
-                }
+    token->value.data = buffer + start;
+    token->value.length = index - start;
+    doc->index = index + 1;
+    return XMLTokenAttribute;
+}
 
-                /* Check if tag matches */
-                if (node->tag == NULL || strcmp(node->tag, doc->lexer) != 0) {
-                    fprintf(stderr, "Mismatched tags (%s != %s)\n", node->tag, doc->lexer);
-                    return NULL;
-                }
+/* Reads the markup after '<'. Returns XMLTokenNone for markup that is skipped. */
+enum XMLTokenType scan_XMLTag(XMLDocument* doc, XMLToken* token) {
+    char* buffer = doc->buffer;
+    size_t index = doc->index;
+    size_t start;
 
-                /* Take a step back to nodes parent */
-                node = node->parent;
-                doc->lexer_index = 0;
-                doc->index++;
-                continue;
-            }
+    /* End of node */
+    if (buffer[index] == '/') {
+        start = ++index;
+        index = scan_XMLName(buffer, index);
 
-            /* Special node */
-            if (doc->buffer[doc->index + 1] == '!') {
-                /* Copy start of special node */
-                while (doc->buffer[doc->index] != ' ' && doc->buffer[doc->index] != '>')
-                    doc->lexer[doc->lexer_index++] = doc->buffer[doc->index++];
-                doc->lexer[doc->lexer_index] = '\0';
+        token->type = XMLTokenEndElement;
+        token->name.data = buffer + start;
+        token->name.length = index - start;
 
-                /* Check if special node is a comment */
-                if (!strcmp(doc->lexer, "<!--")) {
-                    doc->lexer[doc->lexer_index] = '\0';
+        while (is_whitespace(buffer[index]))
+            index++;
+        doc->index = index;
+        if (buffer[index] != '>')
+            return error_XMLToken(doc, "Unterminated closing tag");
 
-                    /* Check if we have reached the end of the comment */
-                    while (!ends_with(doc->lexer, "-->")) {
-                        doc->lexer[doc->lexer_index++] = doc->buffer[doc->index++];
-                        doc->lexer[doc->lexer_index] = '\0';
-                    }
-                    doc->lexer_index = 0;
-                    continue;
-                }
-            }
+        doc->index++;
+        doc->state = XMLStateContent;
+        return XMLTokenEndElement;
+    }
 
-            /* Declaration tag */
-            if (doc->buffer[doc->index + 1] == '?') {
-                /* Copy declaration tag name and NULL terminate */
-                while (doc->buffer[doc->index] != ' ' && doc->buffer[doc->index] != '>') {
-                    doc->lexer[doc->lexer_index++] = doc->buffer[doc->index++];
-                }
-                doc->lexer[doc->lexer_index] = '\0';
+    /* Comment and CDATA are found with memchr, so skipping them is a linear scan */
+    bool comment = !strncmp(buffer + index, "!--", 3);
+    if (comment || !strncmp(buffer + index, "![CDATA[", 8)) {
+        start = index + (comment ? 3 : 8);
+        char* end = find_XMLString(buffer + start, doc->file_size - start, comment ? "-->" : "]]>");
+        if (!end)
+            return error_XMLToken(doc, comment ? "Unterminated comment" : "Unterminated CDATA");
 
-                /* Check if we have a xml declaration tag */
-                if (!strcmp(doc->lexer, "<?xml")) {
-                    doc->lexer_index = 0;
+        token->type = comment ? XMLTokenComment : XMLTokenCData;
+        token->value.data = buffer + start;
+        token->value.length = (size_t)(end - token->value.data);
 
-                    /* Create xml node and parse attributes */
-                    XMLNode* declaration = new_XMLNode(NULL);
-                    parse_XMLAttributes(doc, declaration);
+        doc->index = (size_t)(end - buffer) + 3;
+        if (comment)
+            SXML_COUNT(doc, skipped, doc->index - index + 1);
+        doc->state = XMLStateContent;
+        return token->type;
+    }
 
-                    /* Set the attributes of xml document */
-                    doc->info = declaration->attributes;
+    /* DOCTYPE and other special nodes are skipped */
+    if (buffer[index] == '!') {
+        if (!skip_XMLDoctype(buffer, &doc->index, doc->file_size))
+            return error_XMLToken(doc, "Unterminated special node");
+        SXML_COUNT(doc, skipped, doc->index - index + 1);
 
-                    /* Skip "?>" */
-                    doc->index++;
-                    doc->lexer_index = 0;
+        doc->state = XMLStateContent;
+        return XMLTokenNone;
+    }
 
-                    continue;
-                }
-            }
+    /* Declaration tag */
+    if (buffer[index] == '?') {
+        start = ++index;
+        index = scan_XMLName(buffer, index);
 
-            /* Set current node */
-            node = new_XMLNode(node);
+        /* Only the xml declaration is kept, processing instructions are skipped */
+        if (index - start != 3 || strncmp(buffer + start, "xml", 3) != 0) {
+            char* end = find_XMLString(buffer + index, doc->file_size - index, "?>");
+            if (!end)
+                return error_XMLToken(doc, "Unterminated processing instruction");
 
-            /* Start tag */
-            doc->index++;
+            doc->index = (size_t)(end - buffer) + 2;
+            doc->state = XMLStateContent;
+            SXML_COUNT(doc, skipped, doc->index - start + 2);
+            return XMLTokenNone;
+        }
 
-            /* In case we have the inline node go back to parent immediately */
-            if (parse_XMLAttributes(doc, node)) {
-                node = node->parent;
-                doc->lexer_index = 0;
-                doc->index++;
-                continue;
+        token->type = XMLTokenDeclaration;
+        token->name.data = buffer + start;
+        token->name.length = index - start;
+        doc->tag = token->name;
+
+        if (!skip_XMLDelimiter(doc, index))
+            return error_XMLToken(doc, "Unterminated declaration");
+        return XMLTokenDeclaration;
+    }
+
+    /* Start tag */
+    start = index;
+    index = scan_XMLName(buffer, index);
+    doc->index = index;
+    if (index == start)
+        return error_XMLToken(doc, "Missing tag name");
+
+    token->type = XMLTokenStartElement;
+    token->name.data = buffer + start;
+    token->name.length = index - start;
+    doc->tag = token->name;
+
+    if (!skip_XMLDelimiter(doc, index))
+        return error_XMLToken(doc, "Unterminated tag");
+    return XMLTokenStartElement;
+}
+
+/*
+ * Reads the next token of the document.
+ * Every view of a returned token ends before doc->index, so it can be NUL terminated in place.
+ */
+enum XMLTokenType next_XMLToken(XMLDocument* doc, XMLToken* token) {
+    char* buffer = doc->buffer;
+    enum XMLTokenType type;
+
+    for (;;) {
+        switch (doc->state) {
+        case XMLStateError:
+            token->type = XMLTokenError;
+            return XMLTokenError;
+
+        case XMLStateInline:
+            /* Inline nodes end with their own tag */
+            doc->state = XMLStateContent;
+            token->type = XMLTokenEndElement;
+            token->name = doc->tag;
+            return XMLTokenEndElement;
+
+        case XMLStateAttributes:
+            type = scan_XMLAttribute(doc, token);
+            if (type != XMLTokenNone)
+                return type;
+            break;
+
+        case XMLStateTag:
+            type = scan_XMLTag(doc, token);
+            if (type != XMLTokenNone)
+                return type;
+            break;
+
+        case XMLStateContent:
+            if (doc->index >= doc->file_size || buffer[doc->index] == '\0') {
+                token->type = XMLTokenNone;
+                return XMLTokenNone;
             }
 
-            /* Set tag if not set */
-            doc->lexer[doc->lexer_index] = '\0';
-            if (node->tag == NULL) {
-                node->tag = _strdup(doc->lexer);
+            /* Tag start */
+            if (buffer[doc->index] == '<') {
+                doc->index++;
+                doc->state = XMLStateTag;
+                break;
             }
 
-            /* Reset lexer */
-            doc->lexer_index = 0;
-            doc->index++;
-            continue;
-        }
-        else {
+            /* Inner text runs until the next tag, which is consumed so the text can be terminated */
+            size_t start = doc->index;
+            size_t end = scan_XMLText(buffer, start, doc->file_size);
 
-            /* Increase lexer_size if inner_text is greater than lexer_size */
-            if (doc->lexer_index >= doc->lexer_size) {
-                doc->lexer_size += EXPAND_LEXER_SIZE;
-                doc->lexer = realloc(doc->lexer, sizeof(char) * doc->lexer_size);
-                if (!doc->lexer) {
-                    fprintf(stderr, "Unable to reallocate lexer\n");
-                    exit(1);
-                }
+            token->type = XMLTokenText;
+            token->value.data = buffer + start;
+            token->value.length = end - start;
+
+            doc->index = end;
+            if (buffer[end] == '<') {
+                doc->index++;
+                doc->state = XMLStateTag;
             }
+            return XMLTokenText;
+        }
+    }
+}
+
+
+/* SKIPPING */
+
+/* Moves index past the '>' that closes the current tag, quoted values may contain '>'. Returns false if the tag is unterminated. */
+bool skip_XMLTag(const char* buffer, size_t* index, size_t size, bool* inline_node) {
+    size_t i = *index;
+    for (;;) {
+        if (buffer[i] == '\0')
+            return false;
 
-            /* Ensure lexer is not a null ptr */
-            if (!doc->lexer) {
-                fprintf(stderr, "Lexer is null ptr\n");
-                exit(1);
+        if (buffer[i] == '"' || buffer[i] == '\'') {
+            i++;
+            for (;;) {
+                i = scan_XMLValue(buffer, i, size);
+                if (buffer[i] != '\\' || buffer[i + 1] == '\0')
+                    break;
+                i += 2;
             }
+            if (buffer[i] == '\0' || buffer[i] == '\\')
+                return false;
+            i++;
+            continue;
+        }
 
-            /* Add inner_text to lexer */
-            doc->lexer[doc->lexer_index++] = doc->buffer[doc->index++];
-            char char1 = doc->lexer[doc->lexer_index - 1];
-            char char2 = doc->lexer[doc->lexer_index - 2];
-            if (is_whitespace(char1) && is_whitespace(char2)) doc->lexer_index--;
+        if (buffer[i] == '>') {
+            *inline_node = i > 0 && buffer[i - 1] == '/';
+            *index = i + 1;
+            return true;
         }
+        i++;
+    }
+}
+
+/* Moves index past a comment, CDATA, DOCTYPE or processing instruction. index points after '<'. */
+bool skip_XMLSpecial(const char* buffer, size_t* index, size_t size) {
+    const char* marker;
+    size_t start = *index;
+
+    if (!strncmp(buffer + start, "!--", 3)) {
+        marker = "-->";
+        start += 3;
+    }
+    else if (!strncmp(buffer + start, "![CDATA[", 8)) {
+        marker = "]]>";
+        start += 8;
+    }
+    else if (buffer[start] == '?')
+        marker = "?>";
+    else return skip_XMLDoctype(buffer, index, size);
+
+    const char* end = find_XMLString(buffer + start, size - start, marker);
+    if (!end)
+        return false;
+    *index = (size_t)(end - buffer) + strlen(marker);
+    return true;
+}
+
+/*
+ * Moves index from the content of an element past its end tag by counting depth instead of tokenizing.
+ * Returns false if the element is unterminated.
+ */
+bool skip_XMLElement(const char* buffer, size_t* index, size_t size) {
+    size_t i = *index;
+    size_t depth = 1;
+    bool inline_node;
+
+    for (;;) {
+        i = scan_XMLText(buffer, i, size);
+        if (buffer[i] == '\0')
+            return false;
+        i++;
+
+        /* End of node */
+        if (buffer[i] == '/') {
+            const char* end = memchr(buffer + i, '>', size - i);
+            if (!end)
+                return false;
+            i = (size_t)(end - buffer) + 1;
+            if (--depth == 0) {
+                *index = i;
+                return true;
+            }
+            continue;
+        }
+
+        /* Comments, CDATA, declarations and other special nodes */
+        if (buffer[i] == '!' || buffer[i] == '?') {
+            if (!skip_XMLSpecial(buffer, &i, size))
+                return false;
+            continue;
+        }
+
+        /* Start tag */
+        if (!skip_XMLTag(buffer, &i, size, &inline_node))
+            return false;
+        if (!inline_node)
+            depth++;
+    }
+}
+
+
+/* STRING DECODING */
+
+/* Removes '\' from escaped characters. dst may be src. Returns the new length. */
+size_t unescape_XMLValue(char* dst, const char* src, size_t length) {
+    size_t out = 0;
+    for (size_t i = 0; i < length; i++) {
+        if (src[i] == '\\' && i + 1 < length)
+            i++;
+        dst[out++] = src[i];
+    }
+    return out;
+}
+
+/* Returns the amount of leading whitespace. */
+size_t skip_XMLWhitespace(const char* data, size_t length) {
+    size_t i = 0;
+#ifdef SXML_SIMD
+    for (; i + 16 <= length; i += 16) {
+        unsigned int other = ~whitespace_XMLBits(_mm_loadu_si128((const __m128i*)(data + i))) & 0xffff;
+        if (other)
+            return i + first_XMLBit(other);
+    }
+#endif
+    while (i < length && is_whitespace(data[i]))
+        i++;
+    return i;
+}
+
+/*
+ * Collapses runs of whitespace to their first character and drops trailing whitespace in one pass.
+ * dst may be src. Returns the new length.
+ */
+size_t collapse_XMLWhitespace(char* dst, const char* src, size_t length) {
+    size_t out = 0;
+    size_t end = 0;
+    size_t i = 0;
+    bool whitespace = false;
+
+#ifdef SXML_SIMD
+    while (i + 16 <= length) {
+        __m128i bytes = _mm_loadu_si128((const __m128i*)(src + i));
+        unsigned int bits = whitespace_XMLBits(bytes);
+
+        /* Blocks without a run are stored as they are, the block is loaded before dst can overwrite it */
+        if (!(bits & ((bits << 1) | whitespace) & 0xffff)) {
+            _mm_storeu_si128((__m128i*)(dst + out), bytes);
+            unsigned int other = ~bits & 0xffff;
+            if (other)
+                end = out + last_XMLBit(other) + 1;
+            whitespace = (bits >> 15) & 1;
+            out += 16;
+            i += 16;
+            continue;
+        }
+
+        for (size_t stop = i + 16; i < stop; i++) {
+            bool current = is_whitespace(src[i]);
+            if (current && whitespace)
+                continue;
+            whitespace = current;
+            dst[out++] = src[i];
+            if (!current)
+                end = out;
+        }
+    }
+#endif
+
+    for (; i < length; i++) {
+        bool current = is_whitespace(src[i]);
+        if (current && whitespace)
+            continue;
+        whitespace = current;
+        dst[out++] = src[i];
+        if (!current)
+            end = out;
+    }
+    return end;
+}
+
+/*
+ * Returns a NUL terminated copy of the view, or the view itself terminated in place when parsing in situ.
+ * The copies return NULL and set XMLStateError when out of memory.
+ */
+char* copy_XMLView(XMLDocument* doc, XMLView view) {
+    char* string = view.data;
+    if (!(doc->options & XMLOptionInSitu)) {
+        string = alloc_XMLMemory(doc, view.length + 1, XMLMemoryText);
+        if (!string)
+            return NULL;
+        memcpy(string, view.data, view.length);
+    }
+    string[view.length] = '\0';
+    return string;
+}
+
+/* Returns a tag or key, interned when the document has a symbol table. */
+char* copy_XMLName(XMLDocument* doc, XMLView view) {
+    if (doc->symbols) {
+        char* string = (char*)intern_XMLSymbol(doc->symbols, view.data, view.length);
+        return string ? string : fail_XMLMemory(doc);
+    }
+    return copy_XMLView(doc, view);
+}
+
+/* Returns the attribute value of a token with its escapes removed. */
+char* copy_XMLValue(XMLDocument* doc, XMLToken* token) {
+    /* Only values containing escapes have to be rewritten */
+    if (!token->escaped)
+        return copy_XMLView(doc, token->value);
+
+    char* string = token->value.data;
+    if (!(doc->options & XMLOptionInSitu) && !(string = alloc_XMLMemory(doc, token->value.length + 1, XMLMemoryText)))
+        return NULL;
+
+    size_t length = unescape_XMLValue(string, token->value.data, token->value.length);
+    string[length] = '\0';
+    return string;
+}
+
+/*
+ * Returns trimmed inner text with collapsed whitespace, or NULL if the text is only whitespace.
+ * With XMLOptionPreserveWhitespace the text is returned as it is.
+ */
+char* copy_XMLText(XMLDocument* doc, XMLView view) {
+    if (doc->options & XMLOptionPreserveWhitespace)
+        return copy_XMLView(doc, view);
+
+    /* Skip leading whitespace before copying so whitespace between tags costs nothing */
+    size_t start = skip_XMLWhitespace(view.data, view.length);
+    if (start == view.length)
+        return NULL;
+
+    char* string = view.data + start;
+    size_t length = view.length - start;
+    if (!(doc->options & XMLOptionInSitu) && !(string = alloc_XMLMemory(doc, length + 1, XMLMemoryText)))
+        return NULL;
+
+    length = collapse_XMLWhitespace(string, view.data + start, length);
+    string[length] = '\0';
+    return string;
+}
+
+
+/* PARSE STATS IMPLEMENTATION */
+#ifdef SXML_STATS
+/* Returns nanoseconds of a monotonic clock. */
+uint64_t read_XMLClock(void) {
+#ifdef _WIN32
+    return (uint64_t)clock() * (1000000000 / CLOCKS_PER_SEC);
+#else
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (uint64_t)time.tv_sec * 1000000000 + (uint64_t)time.tv_nsec;
+#endif
+}
+
+void start_XMLParseStats(XMLDocument* doc) {
+    memset(&doc->parse, 0, sizeof(XMLParseStats));
+    doc->parse.start = doc->index;
+    doc->parse.lap = read_XMLClock();
+}
+
+/* Adds the time since the last lap to total. */
+void lap_XMLParseStats(XMLDocument* doc, uint64_t* total) {
+    uint64_t now = read_XMLClock();
+    *total += now - doc->parse.lap;
+    doc->parse.lap = now;
+}
+
+/* Counts the bytes parsed, before free_file resets the index. */
+void stop_XMLParseStats(XMLDocument* doc) {
+    doc->parse.bytes = doc->index - doc->parse.start;
+}
+#endif
+
+
+/* PARSER IMPLEMENTATION */
+
+/* Returns true if a given node is inline. It also adds attributes to the node. */
+bool parse_XMLAttributes(XMLDocument* doc, XMLNode* node) {
+    XMLToken token;
+    while (doc->state == XMLStateAttributes && scan_XMLAttribute(doc, &token) == XMLTokenAttribute) {
+        /* Failed allocations set XMLStateError, the attribute is freed with the document */
+        XMLAttribute* attribute = new_XMLAttribute(doc);
+        if (!attribute || !(attribute->key = copy_XMLName(doc, token.name)))
+            break;
+        if (token.value.data && !(attribute->value = copy_XMLValue(doc, &token)))
+            break;
+        if (!append_XMLItem(doc, node->attributes, attribute))
+            break;
+        SXML_COUNT(doc, attributes, 1);
+    }
+    if (doc->state == XMLStateError)
+        return false;
+    index_XMLAttributes(doc, node);
+
+    /* The end element of an inline node is implied */
+    if (doc->state == XMLStateInline) {
+        doc->state = XMLStateContent;
+        return true;
+    }
+    return false;
+}
+
+/* Returns the pending regions of a node, made on first use. Returns NULL when out of memory. */
+XMLPending* get_XMLPending(XMLDocument* doc, XMLNode* node) {
+    if (!node->pending) {
+        /* Failed allocations set XMLStateError, the node is freed with the document */
+        XMLPending* pending = alloc_XMLMemory(doc, sizeof(XMLPending), XMLMemoryOther);
+        if (!pending)
+            return NULL;
+        pending->doc = doc->parent ? doc->parent : doc;
+        pending->attributes = 0;
+        pending->content = 0;
+        node->pending = pending;
+    }
+    return node->pending;
+}
+
+/* Frees the pending regions of a node once all of them are parsed. */
+void settle_XMLPending(XMLNode* node) {
+    XMLPending* pending = node->pending;
+    if (pending && !pending->attributes && !pending->content) {
+        node->pending = NULL;
+        free_XMLMemory(pending->doc, pending);
+    }
+}
+
+/* Records where the attributes of the current tag start and skips them. Returns true for inline nodes. */
+bool defer_XMLAttributes(XMLDocument* doc, XMLNode* node) {
+    if (doc->state == XMLStateAttributes) {
+        size_t start = doc->index;
+        bool inline_node;
+        if (!skip_XMLTag(doc->buffer, &doc->index, doc->file_size, &inline_node)) {
+            error_XMLToken(doc, "Unterminated tag");
+            return false;
+        }
+        doc->state = inline_node ? XMLStateInline : XMLStateContent;
+
+        XMLPending* pending = get_XMLPending(doc, node);
+        if (!pending)
+            return false;
+        pending->attributes = start;
+    }
+
+    if (doc->state == XMLStateInline) {
+        doc->state = XMLStateContent;
+        return true;
+    }
+    return false;
+}
+
+/*
+ * Splits, unescapes and stores the attributes of a node parsed with XMLOptionLazyAttributes, once.
+ * Decoding changes the document, so the nodes of a document must not be decoded from several threads at once.
+ * Returns false when the attributes are malformed or out of memory, the node keeps the ones before.
+ */
+bool decode_XMLAttributes(XMLNode* node) {
+    XMLPending* pending = node->pending;
+    if (!pending || !pending->attributes)
+        return true;
+
+    /* The region is read like the rest of the current tag, the parser is left where it was */
+    XMLDocument* doc = pending->doc;
+    size_t index = doc->index;
+    enum XMLState state = doc->state;
+    doc->index = pending->attributes;
+    doc->state = XMLStateAttributes;
+    pending->attributes = 0;
+    parse_XMLAttributes(doc, node);
+    bool success = doc->state != XMLStateError;
+    doc->index = index;
+    doc->state = state;
+
+    settle_XMLPending(node);
+    return success;
+}
+
+/* Records where the content of the current element starts and skips past its end tag by counting depth. */
+bool defer_XMLChildren(XMLDocument* doc, XMLNode* node) {
+    size_t start = doc->index;
+    if (!skip_XMLElement(doc->buffer, &doc->index, doc->file_size)) {
+        error_XMLToken(doc, "Unterminated element");
+        return false;
+    }
+
+    XMLPending* pending = get_XMLPending(doc, node);
+    if (!pending)
+        return false;
+    pending->content = start;
+    return true;
+}
+
+/* Sets up where the nodes of the document are allocated and how they are tracked. Returns false when out of memory. */
+bool prepare_XMLTree(XMLDocument* doc) {
+    /* Arena documents own their memory, heap documents track it for free_XMLDocument */
+    if (doc->options & (XMLOptionArena | XMLOptionInSitu)) {
+        if (!doc->arena)
+            doc->arena = new_XMLArena(&doc->allocator, &doc->stats);
+        if (!doc->arena) {
+            fail_XMLMemory(doc);
+            return false;
+        }
+    }
+    else if (!doc->nodes) {
+        if (!(doc->nodes = new_XMLList(doc)) || !(doc->attributes = new_XMLList(doc)) || !(doc->text = new_XMLList(doc)))
+            return false;
+    }
+
+    if ((doc->options & XMLOptionIntern) && !doc->symbols && !(doc->symbols = new_XMLSymbols(doc, false))) {
+        fail_XMLMemory(doc);
+        return false;
+    }
+
+    /* Everything below the root is on every path */
+    if (doc->projection) {
+        if (!doc->projected) {
+            doc->projected_size = PROJECTION_STACK_SIZE;
+            if (!(doc->projected = alloc_XMLHeap(doc, sizeof(uint64_t) * doc->projected_size, XMLMemoryOther)))
+                return false;
+        }
+        doc->projected[0] = ((uint64_t)1 << doc->projection->count) - 1;
+        doc->projected_count = 1;
+    }
+    if ((doc->options & XMLOptionTagIndex) && !doc->tag_index)
+        doc->tag_index = new_XMLTagIndex(doc);
+    return doc->state != XMLStateError;
+}
+
+/* Returns the paths of the projection an element with tag is on, given the paths of its parent. */
+uint64_t match_XMLProjection(XMLDocument* doc, XMLView tag) {
+    uint64_t whole = (uint64_t)1 << PROJECTION_PATHS;
+    uint64_t parent = doc->projected[doc->projected_count - 1];
+    if (parent & whole)
+        return whole;
+
+    /* An element at depth is on a path when the step of that depth matches */
+    size_t depth = doc->projected_count - 1;
+    uint64_t paths = 0;
+    for (size_t i = 0; i < doc->projection->count; i++) {
+        if (!(parent >> i & 1))
+            continue;
+        const XMLQuery* path = doc->projection->paths[i];
+        const char* step = path->steps[depth].tag;
+        if (step && (strncmp(step, tag.data, tag.length) != 0 || step[tag.length] != '\0'))
+            continue;
+        paths |= depth + 1 == path->step_count ? whole : (uint64_t)1 << i;
+    }
+    return paths;
+}
+
+/* Returns true when text at the current element is built, which is only inside the whole subtrees of a projection. */
+bool is_XMLProjected(XMLDocument* doc) {
+    return !doc->projection || doc->projected[doc->projected_count - 1] >> PROJECTION_PATHS;
+}
+
+/* Skips the rest of the current start tag and the content of its element without allocating. */
+bool skip_XMLContent(XMLDocument* doc) {
+    bool inline_node = doc->state == XMLStateInline;
+    if (doc->state == XMLStateAttributes && !skip_XMLTag(doc->buffer, &doc->index, doc->file_size, &inline_node)) {
+        error_XMLToken(doc, "Unterminated tag");
+        return false;
+    }
+    doc->state = XMLStateContent;
+    if (!inline_node && !skip_XMLElement(doc->buffer, &doc->index, doc->file_size)) {
+        error_XMLToken(doc, "Unterminated element");
+        return false;
+    }
+    return true;
+}
+
+/* Opens an element on the paths of a projection. Returns false when out of memory. */
+bool push_XMLProjection(XMLDocument* doc, uint64_t paths) {
+    if (doc->projected_count == doc->projected_size) {
+        uint64_t* grown = realloc_XMLHeap(doc, doc->projected, sizeof(uint64_t) * doc->projected_size * 2, XMLMemoryOther);
+        if (!grown)
+            return false;
+        doc->projected = grown;
+        doc->projected_size *= 2;
+    }
+    doc->projected[doc->projected_count++] = paths;
+    return true;
+}
+
+/* Takes an ancestor built for a projection out of the tree again when nothing on its paths was found below it. */
+void prune_XMLProjection(XMLDocument* doc, XMLNode* node, uint64_t paths) {
+    /* The document element is always kept */
+    if (paths >> PROJECTION_PATHS || node->children->count || doc->projected_count == 1)
+        return;
+
+    /* Only elements are built below an ancestor, so node is the last item of its parent. It is freed with the document */
+    XMLNode* parent = node->parent;
+    parent->children->count--;
+    free_XMLMemory(doc, parent->inner_xml->items[--parent->inner_xml->count]);
+    if (doc->tag_index)
+        doc->tag_index->stale = true;
+}
+
+/*
+ * Adds a token to the tree below *node and moves *node when an element starts or ends.
+ * *node becomes NULL when root is closed. Returns false on failure.
+ */
+bool add_XMLToken(XMLDocument* doc, XMLNode** node, XMLNode* root, XMLToken* token) {
+    switch (token->type) {
+    case XMLTokenText:
+    case XMLTokenCData: {
+        if (!is_XMLProjected(doc))
+            break;
+
+        /* Append inner_text to XMLNode, CDATA is kept as it is */
+        char* string = token->type == XMLTokenText ? copy_XMLText(doc, token->value)
+            : token->value.length ? copy_XMLView(doc, token->value) : NULL;
+        if (string) {
+            /* The text is tracked first so it is freed even if it cannot be attached */
+            if (!doc->arena && !append_XMLItem(doc, doc->text, string)) {
+                free_XMLMemory(doc, string);
+                return false;
+            }
+            XMLValue* text = new_XMLValue(doc, string, XMLTypeText);
+            if (!text)
+                return false;
+            if (!append_XMLItem(doc, (*node)->inner_xml, text)) {
+                free_XMLMemory(doc, text);
+                return false;
+            }
+            SXML_COUNT(doc, texts, 1);
+        }
+        break;
+    }
+
+    case XMLTokenStartElement: {
+        /* Elements off the paths of a projection are skipped, only the document element is always built */
+        uint64_t paths = doc->projection ? match_XMLProjection(doc, token->name) : 0;
+        if (doc->projection && !paths && doc->projected_count > 1) {
+            if (!skip_XMLContent(doc))
+                return false;
+            break;
+        }
+
+        /* Set current node */
+        XMLNode* child = new_XMLNode(doc, *node);
+        if (!child)
+            return false;
+        *node = child;
+        (*node)->tag = copy_XMLName(doc, token->name);
+        if (!(*node)->tag)
+            return false;
+        if (doc->tag_index && !add_XMLTagNode(doc, doc->tag_index, *node, token->name.length))
+            return false;
+#ifdef SXML_STATS
+        doc->parse.elements++;
+        if (doc->parse.depth + 1 > doc->parse.max_depth)
+            doc->parse.max_depth = doc->parse.depth + 1;
+#endif
+
+        /* In case we have the inline node go back to parent immediately, lazy content is skipped the same way */
+        if (doc->options & XMLOptionLazyAttributes ? defer_XMLAttributes(doc, *node) : parse_XMLAttributes(doc, *node)) {
+            if (doc->projection)
+                prune_XMLProjection(doc, *node, paths);
+            *node = (*node)->parent;
+        }
+        else if ((doc->options & XMLOptionLazyChildren) && (!doc->projection || paths >> PROJECTION_PATHS)) {
+            if (doc->state == XMLStateError || !defer_XMLChildren(doc, *node))
+                return false;
+            *node = (*node)->parent;
+        }
+        else {
+            /* The ancestors of a projection are built eagerly, their paths are needed for the elements below */
+            if (doc->projection && !push_XMLProjection(doc, paths))
+                return false;
+            SXML_COUNT(doc, depth, 1);
+        }
+        break;
+    }
+
+    case XMLTokenEndElement:
+        /* Reached root, stop parsing */
+        if (*node == root) {
+            *node = NULL;
+            break;
+        }
+
+        /* Check if tag matches */
+        if (strncmp((*node)->tag, token->name.data, token->name.length) != 0 || (*node)->tag[token->name.length] != '\0') {
+            fprintf(stderr, "Mismatched tags (%s != %.*s)\n", (*node)->tag, (int)token->name.length, token->name.data);
+            return false;
+        }
+
+        /* Take a step back to nodes parent */
+        if (doc->projection) {
+            uint64_t paths = doc->projected[--doc->projected_count];
+            prune_XMLProjection(doc, *node, paths);
+        }
+        *node = (*node)->parent;
+        SXML_COUNT(doc, depth, -1);
+        break;
+
+    case XMLTokenDeclaration: {
+        /* Create xml node and parse attributes */
+        XMLNode* declaration = new_XMLNode(doc, NULL);
+        if (!declaration)
+            return false;
+        parse_XMLAttributes(doc, declaration);
+
+        /* Set the attributes of xml document */
+        doc->info = declaration->attributes;
+        break;
+    }
+
+    case XMLTokenError:
+        return false;
+
+    default:
+        break;
+    }
+
+    return doc->state != XMLStateError;
+}
+
+/*
+ * Parses the children and text of a node parsed with XMLOptionLazyChildren, once. Its child elements are
+ * left lazy in turn. Expanding changes the document, so nodes of a document must not be expanded from
+ * several threads at once. Returns false when the content is malformed or out of memory, the node keeps
+ * what was parsed before.
+ */
+bool expand_XMLNode(XMLNode* node) {
+    XMLPending* pending = node->pending;
+    if (!pending || !pending->content)
+        return true;
+
+    /* The content is read like the content of a document whose root is node, the parser is left where it was */
+    XMLDocument* doc = pending->doc;
+    size_t index = doc->index;
+    enum XMLState state = doc->state;
+    XMLView tag = doc->tag;
+    const XMLProjection* projection = doc->projection;
+    doc->index = pending->content;
+    doc->state = XMLStateContent;
+    pending->content = 0;
+
+    /* Lazy nodes of a projection are inside a subtree that is built as a whole */
+    doc->projection = NULL;
+
+    XMLNode* current = node;
+    XMLToken token;
+    while (current && next_XMLToken(doc, &token) != XMLTokenNone) {
+        if (!add_XMLToken(doc, &current, node, &token))
+            break;
+    }
+
+    /* The depth was counted while skipping, only the names of the end tag of node are left to compare */
+    bool success = !current && doc->state != XMLStateError;
+    if (success && (strncmp(node->tag, token.name.data, token.name.length) != 0 || node->tag[token.name.length] != '\0')) {
+        fprintf(stderr, "Mismatched tags (%s != %.*s)\n", node->tag, (int)token.name.length, token.name.data);
+        success = false;
+    }
+    doc->index = index;
+    doc->state = state;
+    doc->tag = tag;
+    doc->projection = projection;
+
+    /* A child that failed half way has no tag yet, it is still freed with the document but leaves the tree */
+    XMLList* inner_xml = node->inner_xml;
+    XMLValue* last = inner_xml->count ? inner_xml->items[inner_xml->count - 1] : NULL;
+    if (!success && last && last->type == XMLTypeNode && !((XMLNode*)last->value)->tag) {
+        inner_xml->count--;
+        free_XMLMemory(doc, last);
+    }
+    if (!success && node->children->count && !((XMLNode*)node->children->items[node->children->count - 1])->tag)
+        node->children->count--;
+
+    settle_XMLPending(node);
+    return success;
+}
+
+/* Returns the child elements of a node, expanded first when they were parsed lazily. */
+XMLList* get_XMLChildren(XMLNode* node) {
+    expand_XMLNode(node);
+    return node->children;
+}
+
+/* Returns the text and child elements of a node in document order, expanded first when they were parsed lazily. */
+XMLList* get_XMLInnerXML(XMLNode* node) {
+    expand_XMLNode(node);
+    return node->inner_xml;
+}
+
+/* Finishes the tree below root and returns its first element, or NULL on failure. */
+XMLNode* finish_XMLTree(XMLDocument* doc, XMLNode* root, XMLNode* node) {
+    XMLToken token;
+    while (node && next_XMLToken(doc, &token) != XMLTokenNone) {
+        SXML_LAP(doc, tokenize_ns);
+        if (!add_XMLToken(doc, &node, root, &token))
+            return NULL;
+        SXML_LAP(doc, build_ns);
+    }
+    SXML_LAP(doc, tokenize_ns);
+    SXML_STOP(doc);
+
+    /* We are done parsing, the buffer is kept alive when the tree points into it */
+    if (!(doc->options & (XMLOptionInSitu | XMLOptionLazyAttributes | XMLOptionLazyChildren)))
+        free_file(doc);
+    if (root->children->count > 0) {
+        ((XMLNode*)root->children->items[0])->parent = NULL;
+        if (doc->tag_index) {
+            doc->tag_index->root = root->children->items[0];
+            /* Lazy subtrees are missing from the index, the first lookup expands and indexes the whole tree */
+            if (doc->options & XMLOptionLazyChildren)
+                doc->tag_index->stale = true;
+        }
+        return root->children->items[0];
+    }
+    return NULL;
+}
+
+/* Returns root node on success, on failure NULL ptr is returned */
+XMLNode* parse_xml(XMLDocument* doc) {
+    SXML_START(doc);
+    doc->state = XMLStateContent;
+    XMLNode* root = prepare_XMLTree(doc) ? new_XMLNode(doc, NULL) : NULL;
+    if (!root)
+        return NULL;
+    return finish_XMLTree(doc, root, root);
+}
+
+
+/* PARALLEL PARSER IMPLEMENTATION */
+
+/* Depth and split candidates of a range of the document, found without tokenizing */
+typedef struct XMLSkeleton {
+    const char* buffer;
+    size_t size;
+    size_t start;           /* First '<' of the range, assumed to be outside of any markup */
+    size_t stop;            /* The range ends at the first '<' outside of markup from here on */
+    size_t end;             /* Where the range ended */
+    long depth;             /* Depth at the end relative to start */
+    long lowest;            /* Lowest depth relative to start */
+    size_t firsts[SKELETON_DEPTH]; /* First markup that is no end tag at relative depth -i, 0 if none */
+    bool success;
+#ifdef SXML_THREADS
+    pthread_t thread;
+#endif
+} XMLSkeleton;
+
+/* A run of children of the document element parsed by one thread */
+typedef struct XMLChunk {
+    XMLDocument* doc;       /* Owns the nodes of the chunk, shares the buffer */
+    XMLNode* parent;        /* Stands in for the document element */
+    const char* tag;        /* Tag of the document element */
+    size_t end;             /* Index of the '<' the next chunk starts at, SIZE_MAX for the last chunk */
+    bool closed;            /* The last chunk read the end tag of the document element */
+    bool success;
+#ifdef SXML_THREADS
+    pthread_t thread;
+#endif
+} XMLChunk;
+
+/* Counts the depth of a range like skip_XMLElement and notes where each new lowest depth is entered. */
+void* scan_XMLSkeleton(void* argument) {
+    XMLSkeleton* skeleton = argument;
+    const char* buffer = skeleton->buffer;
+    size_t size = skeleton->size;
+    size_t index = skeleton->start;
+    long depth = 0;
+    long lowest = 0;
+    bool inline_node;
+
+    memset(skeleton->firsts, 0, sizeof(skeleton->firsts));
+    skeleton->success = false;
+    for (;;) {
+        index = scan_XMLText(buffer, index, size);
+        if (buffer[index] == '\0' || index >= skeleton->stop)
+            break;
+        size_t mark = index++;
+
+        /* End of node */
+        if (buffer[index] == '/') {
+            const char* end = memchr(buffer + index, '>', size - index);
+            if (!end)
+                return NULL;
+            index = (size_t)(end - buffer) + 1;
+            if (--depth < lowest)
+                lowest = depth;
+            continue;
+        }
+
+        if (depth == lowest && -lowest < SKELETON_DEPTH && !skeleton->firsts[-lowest])
+            skeleton->firsts[-lowest] = mark;
+
+        /* Comments, CDATA, declarations and other special nodes */
+        if (buffer[index] == '!' || buffer[index] == '?') {
+            if (!skip_XMLSpecial(buffer, &index, size))
+                return NULL;
+            continue;
+        }
+
+        /* Start tag */
+        if (!skip_XMLTag(buffer, &index, size, &inline_node))
+            return NULL;
+        if (!inline_node)
+            depth++;
+    }
+
+    skeleton->end = index;
+    skeleton->depth = depth;
+    skeleton->lowest = lowest;
+    skeleton->success = true;
+    return NULL;
+}
+
+/*
+ * Finds up to count - 1 indices of '<' between the children of the element whose content starts at index.
+ * The ranges are scanned at the same time, each assuming it starts outside of markup. A range whose
+ * start turns out to be inside a comment, CDATA or value is scanned again from where the one before ended.
+ * Returns the amount of splits, or -1 when the content is not well formed.
+ */
+int split_XMLElement(XMLDocument* doc, const char* buffer, size_t index, size_t size, size_t* splits, size_t count) {
+    XMLSkeleton* skeletons = alloc_XMLHeap(doc, sizeof(XMLSkeleton) * count, XMLMemoryOther);
+    if (!skeletons)
+        return 0;
+
+    size_t length = size - index;
+    for (size_t i = 0; i < count; i++) {
+        XMLSkeleton* skeleton = &skeletons[i];
+        size_t start = index + length / count * i;
+        const char* first = i == 0 ? buffer + start : memchr(buffer + start, '<', size - start);
+
+        skeleton->buffer = buffer;
+        skeleton->size = size;
+        skeleton->start = first ? (size_t)(first - buffer) : size - 1;
+        skeleton->stop = i + 1 < count ? index + length / count * (i + 1) : SIZE_MAX;
+    }
+
+    /* The calling thread scans the first range itself */
+    size_t started = 1;
+#ifdef SXML_THREADS
+    for (; started < count; started++) {
+        if (pthread_create(&skeletons[started].thread, NULL, scan_XMLSkeleton, &skeletons[started]) != 0)
+            break;
+    }
+#endif
+    for (size_t i = started; i < count; i++)
+        scan_XMLSkeleton(&skeletons[i]);
+    scan_XMLSkeleton(&skeletons[0]);
+#ifdef SXML_THREADS
+    for (size_t i = 1; i < started; i++)
+        pthread_join(skeletons[i].thread, NULL);
+#endif
+
+    /* Chain the ranges, the depth before a range tells which of its firsts is a child of the element */
+    int found = 0;
+    long depth = 0;
+    for (size_t i = 0; i < count; i++) {
+        XMLSkeleton* skeleton = &skeletons[i];
+        if (i > 0 && skeleton->start != skeletons[i - 1].end) {
+            skeleton->start = skeletons[i - 1].end;
+            scan_XMLSkeleton(skeleton);
+        }
+        if (!skeleton->success) {
+            found = -1;
+            break;
+        }
+        if (i > 0 && depth < SKELETON_DEPTH && skeleton->firsts[depth])
+            splits[found++] = skeleton->firsts[depth];
+
+        /* Nothing after the end tag of the element belongs to it */
+        if (depth + skeleton->lowest < 0)
+            break;
+        depth += skeleton->depth;
+    }
+
+    free_XMLHeap(doc, skeletons);
+    return found;
+}
+
+/* Parses the siblings of a chunk below its stand in parent. */
+void* parse_XMLChunk(void* argument) {
+    XMLChunk* chunk = argument;
+    XMLDocument* doc = chunk->doc;
+    XMLNode* node = chunk->parent;
+    XMLToken token;
+
+    chunk->success = false;
+    chunk->closed = false;
+    SXML_START(doc);
+    for (;;) {
+        /* Stop in front of the '<' of the next chunk, which may be written by neither */
+        if (node == chunk->parent && (doc->state == XMLStateContent ? doc->index >= chunk->end
+            : doc->state == XMLStateTag && doc->index > chunk->end))
+            break;
+
+        enum XMLTokenType type = next_XMLToken(doc, &token);
+        SXML_LAP(doc, tokenize_ns);
+        if (type == XMLTokenNone)
+            break;
+
+        /* Only the last chunk reaches the end of the document element */
+        if (type == XMLTokenEndElement && node == chunk->parent) {
+            if (chunk->end != SIZE_MAX || strncmp(chunk->tag, token.name.data, token.name.length) != 0 || chunk->tag[token.name.length] != '\0') {
+                fprintf(stderr, "Mismatched tags (%s != %.*s)\n", chunk->tag, (int)token.name.length, token.name.data);
+                return NULL;
+            }
+            chunk->closed = true;
+            break;
+        }
+
+        if (!add_XMLToken(doc, &node, chunk->parent, &token))
+            return NULL;
+        SXML_LAP(doc, build_ns);
+    }
+    chunk->success = true;
+    return NULL;
+}
+
+/* Sets up the document and stand in parent of a chunk, returns false when out of memory. */
+bool start_XMLChunk(XMLDocument* doc, XMLDocument* part, XMLChunk* chunk) {
+    part->options = doc->options;
+    part->parent = doc;
+    chunk->doc = part;
+
+    /* Chunks look up symbols in a private cache, only new ones lock the table of the document */
+    if (doc->symbols) {
+        part->symbols = new_XMLSymbols(part, false);
+        if (!part->symbols)
+            return false;
+        part->symbols->parent = doc->symbols;
+    }
+    if (!prepare_XMLTree(part))
+        return false;
+    chunk->parent = new_XMLNode(part, NULL);
+    return chunk->parent != NULL;
+}
+
+/* Moves the items of a list of a chunk to a list of the document. */
+bool move_XMLItems(XMLDocument* doc, XMLList* into, XMLList* from) {
+    for (size_t i = 0; i < from->count; i++) {
+        if (!append_XMLItem(doc, into, from->items[i])) {
+            /* The rest stays with the chunk and is freed with it */
+            memmove(from->items, from->items + i, sizeof(void*) * (from->count - i));
+            from->count -= i;
+            return false;
+        }
+    }
+    from->count = 0;
+    return true;
+}
+
+/* Hands the nodes, attributes and text of a chunk over to the document. Returns false when out of memory. */
+bool merge_XMLChunk(XMLDocument* doc, XMLNode* element, XMLChunk* chunk) {
+    XMLDocument* part = chunk->doc;
+
+    /* Keep the document order of the inner xml, the stand in parent must not free what moved */
+    for (size_t i = 0; i < chunk->parent->children->count; i++)
+        ((XMLNode*)chunk->parent->children->items[i])->parent = element;
+    bool success = move_XMLItems(doc, element->inner_xml, chunk->parent->inner_xml);
+    success &= move_XMLItems(doc, element->children, chunk->parent->children);
+
+    if (part->arena) {
+        merge_XMLArena(doc->arena, part->arena);
+        part->arena = NULL;
+    }
+    else {
+        success &= move_XMLItems(doc, doc->nodes, part->nodes);
+        success &= move_XMLItems(doc, doc->attributes, part->attributes);
+        success &= move_XMLItems(doc, doc->text, part->text);
+    }
+
+    /* Chunks are merged in document order, so their elements go after the ones before */
+    if (success && part->tag_index)
+        success = merge_XMLTagIndex(doc, doc->tag_index, part->tag_index);
+
+    for (int i = 0; i < XMLMemoryCount; i++) {
+        doc->stats.calls[i] += part->stats.calls[i];
+        doc->stats.bytes[i] += part->stats.bytes[i];
+    }
+    doc->stats.heap_calls += part->stats.heap_calls;
+    doc->stats.heap_bytes += part->stats.heap_bytes;
+    doc->stats.failures += part->stats.failures;
+#ifdef SXML_STATS
+    /* The bytes are counted over the whole range by the document */
+    doc->parse.elements += part->parse.elements;
+    doc->parse.attributes += part->parse.attributes;
+    doc->parse.texts += part->parse.texts;
+    doc->parse.skipped += part->parse.skipped;
+    doc->parse.list_growths += part->parse.list_growths;
+    doc->parse.tokenize_ns += part->parse.tokenize_ns;
+    doc->parse.build_ns += part->parse.build_ns;
+    if (doc->parse.depth + part->parse.max_depth > doc->parse.max_depth)
+        doc->parse.max_depth = doc->parse.depth + part->parse.max_depth;
+#endif
+
+    /* The buffer belongs to the document */
+    part->buffer = NULL;
+    free_XMLDocument(part);
+    return success;
+}
+
+/*
+ * Like parse_xml, but the children of the document element are split into up to threads chunks
+ * at their boundaries, which are parsed at the same time and joined in document order.
+ * Pays off for large documents with many top level records.
+ */
+XMLNode* parse_xml_parallel(XMLDocument* doc, size_t threads) {
+    SXML_START(doc);
+    doc->state = XMLStateContent;
+    XMLNode* root = prepare_XMLTree(doc) ? new_XMLNode(doc, NULL) : NULL;
+    XMLNode* node = root;
+    if (!root)
+        return NULL;
+
+#ifdef SXML_THREADS
+    XMLToken token;
+    if (threads > MAX_PARSE_THREADS)
+        threads = MAX_PARSE_THREADS;
+
+    /* The paths of a projection are followed on one thread */
+    if (doc->projection)
+        threads = 1;
+
+    /* Parse up to the content of the document element, which is split even when children are lazy */
+    unsigned int options = doc->options;
+    doc->options &= ~XMLOptionLazyChildren;
+    while (threads > 1 && node == root && next_XMLToken(doc, &token) != XMLTokenNone) {
+        if (!add_XMLToken(doc, &node, root, &token)) {
+            doc->options = options;
+            return NULL;
+        }
+    }
+    doc->options = options;
+    if (threads < 2 || !node || node == root)
+        return finish_XMLTree(doc, root, node);
+
+    /* Malformed content is left to the sequential parser to report */
+    size_t splits[MAX_PARSE_THREADS];
+    int count = split_XMLElement(doc, doc->buffer, doc->index, doc->file_size, splits, threads);
+    if (count < 1)
+        return finish_XMLTree(doc, root, node);
+
+    XMLChunk chunks[MAX_PARSE_THREADS];
+    for (int i = 0; i <= count; i++) {
+        /* Chunks allocate like the document, their memory is handed over to it */
+        XMLDocument* part = new_XMLDocumentAllocator(&doc->allocator);
+        if (!part || !start_XMLChunk(doc, part, &chunks[i])) {
+            for (int j = 0; j < i; j++) {
+                chunks[j].doc->buffer = NULL;
+                free_XMLDocument(chunks[j].doc);
+            }
+            if (part) {
+                part->buffer = NULL;
+                free_XMLDocument(part);
+            }
+            fail_XMLMemory(doc);
+            return NULL;
+        }
+        /* A chunk reads up to the '<' of the next one, whose bytes another thread may write when parsing in situ */
+        part->buffer = doc->buffer;
+        part->file_size = i < count ? splits[i] + 1 : doc->file_size;
+        part->options = doc->options;
+
+        /* Later chunks start after the '<' like the tokenizer does after text */
+        part->index = i == 0 ? doc->index : splits[i - 1] + 1;
+        part->state = i == 0 ? XMLStateContent : XMLStateTag;
+
+        chunks[i].tag = node->tag;
+        chunks[i].end = i < count ? splits[i] : SIZE_MAX;
+    }
+
+    /* The calling thread parses the first chunk itself */
+    int started = 1;
+    for (; started <= count; started++) {
+        if (pthread_create(&chunks[started].thread, NULL, parse_XMLChunk, &chunks[started]) != 0)
+            break;
+    }
+    parse_XMLChunk(&chunks[0]);
+    for (int i = started; i <= count; i++)
+        parse_XMLChunk(&chunks[i]);
+
+    bool success = true;
+    for (int i = 0; i <= count; i++) {
+        if (i > 0 && i < started)
+            pthread_join(chunks[i].thread, NULL);
+        success &= chunks[i].success;
+    }
+
+    /* Continue after the last chunk */
+    XMLDocument* last = chunks[count].doc;
+    doc->index = last->index;
+    doc->state = last->state;
+    doc->tag = last->tag;
+    bool closed = chunks[count].closed;
+
+    for (int i = 0; i <= count; i++)
+        success &= merge_XMLChunk(doc, node, &chunks[i]);
+    if (!success)
+        return NULL;
+    if (closed) {
+        node = node->parent;
+        SXML_COUNT(doc, depth, -1);
+    }
+#ifdef SXML_STATS
+    /* The chunks timed themselves, waiting for them is left out */
+    doc->parse.lap = read_XMLClock();
+#endif
+#endif
+    return finish_XMLTree(doc, root, node);
+}
+
+
+/* FLAT TREE IMPLEMENTATION */
+
+/* Grows an array of a flat tree so it can hold one more item, returns false when out of memory. */
+bool grow_XMLFlatArray(XMLDocument* doc, void** items, size_t* size, size_t count, size_t item_size, enum XMLMemory kind) {
+    if (count < *size)
+        return true;
+
+    void* grown = realloc_XMLHeap(doc, *items, item_size * *size * 2, kind);
+    if (!grown)
+        return false;
+    *items = grown;
+    *size *= 2;
+    return true;
+}
+
+/* Appends a node below parent, last holds the last child of every open node. Returns FLAT_NONE when out of memory. */
+uint32_t add_XMLFlatNode(XMLDocument* doc, XMLFlatTree* tree, enum XMLType type, const char* value, uint32_t parent, uint32_t* last) {
+    if (!grow_XMLFlatArray(doc, (void**)&tree->nodes, &tree->node_size, tree->node_count, sizeof(XMLFlatNode), XMLMemoryNode))
+        return FLAT_NONE;
+    uint32_t index = (uint32_t)tree->node_count++;
+
+    XMLFlatNode* node = &tree->nodes[index];
+    node->type = type;
+    node->parent = parent;
+    node->first_child = FLAT_NONE;
+    node->next_sibling = FLAT_NONE;
+    node->attributes = (uint32_t)tree->attribute_count;
+    node->attribute_count = 0;
+    node->value = value;
+
+    /* Link after the previous sibling */
+    if (*last != FLAT_NONE)
+        tree->nodes[*last].next_sibling = index;
+    else if (parent != FLAT_NONE)
+        tree->nodes[parent].first_child = index;
+    *last = index;
+    return index;
+}
+
+/* Appends the attributes of the current tag to the packed attribute array. Returns true for inline nodes. */
+bool parse_XMLFlatAttributes(XMLDocument* doc, XMLFlatTree* tree, XMLFlatNode* node) {
+    XMLToken token;
+    while (doc->state == XMLStateAttributes && scan_XMLAttribute(doc, &token) == XMLTokenAttribute) {
+        if (!grow_XMLFlatArray(doc, (void**)&tree->attributes, &tree->attribute_size, tree->attribute_count, sizeof(XMLAttribute), XMLMemoryAttribute))
+            break;
+        XMLAttribute* attribute = &tree->attributes[tree->attribute_count++];
+        attribute->value = NULL;
+        if (!(attribute->key = copy_XMLName(doc, token.name)))
+            break;
+        if (token.value.data && !(attribute->value = copy_XMLValue(doc, &token)))
+            break;
+        node->attribute_count++;
+    }
+
+    if (doc->state == XMLStateInline) {
+        doc->state = XMLStateContent;
+        return true;
+    }
+    return false;
+}
+
+/*
+ * Parses the document into a flat tree owned by the document, or returns NULL on failure.
+ * Strings are kept in the arena of the document (or in the buffer when parsing in situ),
+ * so the whole tree takes a handful of allocations.
+ */
+XMLFlatTree* parse_xml_flat(XMLDocument* doc) {
+    doc->state = XMLStateContent;
+    if (!doc->arena && !(doc->arena = new_XMLArena(&doc->allocator, &doc->stats)))
+        return fail_XMLMemory(doc);
+    if ((doc->options & XMLOptionIntern) && !doc->symbols && !(doc->symbols = new_XMLSymbols(doc, false)))
+        return fail_XMLMemory(doc);
+
+    if (doc->flat) {
+        free_XMLHeap(doc, doc->flat->nodes);
+        free_XMLHeap(doc, doc->flat->attributes);
+        free_XMLHeap(doc, doc->flat);
+        doc->flat = NULL;
+    }
+    XMLFlatTree* tree = alloc_XMLHeap(doc, sizeof(XMLFlatTree), XMLMemoryOther);
+    if (!tree)
+        return NULL;
+    tree->node_count = 0;
+    tree->node_size = NODE_SIZE * 64;
+    tree->attribute_count = 0;
+    tree->attribute_size = NODE_SIZE * 64;
+    tree->attributes = NULL;
+    doc->flat = tree;
+    if (!(tree->nodes = alloc_XMLHeap(doc, sizeof(XMLFlatNode) * tree->node_size, XMLMemoryNode))
+        || !(tree->attributes = alloc_XMLHeap(doc, sizeof(XMLAttribute) * tree->attribute_size, XMLMemoryAttribute)))
+        return NULL;
+
+    /* Open elements and their last child, stack[0] stands for the top level */
+    size_t depth = 0;
+    size_t stack_size = SAX_STACK_SIZE;
+    uint32_t* parents = alloc_XMLHeap(doc, sizeof(uint32_t) * stack_size, XMLMemoryOther);
+    uint32_t* lasts = parents ? alloc_XMLHeap(doc, sizeof(uint32_t) * stack_size, XMLMemoryOther) : NULL;
+    if (!lasts) {
+        free_XMLHeap(doc, parents);
+        return NULL;
+    }
+    parents[0] = FLAT_NONE;
+    lasts[0] = FLAT_NONE;
+
+    bool success = true;
+    XMLToken token;
+    while (success && next_XMLToken(doc, &token) != XMLTokenNone) {
+        switch (token.type) {
+        case XMLTokenText:
+        case XMLTokenCData: {
+            /* Text outside of the document element is dropped like parse_xml does */
+            char* string = token.type == XMLTokenText ? copy_XMLText(doc, token.value)
+                : token.value.length ? copy_XMLView(doc, token.value) : NULL;
+            if (string && depth > 0)
+                add_XMLFlatNode(doc, tree, XMLTypeText, string, parents[depth], &lasts[depth]);
+            break;
+        }
+
+        case XMLTokenStartElement: {
+            const char* tag = copy_XMLName(doc, token.name);
+            uint32_t index = tag ? add_XMLFlatNode(doc, tree, XMLTypeNode, tag, parents[depth], &lasts[depth]) : FLAT_NONE;
+            if (index == FLAT_NONE || parse_XMLFlatAttributes(doc, tree, &tree->nodes[index]))
+                break;
+
+            /* Failures set XMLStateError, which ends the loop */
+            size_t parents_size = stack_size;
+            if (!grow_XMLFlatArray(doc, (void**)&parents, &parents_size, ++depth, sizeof(uint32_t), XMLMemoryOther)
+                || !grow_XMLFlatArray(doc, (void**)&lasts, &stack_size, depth, sizeof(uint32_t), XMLMemoryOther))
+                break;
+            parents[depth] = index;
+            lasts[depth] = FLAT_NONE;
+            break;
+        }
+
+        case XMLTokenEndElement: {
+            /* An end tag at the top level stops parsing */
+            if (depth == 0) {
+                doc->state = XMLStateContent;
+                doc->index = doc->file_size;
+                break;
+            }
+
+            const char* tag = tree->nodes[parents[depth]].value;
+            if (strncmp(tag, token.name.data, token.name.length) != 0 || tag[token.name.length] != '\0') {
+                fprintf(stderr, "Mismatched tags (%s != %.*s)\n", tag, (int)token.name.length, token.name.data);
+                success = false;
+                break;
+            }
+            depth--;
+            break;
+        }
+
+        case XMLTokenDeclaration: {
+            /* The declaration keeps its list of attributes in doc->info */
+            XMLNode* declaration = new_XMLNode(doc, NULL);
+            if (!declaration) {
+                success = false;
+                break;
+            }
+            parse_XMLAttributes(doc, declaration);
+            doc->info = declaration->attributes;
+            break;
+        }
+
+        case XMLTokenError:
+            success = false;
+            break;
+
+        default:
+            break;
+        }
+
+        if (doc->state == XMLStateError)
+            success = false;
+    }
+
+    free_XMLHeap(doc, parents);
+    free_XMLHeap(doc, lasts);
+    if (!(doc->options & XMLOptionInSitu))
+        free_file(doc);
+    if (!success || tree->node_count == 0)
+        return NULL;
+    return tree;
+}
+
+/* Returns the document element of a flat tree. */
+XMLFlatNode* get_XMLFlatRoot(XMLFlatTree* tree) {
+    return tree && tree->node_count > 0 ? &tree->nodes[0] : NULL;
+}
+
+/* Returns the parent element of a node, or NULL for the document element. */
+XMLFlatNode* get_XMLFlatParent(XMLFlatTree* tree, XMLFlatNode* node) {
+    return node->parent != FLAT_NONE ? &tree->nodes[node->parent] : NULL;
+}
+
+/* Returns the first element inside a node, like node->children->items[0]. */
+XMLFlatNode* first_XMLFlatChild(XMLFlatTree* tree, XMLFlatNode* node) {
+    uint32_t index = node->first_child;
+    while (index != FLAT_NONE && tree->nodes[index].type != XMLTypeNode)
+        index = tree->nodes[index].next_sibling;
+    return index != FLAT_NONE ? &tree->nodes[index] : NULL;
+}
+
+/* Returns the next element after a node with the same parent. */
+XMLFlatNode* next_XMLFlatSibling(XMLFlatTree* tree, XMLFlatNode* node) {
+    uint32_t index = node->next_sibling;
+    while (index != FLAT_NONE && tree->nodes[index].type != XMLTypeNode)
+        index = tree->nodes[index].next_sibling;
+    return index != FLAT_NONE ? &tree->nodes[index] : NULL;
+}
+
+/* Returns the amount of elements inside a node, like node->children->count. */
+size_t count_XMLFlatChildren(XMLFlatTree* tree, XMLFlatNode* node) {
+    size_t count = 0;
+    for (XMLFlatNode* child = first_XMLFlatChild(tree, node); child; child = next_XMLFlatSibling(tree, child))
+        count++;
+    return count;
+}
+
+/* Returns the first attribute of a node with the given key, or NULL. */
+XMLAttribute* get_XMLFlatAttribute(XMLFlatTree* tree, XMLFlatNode* node, const char* key) {
+    XMLAttribute* attributes = &tree->attributes[node->attributes];
+    for (uint32_t i = 0; i < node->attribute_count; i++) {
+        if (!strcmp(attributes[i].key, key))
+            return &attributes[i];
+    }
+    return NULL;
+}
+
+
+/* SAX IMPLEMENTATION */
+
+/* Grows a SAX stack with the allocator of the document until it can hold the needed amount of items. */
+bool grow_XMLStack(XMLDocument* doc, void** items, size_t* size, size_t needed, size_t item_size) {
+    if (needed <= *size)
+        return true;
+
+    size_t grown_size = *size;
+    while (grown_size < needed)
+        grown_size *= 2;
+
+    void* grown = realloc_XMLHeap(doc, *items, item_size * grown_size, XMLMemoryOther);
+    if (!grown)
+        return false;
+    *items = grown;
+    *size = grown_size;
+    return true;
+}
+
+bool init_XMLEvents(XMLDocument* doc, XMLEvents* events) {
+    events->attributes_size = SAX_STACK_SIZE;
+    events->tags_size = SAX_STACK_SIZE * 8;
+    events->tags_length = 0;
+    events->depth = 0;
+    events->done = false;
+    events->attributes = alloc_XMLHeap(doc, sizeof(XMLAttribute) * events->attributes_size, XMLMemoryOther);
+    events->tags = events->attributes ? alloc_XMLHeap(doc, events->tags_size, XMLMemoryOther) : NULL;
+    return events->attributes && events->tags;
+}
+
+void free_XMLEvents(XMLDocument* doc, XMLEvents* events) {
+    if (events) {
+        free_XMLHeap(doc, events->attributes);
+        free_XMLHeap(doc, events->tags);
+        events->attributes = NULL;
+        events->tags = NULL;
+    }
+}
+
+/* Returns the name of the innermost open element. */
+char* top_XMLTag(XMLEvents* events) {
+    char* tag = events->tags + events->tags_length - 1;
+    while (tag > events->tags && tag[-1] != '\0')
+        tag--;
+    return tag;
+}
+
+/* Copies the name of an opened element onto the stack, so it outlives the buffer it was read from. */
+bool push_XMLTag(XMLDocument* doc, XMLEvents* events, const char* tag) {
+    size_t length = strlen(tag) + 1;
+    if (!grow_XMLStack(doc, (void**)&events->tags, &events->tags_size, events->tags_length + length, sizeof(char)))
+        return false;
+    memcpy(events->tags + events->tags_length, tag, length);
+    events->tags_length += length;
+    events->depth++;
+    return true;
+}
+
+void pop_XMLTag(XMLEvents* events) {
+    events->tags_length = (size_t)(top_XMLTag(events) - events->tags);
+    events->depth--;
+}
+
+/* Reports the tokens of doc->buffer to the handler. Returns false on malformed input. */
+bool dispatch_XMLEvents(XMLDocument* doc, XMLHandler* handler, XMLEvents* events) {
+    bool success = true;
+
+    /* Events are decoded in place so nothing is allocated per node */
+    unsigned int options = doc->options;
+    doc->options |= XMLOptionInSitu;
+
+    XMLToken token;
+    while (success && !events->done && next_XMLToken(doc, &token) != XMLTokenNone) {
+        switch (token.type) {
+        case XMLTokenText:
+            if (handler->text) {
+                char* text = copy_XMLText(doc, token.value);
+                if (text)
+                    handler->text(handler->user, text);
+            }
+            break;
+
+        case XMLTokenCData:
+            if (handler->text && token.value.length)
+                handler->text(handler->user, copy_XMLView(doc, token.value));
+            break;
+
+        case XMLTokenComment:
+            if (handler->comment)
+                handler->comment(handler->user, copy_XMLView(doc, token.value));
+            break;
+
+        case XMLTokenStartElement:
+        case XMLTokenDeclaration: {
+            enum XMLTokenType type = token.type;
+            char* tag = copy_XMLView(doc, token.name);
+
+            /* Collect the attributes of the tag */
+            size_t count = 0;
+            while (doc->state == XMLStateAttributes && scan_XMLAttribute(doc, &token) == XMLTokenAttribute) {
+                if (!grow_XMLStack(doc, (void**)&events->attributes, &events->attributes_size, count + 1, sizeof(XMLAttribute))) {
+                    success = false;
+                    break;
+                }
+                events->attributes[count].key = copy_XMLView(doc, token.name);
+                events->attributes[count].value = token.value.data ? copy_XMLValue(doc, &token) : NULL;
+                count++;
+            }
+            if (!success || doc->state == XMLStateError)
+                break;
+
+            if (type == XMLTokenDeclaration) {
+                if (handler->declaration)
+                    handler->declaration(handler->user, events->attributes, count);
+                break;
+            }
+
+            if (handler->start_element)
+                handler->start_element(handler->user, tag, events->attributes, count);
+
+            /* Inline nodes end right away */
+            if (doc->state == XMLStateInline) {
+                doc->state = XMLStateContent;
+                if (handler->end_element)
+                    handler->end_element(handler->user, tag);
+                break;
+            }
+
+            success = push_XMLTag(doc, events, tag);
+            break;
+        }
+
+        case XMLTokenEndElement: {
+            /* Reached root, stop parsing */
+            if (events->depth == 0) {
+                events->done = true;
+                break;
+            }
+
+            /* Check if tag matches */
+            char* tag = copy_XMLView(doc, token.name);
+            if (strcmp(top_XMLTag(events), tag) != 0) {
+                fprintf(stderr, "Mismatched tags (%s != %s)\n", top_XMLTag(events), tag);
+                success = false;
+                break;
+            }
+
+            pop_XMLTag(events);
+            if (handler->end_element)
+                handler->end_element(handler->user, tag);
+            break;
+        }
+
+        case XMLTokenError:
+            success = false;
+            break;
+
+        default:
+            break;
+        }
+    }
+
+    doc->options = options;
+    return success && doc->state != XMLStateError;
+}
+
+/*
+ * Parses the document without building nodes and reports every element, text, comment and declaration to the handler.
+ * Strings are decoded in place and are only valid during the callback unless XMLOptionInSitu is set.
+ * Returns true if the whole document was parsed.
+ */
+bool parse_xml_sax(XMLDocument* doc, XMLHandler* handler) {
+    /* Attributes and open tags live in stacks that are reused for every element */
+    XMLEvents events;
+    bool success = init_XMLEvents(doc, &events);
+
+    doc->state = XMLStateContent;
+    if (success)
+        success = dispatch_XMLEvents(doc, handler, &events);
+    free_XMLEvents(doc, &events);
+
+    /* Strings only outlive the parse when the buffer is kept */
+    if (!(doc->options & XMLOptionInSitu))
+        free_file(doc);
+    return success;
+}
+
+
+/* PUSH PARSER IMPLEMENTATION */
+
+/*
+ * Scans the bytes fed since the last call and returns how much of the lexer only holds complete tokens.
+ * The scan stops in the middle of a token and resumes there when more input arrives.
+ */
+size_t scan_XMLChunk(XMLDocument* doc) {
+    char* lexer = doc->lexer;
+    size_t length = doc->lexer_index;
+    size_t index = doc->scan_index;
+    size_t complete = 0;
+    char* end;
+
+    while (index < length) {
+        switch (doc->scan) {
+        case XMLScanText:
+            /* Text is complete once the next tag starts */
+            end = memchr(lexer + index, '<', length - index);
+            if (!end) {
+                index = length;
+                break;
+            }
+            index = (size_t)(end - lexer);
+            complete = index++;
+            doc->scan = XMLScanOpen;
+            break;
+
+        case XMLScanOpen:
+            /* Decide what kind of markup follows '<', waiting for enough input to tell */
+            if (lexer[index] == '!') {
+                size_t available = length - index;
+                if (available < 3 || (available < 8 && !memcmp(lexer + index, "![CDATA[", available))) {
+                    doc->scan_index = index;
+                    return complete;
+                }
+                if (!strncmp(lexer + index, "!--", 3)) {
+                    doc->scan = XMLScanComment;
+                    index += 3;
+                }
+                else if (!strncmp(lexer + index, "![CDATA[", 8)) {
+                    doc->scan = XMLScanCData;
+                    index += 8;
+                }
+                else doc->scan = XMLScanSpecial;
+            }
+            else if (lexer[index] == '?') {
+                doc->scan = XMLScanInstruction;
+                index++;
+            }
+            else doc->scan = XMLScanTag;
+            break;
+
+        case XMLScanTag:
+            while (index < length && lexer[index] != '>' && lexer[index] != '"' && lexer[index] != '\'')
+                index++;
+            if (index == length)
+                break;
+            if (lexer[index++] == '>') {
+                complete = index;
+                doc->scan = XMLScanText;
+            }
+            else doc->scan = XMLScanValue;
+            break;
+
+        case XMLScanValue:
+            /* Values end at either quote and '\' escapes the next character */
+            while (index < length && lexer[index] != '"' && lexer[index] != '\'' && lexer[index] != '\\')
+                index++;
+            if (index == length)
+                break;
+            if (lexer[index] == '\\') {
+                if (index + 1 == length) {
+                    doc->scan_index = index;
+                    return complete;
+                }
+                index += 2;
+                break;
+            }
+            index++;
+            doc->scan = XMLScanTag;
+            break;
+
+        case XMLScanSpecial:
+            /* A DOCTYPE ends at '>' outside of its literals and internal subset */
+            while (index < length && lexer[index] != '>' && lexer[index] != '[' && lexer[index] != '"' && lexer[index] != '\'')
+                index++;
+            if (index == length)
+                break;
+            if (lexer[index] == '>') {
+                complete = ++index;
+                doc->scan = XMLScanText;
+            }
+            else if (lexer[index] == '[') {
+                index++;
+                doc->scan = XMLScanSubset;
+            }
+            else {
+                doc->scan_quote = lexer[index++];
+                doc->scan = XMLScanLiteral;
+            }
+            break;
+
+        case XMLScanSubset:
+            while (index < length && lexer[index] != ']' && lexer[index] != '<' && lexer[index] != '"' && lexer[index] != '\'')
+                index++;
+            if (index == length)
+                break;
+            if (lexer[index] == ']') {
+                index++;
+                doc->scan = XMLScanSpecial;
+            }
+            else if (lexer[index] == '<') {
+                /* Wait until a comment can be told apart from other declarations */
+                if (length - index < 4) {
+                    doc->scan_index = index;
+                    return complete;
+                }
+                if (!strncmp(lexer + index, "<!--", 4)) {
+                    index += 4;
+                    doc->scan = XMLScanSubsetComment;
+                }
+                else index++;
+            }
+            else {
+                doc->scan_quote = lexer[index++];
+                doc->scan = XMLScanSubsetLiteral;
+            }
+            break;
+
+        case XMLScanLiteral:
+        case XMLScanSubsetLiteral:
+            end = memchr(lexer + index, doc->scan_quote, length - index);
+            if (!end) {
+                index = length;
+                break;
+            }
+            index = (size_t)(end - lexer) + 1;
+            doc->scan = doc->scan == XMLScanLiteral ? XMLScanSpecial : XMLScanSubset;
+            break;
+
+        case XMLScanComment:
+        case XMLScanCData:
+        case XMLScanInstruction:
+        case XMLScanSubsetComment: {
+            const char* marker = doc->scan == XMLScanCData ? "]]>" : doc->scan == XMLScanInstruction ? "?>" : "-->";
+            size_t marker_length = strlen(marker);
+            end = find_XMLString(lexer + index, length - index, marker);
+            if (!end) {
+                /* Resume where a marker split over two chunks could start */
+                if (length - index >= marker_length)
+                    index = length - marker_length + 1;
+                doc->scan_index = index;
+                return complete;
+            }
+            index = (size_t)(end - lexer) + marker_length;
+            if (doc->scan == XMLScanSubsetComment) {
+                doc->scan = XMLScanSubset;
+                break;
+            }
+            complete = index;
+            doc->scan = XMLScanText;
+            break;
+        }
+        }
+    }
+
+    doc->scan_index = index;
+    return complete;
+}
+
+/* Reports the first complete bytes of the lexer and keeps the rest for the next chunk. */
+bool dispatch_XMLChunk(XMLDocument* doc, XMLHandler* handler, size_t complete) {
+    if (complete == 0)
+        return true;
+
+    /* Tokenize the complete part as if it was a whole document */
+    char next = doc->lexer[complete];
+    doc->lexer[complete] = '\0';
+    doc->buffer = doc->lexer;
+    doc->file_size = complete;
+    doc->index = 0;
+    doc->state = XMLStateContent;
+
+    bool success = dispatch_XMLEvents(doc, handler, doc->events);
+
+    doc->lexer[complete] = next;
+    doc->buffer = NULL;
+    doc->file_size = 0;
+
+    /* Move the incomplete token to the front */
+    memmove(doc->lexer, doc->lexer + complete, doc->lexer_index - complete);
+    doc->lexer_index -= complete;
+    doc->scan_index -= complete;
+    return success;
+}
+
+/*
+ * Appends a chunk of the document and reports every token it completes to the handler.
+ * Only the incomplete token at the end of the input is kept between chunks.
+ * Returns false on malformed input.
+ */
+bool feed_xml(XMLDocument* doc, XMLHandler* handler, const char* chunk, size_t length) {
+    /* Start a new document */
+    if (!doc->events) {
+        doc->events = alloc_XMLHeap(doc, sizeof(XMLEvents), XMLMemoryOther);
+        if (!doc->events || !init_XMLEvents(doc, doc->events)) {
+            free_XMLEvents(doc, doc->events);
+            free_XMLHeap(doc, doc->events);
+            doc->events = NULL;
+            return false;
+        }
+        doc->scan = XMLScanText;
+        doc->scan_index = 0;
+        doc->lexer_index = 0;
+    }
+    if (doc->events->done)
+        return true;
+
+    /* Increase lexer_size if the chunk does not fit, keeping room for a NUL */
+    if (!doc->lexer || doc->lexer_index + length + 1 > doc->lexer_size) {
+        size_t lexer_size = doc->lexer_size * 2;
+        while (lexer_size < doc->lexer_index + length + 1)
+            lexer_size += EXPAND_LEXER_SIZE;
+
+        char* lexer = realloc_XMLHeap(doc, doc->lexer, sizeof(char) * lexer_size, XMLMemoryOther);
+        if (!lexer)
+            return false;
+        doc->lexer = lexer;
+        doc->lexer_size = lexer_size;
+        SXML_COUNT(doc, lexer_growths, 1);
+    }
+
+    memcpy(doc->lexer + doc->lexer_index, chunk, length);
+    doc->lexer_index += length;
+    return dispatch_XMLChunk(doc, handler, scan_XMLChunk(doc));
+}
+
+/* Reports the remaining text after the last chunk. Returns false if the input ends inside a tag. */
+bool finish_xml(XMLDocument* doc, XMLHandler* handler) {
+    if (!doc->events)
+        return false;
+
+    bool success = true;
+    if (!doc->events->done) {
+        if (doc->scan != XMLScanText) {
+            fprintf(stderr, "Unexpected end of document\n");
+            success = false;
+        }
+        else success = dispatch_XMLChunk(doc, handler, doc->lexer_index);
+    }
+
+    /* The document can be reused for the next stream */
+    free_XMLEvents(doc, doc->events);
+    free_XMLHeap(doc, doc->events);
+    doc->events = NULL;
+    doc->lexer_index = 0;
+    return success;
+}
+
+
+/* READER IMPLEMENTATION */
+
+/* Creates a reader over the document, or returns NULL when out of memory. */
+XMLReader* new_XMLReader(XMLDocument* doc) {
+    XMLReader* reader = alloc_XMLHeap(doc, sizeof(XMLReader), XMLMemoryOther);
+    if (reader)
+        reader->tags = alloc_XMLHeap(doc, sizeof(XMLView) * SAX_STACK_SIZE, XMLMemoryOther);
+    if (!reader || !reader->tags) {
+        free_XMLHeap(doc, reader);
+        return NULL;
+    }
+    reader->doc = doc;
+    reader->depth = 0;
+    reader->tags_size = SAX_STACK_SIZE;
+    reader->token.type = XMLTokenNone;
+    doc->state = XMLStateContent;
+    return reader;
+}
+
+/*
+ * Reads the next token. Attributes follow their start element or declaration as XMLTokenAttribute.
+ * Views point into the untouched document buffer: text is trimmed (unless XMLOptionPreserveWhitespace is set)
+ * and attribute values keep their escapes.
+ */
+enum XMLTokenType next_XMLReader(XMLReader* reader) {
+    XMLDocument* doc = reader->doc;
+    XMLToken* token = &reader->token;
+
+    for (;;) {
+        switch (next_XMLToken(doc, token)) {
+        case XMLTokenText:
+            if (doc->options & XMLOptionPreserveWhitespace)
+                return XMLTokenText;
+
+            /* Trim the view and skip whitespace between tags */
+            size_t start = skip_XMLWhitespace(token->value.data, token->value.length);
+            token->value.data += start;
+            token->value.length -= start;
+            while (token->value.length > 0 && is_whitespace(token->value.data[token->value.length - 1]))
+                token->value.length--;
+            if (token->value.length == 0)
+                continue;
+            return XMLTokenText;
+
+        case XMLTokenStartElement:
+            if (!grow_XMLStack(doc, (void**)&reader->tags, &reader->tags_size, reader->depth + 1, sizeof(XMLView)))
+                return error_XMLToken(doc, "Unable to grow reader");
+            reader->tags[reader->depth++] = token->name;
+            return XMLTokenStartElement;
+
+        case XMLTokenEndElement: {
+            /* Reached root, stop reading */
+            if (reader->depth == 0) {
+                doc->index = doc->file_size;
+                token->type = XMLTokenNone;
+                return XMLTokenNone;
+            }
+
+            /* Check if tag matches */
+            XMLView tag = reader->tags[reader->depth - 1];
+            if (tag.length != token->name.length || memcmp(tag.data, token->name.data, tag.length) != 0)
+                return error_XMLToken(doc, "Mismatched tags");
+
+            reader->depth--;
+            return XMLTokenEndElement;
+        }
+
+        default:
+            return token->type;
+        }
+    }
+}
+
+/*
+ * Skips the rest of the innermost open element, including its end element, without tokenizing it.
+ * Returns false if no element is open or the element is unterminated.
+ */
+bool skip_XMLReader(XMLReader* reader) {
+    XMLDocument* doc = reader->doc;
+    size_t index = doc->index;
+    bool inline_node = false;
+
+    if (reader->depth == 0 || doc->state == XMLStateError)
+        return false;
+
+    switch (doc->state) {
+    case XMLStateAttributes:
+        /* Still inside the start tag */
+        if (!skip_XMLTag(doc->buffer, &index, doc->file_size, &inline_node)) {
+            error_XMLToken(doc, "Unterminated tag");
+            return false;
+        }
+        break;
+    case XMLStateInline:
+        inline_node = true;
+        break;
+    case XMLStateTag:
+        /* The '<' of the next tag was consumed after text */
+        index--;
+        break;
+    default:
+        break;
+    }
+
+    if (!inline_node && !skip_XMLElement(doc->buffer, &index, doc->file_size)) {
+        doc->index = index;
+        error_XMLToken(doc, "Unterminated element");
+        return false;
+    }
+
+    doc->index = index;
+    doc->state = XMLStateContent;
+    reader->depth--;
+    return true;
+}
+
+void free_XMLReader(XMLReader* reader) {
+    if (reader) {
+        free_XMLHeap(reader->doc, reader->tags);
+        free_XMLHeap(reader->doc, reader);
+    }
+}
+
+
+/* QUERY IMPLEMENTATION */
+
+/* Characters that end a tag name or attribute key in a query. */
+bool is_XMLQueryName(const char c) {
+    return c != '\0' && c != '/' && c != '[' && c != ']' && c != '@' && c != '='
+        && c != '*' && c != '\'' && c != '"' && !is_whitespace(c);
+}
+
+/* Copies the name at *expression to *strings and NUL terminates it. Returns NULL if there is no name. */
+const char* copy_XMLQueryName(const char** expression, char** strings) {
+    const char* start = *expression;
+    while (is_XMLQueryName(**expression))
+        (*expression)++;
+    size_t length = *expression - start;
+    if (!length)
+        return NULL;
+
+    char* name = *strings;
+    memcpy(name, start, length);
+    name[length] = '\0';
+    *strings += length + 1;
+    return name;
+}
+
+void free_XMLQuery(XMLQuery* query) {
+    if (query) {
+        free(query->steps);
+        free(query->strings);
+        free(query);
+    }
+}
+
+/*
+ * Compiles a path expression for run_XMLQuery, or returns NULL if it is malformed or out of memory.
+ * Steps are tag names or '*' separated by '/' (children) or '//' (descendants), each with up to
+ * QUERY_PREDICATES predicates: a position '[2]', an attribute '[@key]' or an attribute value '[@key='value']'.
+ * A leading '/' or '//' starts at the top of the tree, otherwise the query starts at the node it is run on.
+ */
+XMLQuery* compile_XMLQuery(const char* expression) {
+    XMLQuery* query = calloc(1, sizeof(XMLQuery));
+    size_t steps_size = 4;
+    if (query) {
+        query->steps = malloc(sizeof(XMLQueryStep) * steps_size);
+        /* Every name gets a terminator, so the copies take at most twice the expression */
+        query->strings = malloc(strlen(expression) * 2 + 2);
+    }
+    if (!query || !query->steps || !query->strings) {
+        free_XMLQuery(query);
+        return fail_XMLMemory(NULL);
+    }
+
+    const char* p = expression;
+    char* strings = query->strings;
+    const char* error = NULL;
+    bool descendant = false;
+    if (*p == '/') {
+        query->absolute = true;
+        descendant = *(++p) == '/';
+        if (descendant)
+            p++;
+    }
+
+    while (!error) {
+        if (query->step_count == steps_size) {
+            steps_size *= 2;
+            XMLQueryStep* steps = realloc(query->steps, sizeof(XMLQueryStep) * steps_size);
+            if (!steps) {
+                free_XMLQuery(query);
+                return fail_XMLMemory(NULL);
+            }
+            query->steps = steps;
+        }
+        XMLQueryStep* step = &query->steps[query->step_count++];
+        step->descendant = descendant;
+        step->tag = NULL;
+        step->predicate_count = 0;
+
+        if (*p == '*')
+            p++;
+        else if (!(step->tag = copy_XMLQueryName(&p, &strings))) {
+            error = "Expected a tag name";
+            break;
+        }
+
+        while (*p == '[') {
+            p++;
+            if (step->predicate_count == QUERY_PREDICATES) {
+                error = "Too many predicates";
+                break;
+            }
+            XMLPredicate* predicate = &step->predicates[step->predicate_count++];
+            if (*p >= '0' && *p <= '9') {
+                char* end;
+                predicate->type = XMLPredicatePosition;
+                predicate->position = strtoul(p, &end, 10);
+                p = end;
+                if (!predicate->position) {
+                    error = "Positions start at 1";
+                    break;
+                }
+            } else if (*p == '@') {
+                p++;
+                predicate->type = XMLPredicateAttribute;
+                predicate->value = NULL;
+                const char* key = copy_XMLQueryName(&p, &strings);
+                if (!key) {
+                    error = "Expected an attribute key";
+                    break;
+                }
+                predicate->key = make_XMLKey(key);
+                if (*p == '=') {
+                    char quote = *(++p);
+                    if (quote != '\'' && quote != '"') {
+                        error = "Expected a quoted value";
+                        break;
+                    }
+                    const char* start = ++p;
+                    while (*p && *p != quote)
+                        p++;
+                    if (!*p) {
+                        error = "Unterminated value";
+                        break;
+                    }
+                    memcpy(strings, start, p - start);
+                    strings[p - start] = '\0';
+                    predicate->value = strings;
+                    strings += p - start + 1;
+                    p++;
+                }
+            } else {
+                error = "Expected a position or an attribute";
+                break;
+            }
+            if (*p != ']') {
+                error = "Expected ']'";
+                break;
+            }
+            p++;
+        }
+
+        if (error || *p == '\0')
+            break;
+        if (*p != '/') {
+            error = "Unexpected character";
+            break;
+        }
+        descendant = *(++p) == '/';
+        if (descendant)
+            p++;
+    }
+
+    if (error) {
+        fprintf(stderr, "%s at %zu in query '%s'\n", error, (size_t)(p - expression), expression);
+        free_XMLQuery(query);
+        return NULL;
+    }
+    return query;
+}
+
+XMLQueryResult* new_XMLQueryResult(void) {
+    XMLQueryResult* result = calloc(1, sizeof(XMLQueryResult));
+    return result ? result : fail_XMLMemory(NULL);
+}
+
+void free_XMLQueryResult(XMLQueryResult* result) {
+    if (result) {
+        free(result->nodes);
+        free(result->context);
+        free(result->frames);
+        free(result->tags);
+        free(result);
+    }
+}
+
+/* Grows an array of a query result until it can hold the needed amount of items, marks the result failed if it cannot. */
+bool grow_XMLQueryArray(XMLQueryResult* result, void** items, size_t* size, size_t needed, size_t item_size) {
+    if (needed <= *size)
+        return true;
+
+    size_t grown_size = *size ? *size : SAX_STACK_SIZE;
+    while (grown_size < needed)
+        grown_size *= 2;
+
+    void* grown = realloc(*items, item_size * grown_size);
+    if (!grown) {
+        fail_XMLMemory(NULL);
+        result->failed = true;
+        return false;
+    }
+    *items = grown;
+    *size = grown_size;
+    return true;
+}
+
+/* Tests the tag and the predicates of a step on a node, positions counts the nodes that reached each predicate. */
+bool match_XMLQueryStep(const XMLQueryStep* step, const char* tag, XMLNode* node, size_t* positions) {
+    /* Tags interned in another table than the one of the tree still match by their text */
+    if (step->tag && node->tag != tag && strcmp(node->tag, step->tag))
+        return false;
+
+    for (size_t i = 0; i < step->predicate_count; i++) {
+        const XMLPredicate* predicate = &step->predicates[i];
+        if (predicate->type == XMLPredicatePosition) {
+            if (++positions[i] != predicate->position)
+                return false;
+        } else {
+            XMLAttribute* attribute = find_XMLAttribute(node, &predicate->key);
+            if (!attribute || (predicate->value && (!attribute->value || strcmp(attribute->value, predicate->value))))
+                return false;
+        }
+    }
+    return true;
+}
+
+void add_XMLQueryNode(XMLQueryResult* result, XMLNode* node) {
+    if (result->count == result->size && !grow_XMLQueryArray(result, (void**)&result->nodes, &result->size, result->count + 1, sizeof(XMLNode*)))
+        return;
+    result->nodes[result->count++] = node;
+}
+
+/* Matches a step against a list of siblings, and against everything below them for descendant steps. */
+void select_XMLQueryNodes(XMLQueryResult* result, const XMLQueryStep* step, const char* tag, XMLNode** nodes, size_t count) {
+    size_t positions[QUERY_PREDICATES] = { 0 };
+    for (size_t i = 0; i < count; i++) {
+        if (match_XMLQueryStep(step, tag, nodes[i], positions))
+            add_XMLQueryNode(result, nodes[i]);
+        if (step->descendant) {
+            XMLList* children = get_XMLChildren(nodes[i]);
+            select_XMLQueryNodes(result, step, tag, (XMLNode**)children->items, children->count);
+        }
+    }
+}
+
+/* Matches the children of a frame up to and including last, or all of them if last is NULL. */
+void select_XMLQueryFrame(XMLQueryResult* result, const XMLQueryStep* step, const char* tag, XMLQueryFrame* frame, XMLNode* last) {
+    XMLList* children = get_XMLChildren(frame->parent);
+    while (frame->next < children->count) {
+        XMLNode* child = children->items[frame->next++];
+        if (match_XMLQueryStep(step, tag, child, frame->positions))
+            add_XMLQueryNode(result, child);
+        if (child == last)
+            break;
+    }
+}
+
+bool contains_XMLNode(XMLNode* ancestor, XMLNode* node) {
+    for (node = node->parent; node; node = node->parent) {
+        if (node == ancestor)
+            return true;
+    }
+    return false;
+}
+
+/*
+ * Matches a step against the nodes of the previous step, which are in document order but may be nested.
+ * Descendant steps skip nodes inside the previous one since they were already searched. Child steps keep
+ * the children of the enclosing nodes open on a stack, so the matches of nested nodes are merged in
+ * document order.
+ */
+void select_XMLQueryStep(XMLQueryResult* result, const XMLQueryStep* step, const char* tag, XMLNode** context, size_t count) {
+    if (step->descendant) {
+        XMLNode* searched = NULL;
+        for (size_t i = 0; i < count; i++) {
+            if (searched && contains_XMLNode(searched, context[i]))
+                continue;
+            searched = context[i];
+            XMLList* children = get_XMLChildren(searched);
+            select_XMLQueryNodes(result, step, tag, (XMLNode**)children->items, children->count);
+        }
+        return;
+    }
+
+    size_t depth = 0;
+    for (size_t i = 0; i < count; i++) {
+        XMLNode* node = context[i];
+        while (depth && !contains_XMLNode(result->frames[depth - 1].parent, node)) {
+            select_XMLQueryFrame(result, step, tag, &result->frames[depth - 1], NULL);
+            depth--;
+        }
+        if (depth) {
+            /* Match the children in front of the node first */
+            XMLQueryFrame* frame = &result->frames[depth - 1];
+            XMLNode* last = node;
+            while (last->parent != frame->parent)
+                last = last->parent;
+            select_XMLQueryFrame(result, step, tag, frame, last);
+        }
+
+        if (!grow_XMLQueryArray(result, (void**)&result->frames, &result->frames_size, depth + 1, sizeof(XMLQueryFrame)))
+            return;
+        XMLQueryFrame* frame = &result->frames[depth++];
+        frame->parent = node;
+        frame->next = 0;
+        memset(frame->positions, 0, sizeof(frame->positions));
+    }
+    while (depth) {
+        select_XMLQueryFrame(result, step, tag, &result->frames[depth - 1], NULL);
+        depth--;
+    }
+}
+
+/*
+ * Runs a compiled query from node and returns the amount of matches, which are in result->nodes in document order.
+ * Pass the symbol table of a tree parsed with XMLOptionIntern as symbols to match its tags by pointer first, or NULL.
+ * The nodes stay valid until the result is run again or freed. When out of memory 0 is returned and result->failed is set.
+ */
+size_t run_XMLQuery(const XMLQuery* query, XMLNode* node, XMLSymbols* symbols, XMLQueryResult* result) {
+    result->count = 0;
+    result->failed = false;
+    if (!node || !query->step_count)
+        return 0;
+
+    /* Tags that are not in the table are compared by their text */
+    if (!grow_XMLQueryArray(result, (void**)&result->tags, &result->tags_size, query->step_count, sizeof(const char*)))
+        return 0;
+    for (size_t i = 0; i < query->step_count; i++) {
+        const char* tag = query->steps[i].tag;
+        result->tags[i] = tag && symbols ? find_XMLSymbol(symbols, tag) : NULL;
+    }
+
+    if (query->absolute) {
+        while (node->parent)
+            node = node->parent;
+        select_XMLQueryNodes(result, &query->steps[0], result->tags[0], &node, 1);
+    } else {
+        XMLList* children = get_XMLChildren(node);
+        select_XMLQueryNodes(result, &query->steps[0], result->tags[0], (XMLNode**)children->items, children->count);
+    }
+
+    for (size_t i = 1; i < query->step_count && result->count; i++) {
+        /* The matches of the last step become the context of this one */
+        XMLNode** context = result->nodes;
+        size_t context_size = result->size;
+        size_t count = result->count;
+        result->nodes = result->context;
+        result->size = result->context_size;
+        result->context = context;
+        result->context_size = context_size;
+        result->count = 0;
+        select_XMLQueryStep(result, &query->steps[i], result->tags[i], context, count);
+    }
+    if (result->failed)
+        result->count = 0;
+    return result->count;
+}
+
+
+/* PROJECTION IMPLEMENTATION */
+
+void free_XMLProjection(XMLProjection* projection) {
+    if (projection) {
+        for (size_t i = 0; i < projection->count; i++)
+            free_XMLQuery(projection->paths[i]);
+        free(projection->paths);
+        free(projection);
+    }
+}
+
+/*
+ * Compiles up to PROJECTION_PATHS paths for doc->projection, the same projection can be set on many documents.
+ * Paths start at the document element, like "DOC/window/layout/slider", and are tag names or '*' joined by '/'.
+ * The elements at the end of a path are built with everything inside them, their ancestors only with
+ * their attributes. Returns NULL if a path is malformed, has predicates or '//', or when out of memory.
+ */
+XMLProjection* compile_XMLProjection(const char** paths, size_t count) {
+    if (count > PROJECTION_PATHS) {
+        fprintf(stderr, "A projection has at most %d paths\n", PROJECTION_PATHS);
+        return NULL;
+    }
+    XMLProjection* projection = calloc(1, sizeof(XMLProjection));
+    if (!projection || !(projection->paths = calloc(count ? count : 1, sizeof(XMLQuery*)))) {
+        free(projection);
+        return fail_XMLMemory(NULL);
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        XMLQuery* path = compile_XMLQuery(paths[i]);
+        if (!path) {
+            free_XMLProjection(projection);
+            return NULL;
+        }
+        projection->paths[projection->count++] = path;
+
+        /* Only child steps can be followed before the attributes of an element are known */
+        for (size_t j = 0; j < path->step_count; j++) {
+            if (path->steps[j].descendant || path->steps[j].predicate_count) {
+                fprintf(stderr, "Projections only have child steps without predicates in '%s'\n", paths[i]);
+                free_XMLProjection(projection);
+                return NULL;
+            }
+        }
+    }
+    return projection;
+}
+
+
+/* BLOB IMPLEMENTATION */
+
+/* Arrays of a blob being written, sized up front by measure_XMLBlob */
+typedef struct XMLBlobWriter {
+    XMLBlobNode* nodes;
+    uint32_t node_count;
+    XMLBlobAttribute* attributes;
+    uint32_t attribute_count;
+    char* strings;
+    uint32_t strings_size;
+    XMLAttributeSlot* slots;    /* Strings already written, item is their offset plus one */
+    uint32_t mask;
+} XMLBlobWriter;
+
+/* Adds up the nodes, attributes and string bytes below node. */
+void measure_XMLBlob(XMLNode* node, size_t* nodes, size_t* attributes, size_t* strings) {
+    (*nodes)++;
+    *strings += strlen(node->tag) + 1;
+    decode_XMLAttributes(node);
+    expand_XMLNode(node);
+    *attributes += node->attributes->count;
+    for (size_t i = 0; i < node->attributes->count; i++) {
+        XMLAttribute* attribute = node->attributes->items[i];
+        *strings += strlen(attribute->key) + 1;
+        if (attribute->value)
+            *strings += strlen(attribute->value) + 1;
+    }
+    for (size_t i = 0; i < node->inner_xml->count; i++) {
+        XMLValue* value = node->inner_xml->items[i];
+        if (value->type == XMLTypeNode) {
+            measure_XMLBlob(value->value, nodes, attributes, strings);
+        } else {
+            (*nodes)++;
+            *strings += strlen(value->value) + 1;
+        }
+    }
+}
+
+/* Returns the offset of a string, every distinct string is written once. */
+uint32_t add_XMLBlobString(XMLBlobWriter* writer, const char* string) {
+    size_t length = strlen(string);
+    uint32_t hash = hash_XMLString(string, length);
+    uint32_t slot = hash & writer->mask;
+    for (; writer->slots[slot].item; slot = (slot + 1) & writer->mask) {
+        uint32_t offset = writer->slots[slot].item - 1;
+        if (writer->slots[slot].hash == hash && !strcmp(writer->strings + offset, string))
+            return offset;
+    }
+
+    uint32_t offset = writer->strings_size;
+    memcpy(writer->strings + offset, string, length + 1);
+    writer->strings_size += (uint32_t)length + 1;
+    writer->slots[slot].hash = hash;
+    writer->slots[slot].item = offset + 1;
+    return offset;
+}
+
+uint32_t add_XMLBlobNode(XMLBlobWriter* writer, enum XMLType type, const char* value, uint32_t parent) {
+    uint32_t index = writer->node_count++;
+    XMLBlobNode* node = &writer->nodes[index];
+    node->type = type;
+    node->parent = parent;
+    node->first_child = FLAT_NONE;
+    node->next_sibling = FLAT_NONE;
+    node->attributes = writer->attribute_count;
+    node->attribute_count = 0;
+    node->value = add_XMLBlobString(writer, value);
+    return index;
+}
+
+/* Writes an element and everything inside it in document order, returns its index. */
+uint32_t fill_XMLBlob(XMLBlobWriter* writer, XMLNode* node, uint32_t parent) {
+    uint32_t index = add_XMLBlobNode(writer, XMLTypeNode, node->tag, parent);
+    writer->nodes[index].attribute_count = (uint32_t)node->attributes->count;
+    for (size_t i = 0; i < node->attributes->count; i++) {
+        XMLAttribute* attribute = node->attributes->items[i];
+        XMLBlobAttribute* blob_attribute = &writer->attributes[writer->attribute_count++];
+        blob_attribute->key = add_XMLBlobString(writer, attribute->key);
+        blob_attribute->value = attribute->value ? add_XMLBlobString(writer, attribute->value) : FLAT_NONE;
+    }
+
+    uint32_t last = FLAT_NONE;
+    for (size_t i = 0; i < node->inner_xml->count; i++) {
+        XMLValue* value = node->inner_xml->items[i];
+        uint32_t child = value->type == XMLTypeNode ? fill_XMLBlob(writer, value->value, index)
+            : add_XMLBlobNode(writer, XMLTypeText, value->value, index);
+        if (last == FLAT_NONE)
+            writer->nodes[index].first_child = child;
+        else
+            writer->nodes[last].next_sibling = child;
+        last = child;
+    }
+    return index;
+}
+
+/*
+ * Writes the tree below root to a blob file that load_XMLBlob maps back without parsing.
+ * The blob uses the byte order of the machine that wrote it. Returns false on failure.
+ */
+bool write_XMLBlob(XMLNode* root, const char* filename) {
+    size_t nodes = 0, attributes = 0, strings = 0;
+    measure_XMLBlob(root, &nodes, &attributes, &strings);
+    /* Offsets, indices and the slots of the strings have to fit 32 bits */
+    if (strings >= FLAT_NONE || nodes >= FLAT_NONE || attributes >= FLAT_NONE || nodes + attributes * 2 > UINT32_MAX / 2) {
+        fprintf(stderr, "Tree is too large for a blob\n");
+        return false;
+    }
+
+    size_t size = sizeof(XMLBlobHeader) + sizeof(XMLBlobNode) * nodes + sizeof(XMLBlobAttribute) * attributes + strings;
+    char* data = malloc(size);
+    if (!data) {
+        fail_XMLMemory(NULL);
+        return false;
+    }
+
+    /* Room for every string at most half full */
+    size_t slots = 1;
+    while (slots < (nodes + attributes * 2) * 2)
+        slots *= 2;
+
+    XMLBlobWriter writer;
+    writer.nodes = (XMLBlobNode*)(data + sizeof(XMLBlobHeader));
+    writer.node_count = 0;
+    writer.attributes = (XMLBlobAttribute*)(writer.nodes + nodes);
+    writer.attribute_count = 0;
+    writer.strings = (char*)(writer.attributes + attributes);
+    writer.strings_size = 0;
+    writer.slots = calloc(slots, sizeof(XMLAttributeSlot));
+    writer.mask = (uint32_t)(slots - 1);
+    if (!writer.slots) {
+        free(data);
+        fail_XMLMemory(NULL);
+        return false;
+    }
+    fill_XMLBlob(&writer, root, FLAT_NONE);
+    free(writer.slots);
+
+    /* Repeated strings were left out */
+    size -= strings - writer.strings_size;
+
+    XMLBlobHeader* header = (XMLBlobHeader*)data;
+    memcpy(header->magic, "SXMB", 4);
+    header->version = BLOB_VERSION;
+    header->node_count = writer.node_count;
+    header->attribute_count = writer.attribute_count;
+    header->strings_size = writer.strings_size;
+    header->checksum = 0;
+    header->checksum = hash_XMLString(data, size);
+
+    FILE* file = fopen(filename, "wb");
+    if (!file) {
+        fprintf(stderr, "Could not write file '%s'\n", filename);
+        free(data);
+        return false;
+    }
+    bool success = fwrite(data, 1, size, file) == size;
+    success &= fclose(file) == 0;
+    free(data);
+    if (!success)
+        fprintf(stderr, "Could not write file '%s'\n", filename);
+    return success;
+}
+
+void free_XMLBlob(XMLBlob* blob) {
+    if (blob) {
+#ifndef _WIN32
+        if (blob->mapped)
+            munmap((void*)blob->data, blob->size);
+        else
+#endif
+            free((void*)blob->data);
+        free(blob);
+    }
+}
+
+/* Returns true if every index and offset of the blob stays inside its sections, and every link points forward in document order. */
+bool check_XMLBlob(const XMLBlob* blob, uint32_t strings_size) {
+    /* Strings at any offset end inside the strings */
+    if (strings_size && blob->strings[strings_size - 1] != '\0')
+        return false;
+
+    for (uint32_t i = 0; i < blob->node_count; i++) {
+        const XMLBlobNode* node = &blob->nodes[i];
+        if ((node->type != XMLTypeNode && node->type != XMLTypeText) || node->value >= strings_size
+            || (size_t)node->attributes + node->attribute_count > blob->attribute_count
+            || (node->parent != FLAT_NONE && node->parent >= i)
+            || (node->first_child != FLAT_NONE && (node->first_child <= i || node->first_child >= blob->node_count))
+            || (node->next_sibling != FLAT_NONE && (node->next_sibling <= i || node->next_sibling >= blob->node_count)))
+            return false;
+    }
+    for (uint32_t i = 0; i < blob->attribute_count; i++) {
+        const XMLBlobAttribute* attribute = &blob->attributes[i];
+        if (attribute->key >= strings_size || (attribute->value != FLAT_NONE && attribute->value >= strings_size))
+            return false;
+    }
+    return true;
+}
+
+/*
+ * Maps a blob of write_XMLBlob read only, so processes loading the same blob share its pages.
+ * The whole blob is checksummed once when it is loaded, and the nodes and attributes are checked to stay inside it.
+ * Returns NULL if the file is missing, or was written by another version or got corrupted.
+ */
+XMLBlob* load_XMLBlob(const char* filename) {
+    XMLBlob* blob = malloc(sizeof(XMLBlob));
+    if (!blob)
+        return fail_XMLMemory(NULL);
+    blob->data = NULL;
+    blob->size = 0;
+    blob->mapped = false;
+
+#ifdef _WIN32
+    FILE* file = fopen(filename, "rb");
+    if (file) {
+        fseek(file, 0, SEEK_END);
+        blob->size = ftell(file);
+        fseek(file, 0, SEEK_SET);
+        blob->data = malloc(blob->size ? blob->size : 1);
+        if (!blob->data || fread((void*)blob->data, 1, blob->size, file) != blob->size)
+            blob->size = 0;
+        fclose(file);
+    }
+#else
+    int file = open(filename, O_RDONLY);
+    struct stat info;
+    if (file >= 0 && fstat(file, &info) == 0 && info.st_size > 0) {
+        void* data = mmap(NULL, (size_t)info.st_size, PROT_READ, MAP_SHARED, file, 0);
+        if (data != MAP_FAILED) {
+            blob->data = data;
+            blob->size = (size_t)info.st_size;
+            blob->mapped = true;
+        }
+    }
+    if (file >= 0)
+        close(file);
+#endif
+    if (!blob->size) {
+        fprintf(stderr, "Could not load file from '%s'\n", filename);
+        free_XMLBlob(blob);
+        return NULL;
+    }
+
+    /* The counts have to add up to the size before the sections can be trusted */
+    XMLBlobHeader header;
+    memset(&header, 0, sizeof(XMLBlobHeader));
+    if (blob->size >= sizeof(XMLBlobHeader))
+        memcpy(&header, blob->data, sizeof(XMLBlobHeader));
+    uint32_t checksum = header.checksum;
+    header.checksum = 0;
+    if (blob->size < sizeof(XMLBlobHeader) || memcmp(header.magic, "SXMB", 4) != 0 || header.version != BLOB_VERSION
+        || blob->size != sizeof(XMLBlobHeader) + sizeof(XMLBlobNode) * (size_t)header.node_count
+            + sizeof(XMLBlobAttribute) * (size_t)header.attribute_count + header.strings_size
+        || checksum != mix_XMLHash(hash_XMLString((const char*)&header, sizeof(XMLBlobHeader)),
+            blob->data + sizeof(XMLBlobHeader), blob->size - sizeof(XMLBlobHeader))) {
+        fprintf(stderr, "'%s' is not a blob of this version\n", filename);
+        free_XMLBlob(blob);
+        return NULL;
+    }
+
+    blob->nodes = (const XMLBlobNode*)(blob->data + sizeof(XMLBlobHeader));
+    blob->node_count = header.node_count;
+    blob->attributes = (const XMLBlobAttribute*)(blob->nodes + blob->node_count);
+    blob->attribute_count = header.attribute_count;
+    blob->strings = (const char*)(blob->attributes + blob->attribute_count);
+    if (!check_XMLBlob(blob, header.strings_size)) {
+        fprintf(stderr, "'%s' is corrupted\n", filename);
+        free_XMLBlob(blob);
+        return NULL;
+    }
+    return blob;
+}
+
+/* Returns the string at an offset of the blob, or NULL for FLAT_NONE. */
+const char* get_XMLBlobString(const XMLBlob* blob, uint32_t offset) {
+    return offset != FLAT_NONE ? blob->strings + offset : NULL;
+}
+
+/* Returns the element the blob was written from, or NULL for an empty blob. */
+const XMLBlobNode* get_XMLBlobRoot(const XMLBlob* blob) {
+    return blob->node_count ? &blob->nodes[0] : NULL;
+}
+
+const XMLBlobNode* get_XMLBlobParent(const XMLBlob* blob, const XMLBlobNode* node) {
+    return node->parent != FLAT_NONE ? &blob->nodes[node->parent] : NULL;
+}
+
+/* Returns the first element inside a node, text is reached through first_child and next_sibling. */
+const XMLBlobNode* first_XMLBlobChild(const XMLBlob* blob, const XMLBlobNode* node) {
+    uint32_t index = node->first_child;
+    while (index != FLAT_NONE && blob->nodes[index].type != XMLTypeNode)
+        index = blob->nodes[index].next_sibling;
+    return index != FLAT_NONE ? &blob->nodes[index] : NULL;
+}
+
+/* Returns the next element after a node with the same parent. */
+const XMLBlobNode* next_XMLBlobSibling(const XMLBlob* blob, const XMLBlobNode* node) {
+    uint32_t index = node->next_sibling;
+    while (index != FLAT_NONE && blob->nodes[index].type != XMLTypeNode)
+        index = blob->nodes[index].next_sibling;
+    return index != FLAT_NONE ? &blob->nodes[index] : NULL;
+}
+
+/* Returns the first attribute of a node with the given key, or NULL. */
+const XMLBlobAttribute* get_XMLBlobAttribute(const XMLBlob* blob, const XMLBlobNode* node, const char* key) {
+    const XMLBlobAttribute* attributes = &blob->attributes[node->attributes];
+    for (uint32_t i = 0; i < node->attribute_count; i++) {
+        if (!strcmp(blob->strings + attributes[i].key, key))
+            return &attributes[i];
     }
-    /* We are done parsing free file and return root */
-    free_file(doc);
-    if (root->children->count > 0) {
-        ((XMLNode*)root->children->items[0])->parent = NULL;
-        return root->children->items[0];
-    }
     return NULL;
 }
 
+
+/* WRITER IMPLEMENTATION */
+
+/* Writes the buffer to the file descriptor of the writer and empties it. */
+bool flush_XMLWriter(XMLWriter* writer) {
+    size_t written = 0;
+    while (!writer->failed && written < writer->length) {
+#ifdef _WIN32
+        int result = _write(writer->fd, writer->buffer + written, (unsigned int)(writer->length - written));
+#else
+        ssize_t result = write(writer->fd, writer->buffer + written, writer->length - written);
+#endif
+        if (result <= 0) {
+            fprintf(stderr, "Could not write to file descriptor %d\n", writer->fd);
+            writer->failed = true;
+        }
+        else
+            written += (size_t)result;
+    }
+    writer->length = 0;
+    return !writer->failed;
+}
+
+/* Makes room for length more bytes, by flushing to the file or by growing the buffer. Returns false when out of memory. */
+bool reserve_XMLWriter(XMLWriter* writer, size_t length) {
+    if (writer->size - writer->length >= length)
+        return true;
+
+    if (writer->fd >= 0) {
+        flush_XMLWriter(writer);
+        if (writer->size >= length)
+            return true;
+    }
+
+    size_t size = writer->size;
+    while (size - writer->length < length)
+        size *= 2;
+    char* buffer = realloc(writer->buffer, size);
+    if (!buffer) {
+        fail_XMLMemory(NULL);
+        writer->failed = true;
+        return false;
+    }
+    writer->buffer = buffer;
+    writer->size = size;
+    return true;
+}
+
+void put_XMLWriter(XMLWriter* writer, const char* data, size_t length) {
+    if (!reserve_XMLWriter(writer, length))
+        return;
+    memcpy(writer->buffer + writer->length, data, length);
+    writer->length += length;
+}
+
+/*
+ * Writes an attribute value with its quotes and backslashes escaped by a backslash, which the tokenizer removes again.
+ * This is sxml's own escape, not XML: other parsers keep the backslashes, and '<' and '&' are written as they are.
+ */
+void put_XMLValue(XMLWriter* writer, const char* string) {
+    const char* start = string;
+    const char* p = string;
+    for (; *p; p++) {
+        if (*p != '"' && *p != '\'' && *p != '\\')
+            continue;
+        put_XMLWriter(writer, start, p - start);
+        put_XMLWriter(writer, "\\", 1);
+        start = p;
+    }
+    put_XMLWriter(writer, start, p - start);
+}
+
+/* Returns true if the parser reads the text back unchanged, without markup and with whitespace it would not collapse. */
+bool is_XMLPlainText(const char* string) {
+    if (is_whitespace(*string))
+        return false;
+    for (const char* p = string; *p; p++) {
+        if (*p == '<' || (is_whitespace(*p) && (!p[1] || is_whitespace(p[1]))))
+            return false;
+    }
+    return true;
+}
+
+/*
+ * Writes text like the parser stores it, references such as "&amp;" are not decoded so they are written as they are.
+ * Text with markup or whitespace the parser would collapse is written as CDATA.
+ */
+void put_XMLText(XMLWriter* writer, const char* string) {
+    if (is_XMLPlainText(string)) {
+        put_XMLWriter(writer, string, strlen(string));
+        return;
+    }
+
+    /* A "]]>" inside is split over two sections */
+    put_XMLWriter(writer, "<![CDATA[", 9);
+    const char* start = string;
+    const char* end;
+    while ((end = strstr(start, "]]>"))) {
+        put_XMLWriter(writer, start, end + 2 - start);
+        put_XMLWriter(writer, "]]><![CDATA[", 12);
+        start = end + 2;
+    }
+    put_XMLWriter(writer, start, strlen(start));
+    put_XMLWriter(writer, "]]>", 3);
+}
+
+void put_XMLIndent(XMLWriter* writer, size_t depth) {
+    if (!reserve_XMLWriter(writer, depth * 4))
+        return;
+    memset(writer->buffer + writer->length, ' ', depth * 4);
+    writer->length += depth * 4;
+}
+
+/* Writes an element with its attributes, text and children in the order of inner_xml. */
+void put_XMLElement(XMLWriter* writer, XMLNode* node, size_t depth) {
+    bool pretty = writer->format == XMLFormatPretty;
+    size_t tag_length = strlen(node->tag);
+    if (pretty)
+        put_XMLIndent(writer, depth);
+    put_XMLWriter(writer, "<", 1);
+    put_XMLWriter(writer, node->tag, tag_length);
+    bool decoded = decode_XMLAttributes(node);
+    if (!expand_XMLNode(node) || !decoded)
+        writer->failed = true;
+    for (size_t i = 0; i < node->attributes->count; i++) {
+        XMLAttribute* attribute = node->attributes->items[i];
+        put_XMLWriter(writer, " ", 1);
+        put_XMLWriter(writer, attribute->key, strlen(attribute->key));
+        if (attribute->value) {
+            put_XMLWriter(writer, "=\"", 2);
+            put_XMLValue(writer, attribute->value);
+            put_XMLWriter(writer, "\"", 1);
+        }
+    }
+
+    if (!node->inner_xml->count) {
+        put_XMLWriter(writer, pretty ? "/>\n" : "/>", pretty ? 3 : 2);
+        return;
+    }
+    put_XMLWriter(writer, ">", 1);
+
+    /* Text only elements stay on one line */
+    bool nested = pretty && node->children->count;
+    if (nested)
+        put_XMLWriter(writer, "\n", 1);
+    for (size_t i = 0; i < node->inner_xml->count; i++) {
+        XMLValue* value = node->inner_xml->items[i];
+        if (value->type == XMLTypeNode) {
+            put_XMLElement(writer, value->value, depth + 1);
+            continue;
+        }
+        if (nested)
+            put_XMLIndent(writer, depth + 1);
+        put_XMLText(writer, value->value);
+        if (nested)
+            put_XMLWriter(writer, "\n", 1);
+    }
+
+    if (nested)
+        put_XMLIndent(writer, depth);
+    put_XMLWriter(writer, "</", 2);
+    put_XMLWriter(writer, node->tag, tag_length);
+    put_XMLWriter(writer, pretty ? ">\n" : ">", pretty ? 2 : 1);
+}
+
+bool init_XMLWriter(XMLWriter* writer, int fd, enum XMLFormat format) {
+    writer->buffer = malloc(WRITER_BUFFER_SIZE);
+    if (!writer->buffer) {
+        fail_XMLMemory(NULL);
+        return false;
+    }
+    writer->length = 0;
+    writer->size = WRITER_BUFFER_SIZE;
+    writer->fd = fd;
+    writer->format = format;
+    writer->failed = false;
+    return true;
+}
+
+/*
+ * Serializes node and everything inside it into a NUL terminated string the caller frees,
+ * and sets length to its length when length is not NULL. Returns NULL when out of memory.
+ * The output is the dialect sxml parses back into the same tree, which is only well-formed XML when every
+ * attribute has a value, no value holds a quote, a backslash or '<' and no text or value holds a bare '&'.
+ */
+char* write_XMLString(XMLNode* node, enum XMLFormat format, size_t* length) {
+    XMLWriter writer;
+    if (!init_XMLWriter(&writer, -1, format))
+        return NULL;
+    put_XMLElement(&writer, node, 0);
+    put_XMLWriter(&writer, "", 1);
+    if (writer.failed) {
+        free(writer.buffer);
+        return NULL;
+    }
+    if (length)
+        *length = writer.length - 1;
+    return writer.buffer;
+}
+
+/* Serializes node and everything inside it to a file descriptor through one buffer, in the dialect of write_XMLString. Returns false on failure. */
+bool write_XMLFile(XMLNode* node, enum XMLFormat format, int fd) {
+    XMLWriter writer;
+    if (!init_XMLWriter(&writer, fd, format))
+        return false;
+    put_XMLElement(&writer, node, 0);
+    bool success = flush_XMLWriter(&writer);
+    free(writer.buffer);
+    return success;
+}
+
 #endif /* SXML_H */
\ No newline at end of file
@@ -8,7 +8,6 @@ int main(int argc, char** argv) {
         if (root != NULL) {
             print_XMLNode(root, 0);
         }
-        free_XMLStacks();
     }
     free_XMLDocument(doc);
     return 0;
@@ -1,3 +1,4 @@
+#include <stddef.h>
 #include "sxml.h"
 #include "./libs/CuTest.h"
 
@@ -32,13 +33,13 @@ void test_parse_XMLDocument(CuTest* tc){
     CuAssertPtrNotNull(tc, groot->children);
     CuAssertPtrNotNull(tc, groot->attributes);
     CuAssertPtrNotNull(tc, groot->inner_xml);
-    CuAssertPtrNotNullMsg(tc, "Failed to initialise Node stack", SXML_NODES);
-    CuAssertPtrNotNullMsg(tc, "Failed to initialise Attributes stack", SXML_ATTRIBUTES);
-    CuAssertPtrNotNullMsg(tc, "Failed to initialise Text stack", SXML_TEXT);
+    CuAssertPtrNotNullMsg(tc, "Failed to initialise Node stack", gdoc->nodes);
+    CuAssertPtrNotNullMsg(tc, "Failed to initialise Attributes stack", gdoc->attributes);
+    CuAssertPtrNotNullMsg(tc, "Failed to initialise Text stack", gdoc->text);
     
-    CuAssertIntEquals(tc, 2, SXML_NODES->count);
-    CuAssertIntEquals(tc, 0, SXML_ATTRIBUTES->count);
-    CuAssertIntEquals(tc, 0, SXML_TEXT->count);
+    CuAssertIntEquals(tc, 2, gdoc->nodes->count);
+    CuAssertIntEquals(tc, 0, gdoc->attributes->count);
+    CuAssertIntEquals(tc, 0, gdoc->text->count);
 
     CuAssertPtrEquals(tc, NULL, groot->parent);
 
@@ -48,7 +49,6 @@ void test_parse_XMLDocument(CuTest* tc){
     
     CuAssertStrEquals(tc, "DOC", groot->tag);
     free_XMLDocument(gdoc);
-    free_XMLStacks();
 }
 
 void test_parse_declaration_XMLNode(CuTest* tc){
@@ -59,9 +59,9 @@ void test_parse_declaration_XMLNode(CuTest* tc){
     if(gdoc->buffer)
         groot = parse_xml(gdoc);
 
-    CuAssertIntEquals(tc, 2, SXML_NODES->count);
-    CuAssertIntEquals(tc, 2, SXML_ATTRIBUTES->count);
-    CuAssertIntEquals(tc, 0, SXML_TEXT->count);
+    CuAssertIntEquals(tc, 2, gdoc->nodes->count);
+    CuAssertIntEquals(tc, 2, gdoc->attributes->count);
+    CuAssertIntEquals(tc, 0, gdoc->text->count);
 
     CuAssertPtrNotNull(tc, gdoc->info);
     CuAssertIntEquals(tc, 2, gdoc->info->count);
@@ -75,7 +75,6 @@ void test_parse_declaration_XMLNode(CuTest* tc){
     CuAssertStrEquals(tc, "encoding", encoding->key);
     CuAssertStrEquals(tc, "utf-8", encoding->value);
     free_XMLDocument(gdoc);
-    free_XMLStacks();
 }
 
 void test_parse_attributes(CuTest* tc) {
@@ -86,9 +85,9 @@ void test_parse_attributes(CuTest* tc) {
     if (gdoc->buffer)
         groot = parse_xml(gdoc);
 
-    CuAssertIntEquals(tc, 2, SXML_NODES->count);
-    CuAssertIntEquals(tc, 6, SXML_ATTRIBUTES->count);
-    CuAssertIntEquals(tc, 0, SXML_TEXT->count);
+    CuAssertIntEquals(tc, 2, gdoc->nodes->count);
+    CuAssertIntEquals(tc, 6, gdoc->attributes->count);
+    CuAssertIntEquals(tc, 0, gdoc->text->count);
 
     XMLAttribute* svalue = get_XMLAttribute(groot, "svalue");
     XMLAttribute* title = get_XMLAttribute(groot, "title");
@@ -112,7 +111,6 @@ void test_parse_attributes(CuTest* tc) {
     CuAssertPtrEquals(tc, NULL, evalue->value);
 
     free_XMLDocument(gdoc);
-    free_XMLStacks();
 }
 
 void test_parse_inline(CuTest* tc) {
@@ -123,9 +121,9 @@ void test_parse_inline(CuTest* tc) {
     if (gdoc->buffer)
         groot = parse_xml(gdoc);
 
-    CuAssertIntEquals(tc, 2, SXML_NODES->count);
-    CuAssertIntEquals(tc, 5, SXML_ATTRIBUTES->count);
-    CuAssertIntEquals(tc, 0, SXML_TEXT->count);
+    CuAssertIntEquals(tc, 2, gdoc->nodes->count);
+    CuAssertIntEquals(tc, 5, gdoc->attributes->count);
+    CuAssertIntEquals(tc, 0, gdoc->text->count);
 
     CuAssertStrEquals(tc, "br", groot->tag);
 
@@ -154,7 +152,6 @@ void test_parse_inline(CuTest* tc) {
     CuAssertPtrEquals(tc, NULL, ev->value);
 
     free_XMLDocument(gdoc);
-    free_XMLStacks();
 }
 
 void test_inner_xml(CuTest* tc) {
@@ -165,9 +162,9 @@ void test_inner_xml(CuTest* tc) {
     if (gdoc->buffer)
         groot = parse_xml(gdoc);
 
-    CuAssertIntEquals(tc, 4, SXML_NODES->count);
-    CuAssertIntEquals(tc, 1, SXML_ATTRIBUTES->count);
-    CuAssertIntEquals(tc, 4, SXML_TEXT->count);
+    CuAssertIntEquals(tc, 4, gdoc->nodes->count);
+    CuAssertIntEquals(tc, 1, gdoc->attributes->count);
+    CuAssertIntEquals(tc, 4, gdoc->text->count);
 
     CuAssertStrEquals(tc, "DOC", groot->tag);
 
@@ -188,7 +185,7 @@ void test_inner_xml(CuTest* tc) {
         "final string",
     };
 
-    for (int i = 0; i < groot->inner_xml->count; i++) {
+    for (size_t i = 0; i < groot->inner_xml->count; i++) {
         XMLValue* item = groot->inner_xml->items[i];
         CuAssertIntEquals(tc, inner_xml_types[i], item->type);
         if (item->type)
@@ -198,7 +195,6 @@ void test_inner_xml(CuTest* tc) {
     }
 
     free_XMLDocument(gdoc);
-    free_XMLStacks();
 }
 
 void test_parse_example(CuTest* tc) {
@@ -210,19 +206,1618 @@ void test_parse_example(CuTest* tc) {
     if (gdoc->buffer)
         groot = parse_xml(gdoc);
 
-    CuAssertIntEquals(tc, 15, SXML_NODES->count);
-    CuAssertIntEquals(tc, 29, SXML_ATTRIBUTES->count);
-    CuAssertIntEquals(tc, 5, SXML_TEXT->count);
+    CuAssertIntEquals(tc, 15, gdoc->nodes->count);
+    CuAssertIntEquals(tc, 29, gdoc->attributes->count);
+    CuAssertIntEquals(tc, 5, gdoc->text->count);
 
     free_XMLDocument(gdoc);
 }
 
-void test_free_XMLStacks(CuTest* tc){
-    free_XMLStacks();
-    CuAssertPtrEquals(tc, NULL, SXML_NODES);
-    CuAssertPtrEquals(tc, NULL, SXML_ATTRIBUTES);
-    CuAssertPtrEquals(tc, NULL, SXML_TEXT);
+void test_parse_reentrant(CuTest* tc) {
+    /* Two documents parsed one after the other keep their own trees */
+    XMLDocument* first = new_XMLDocument();
+    XMLDocument* second = new_XMLDocument();
+    CuAssertIntEquals(tc, 1, load_file(first, "../tests/example.xml"));
+    CuAssertIntEquals(tc, 1, load_file(second, "../tests/attributes.xml"));
+
+    XMLNode* first_root = parse_xml(first);
+    XMLNode* second_root = parse_xml(second);
+    CuAssertPtrNotNull(tc, first_root);
+    CuAssertPtrNotNull(tc, second_root);
+    CuAssertIntEquals(tc, 15, first->nodes->count);
+    CuAssertIntEquals(tc, 2, second->nodes->count);
+
+    /* Freeing one document leaves the other untouched */
+    free_XMLDocument(first);
+    CuAssertStrEquals(tc, "DOC", second_root->tag);
+    CuAssertIntEquals(tc, 6, second->attributes->count);
+    free_XMLDocument(second);
+}
+
+void test_parse_arena(CuTest* tc) {
+    gdoc = new_XMLDocument();
+    CuAssertPtrNotNull(tc, gdoc);
+    CuAssertIntEquals(tc, 1, load_file(gdoc, "../tests/example.xml"));
+
+    gdoc->options |= XMLOptionArena;
+    if (gdoc->buffer)
+        groot = parse_xml(gdoc);
+
+    CuAssertPtrNotNull(tc, groot);
+    CuAssertPtrNotNull(tc, gdoc->arena);
+
+    /* Arena documents are not tracked by the stacks */
+    CuAssertPtrEquals(tc, NULL, gdoc->nodes);
+    CuAssertPtrEquals(tc, NULL, gdoc->attributes);
+    CuAssertPtrEquals(tc, NULL, gdoc->text);
+
+    CuAssertStrEquals(tc, "DOC", groot->tag);
+    CuAssertIntEquals(tc, 2, groot->children->count);
+
+    XMLNode* window = groot->children->items[1];
+    CuAssertStrEquals(tc, "window", window->tag);
+    CuAssertIntEquals(tc, 3, window->children->count);
+    CuAssertStrEquals(tc, "Window 2", get_XMLAttribute(window, "title")->value);
+
+    XMLNode* layout = window->children->items[2];
+    CuAssertIntEquals(tc, 6, layout->children->count);
+    CuAssertStrEquals(tc, "128", get_XMLAttribute(layout->children->items[5], "value")->value);
+
+    free_XMLDocument(gdoc);
+}
+
+void test_parse_in_situ(CuTest* tc) {
+    gdoc = new_XMLDocument();
+    CuAssertPtrNotNull(tc, gdoc);
+    CuAssertIntEquals(tc, 1, load_file(gdoc, "../tests/example.xml"));
+
+    gdoc->options |= XMLOptionInSitu;
+    if (gdoc->buffer)
+        groot = parse_xml(gdoc);
+
+    CuAssertPtrNotNull(tc, groot);
+    CuAssertPtrNotNull(tc, gdoc->buffer);
+
+    /* Strings point into the document buffer */
+    char* begin = gdoc->buffer;
+    char* end = gdoc->buffer + gdoc->file_size;
+    CuAssertStrEquals(tc, "DOC", groot->tag);
+    CuAssertTrue(tc, groot->tag > begin && groot->tag < end);
+
+    XMLNode* window = groot->children->items[0];
+    XMLAttribute* title = get_XMLAttribute(window, "title");
+    CuAssertStrEquals(tc, "\"Window 1\'", title->value);
+    CuAssertTrue(tc, title->value > begin && title->value < end);
+    CuAssertPtrEquals(tc, NULL, get_XMLAttribute(window, "notitle")->value);
+
+    XMLNode* p = window->children->items[0];
+    XMLValue* text = p->inner_xml->items[0];
+    CuAssertStrEquals(tc, "Hello my man i do code I dont know", (char*)text->value);
+    CuAssertTrue(tc, (char*)text->value > begin && (char*)text->value < end);
+
+    XMLAttribute* version = gdoc->info->items[0];
+    CuAssertStrEquals(tc, "version", version->key);
+    CuAssertStrEquals(tc, "1.0", version->value);
+
+    free_XMLDocument(gdoc);
+}
+
+void test_map_file(CuTest* tc) {
+    gdoc = new_XMLDocument();
+    CuAssertPtrNotNull(tc, gdoc);
+    CuAssertIntEquals(tc, 1, map_file(gdoc, "../tests/doc.xml"));
+    CuAssertPtrNotNull(tc, gdoc->buffer);
+    CuAssertIntEquals(tc, 12, gdoc->file_size);
+    CuAssertStrEquals(tc, "<DOC></DOC>", gdoc->buffer);
+
+    gdoc->options |= XMLOptionInSitu;
+    groot = parse_xml(gdoc);
+    CuAssertPtrNotNull(tc, groot);
+    CuAssertStrEquals(tc, "DOC", groot->tag);
+
+    free_XMLDocument(gdoc);
+
+    gdoc = new_XMLDocument();
+    CuAssertIntEquals(tc, 0, map_file(gdoc, "../tests/missing.xml"));
+    CuAssertPtrEquals(tc, NULL, gdoc->buffer);
+    free_XMLDocument(gdoc);
+}
+
+typedef struct SaxCounts {
+    int start_elements;
+    int end_elements;
+    int attributes;
+    int texts;
+    int comments;
+    int declarations;
+    char last_text[64];
+    char window_title[64];
+} SaxCounts;
+
+void sax_start_element(void* user, const char* tag, XMLAttribute* attributes, size_t count) {
+    SaxCounts* counts = user;
+    counts->start_elements++;
+    counts->attributes += (int)count;
+    if (!strcmp(tag, "window") && count > 1 && !counts->window_title[0])
+        strcpy(counts->window_title, attributes[1].value);
+}
+
+void sax_end_element(void* user, const char* tag) {
+    (void)tag;
+    ((SaxCounts*)user)->end_elements++;
+}
+
+void sax_text(void* user, const char* text) {
+    SaxCounts* counts = user;
+    counts->texts++;
+    strncpy(counts->last_text, text, sizeof(counts->last_text) - 1);
+}
+
+void sax_comment(void* user, const char* comment) {
+    (void)comment;
+    ((SaxCounts*)user)->comments++;
+}
+
+void sax_declaration(void* user, XMLAttribute* attributes, size_t count) {
+    (void)attributes;
+    ((SaxCounts*)user)->declarations += (int)count;
+}
+
+void test_parse_sax(CuTest* tc) {
+    gdoc = new_XMLDocument();
+    CuAssertPtrNotNull(tc, gdoc);
+    CuAssertIntEquals(tc, 1, load_file(gdoc, "../tests/example.xml"));
+
+    SaxCounts counts;
+    memset(&counts, 0, sizeof(counts));
+    XMLHandler handler = { &counts, sax_start_element, sax_end_element, sax_text, sax_comment, sax_declaration };
+    CuAssertTrue(tc, parse_xml_sax(gdoc, &handler));
+
+    CuAssertIntEquals(tc, 13, counts.start_elements);
+    CuAssertIntEquals(tc, 13, counts.end_elements);
+    CuAssertIntEquals(tc, 27, counts.attributes);
+    CuAssertIntEquals(tc, 5, counts.texts);
+    CuAssertIntEquals(tc, 1, counts.comments);
+    CuAssertIntEquals(tc, 2, counts.declarations);
+    CuAssertStrEquals(tc, "Blue", counts.last_text);
+    CuAssertStrEquals(tc, "\"Window 1\'", counts.window_title);
+    free_XMLDocument(gdoc);
+
+    /* Mismatched tags fail the parse */
+    gdoc = new_XMLDocument();
+    gdoc->buffer = _strdup("<a><b></a></b>");
+    gdoc->file_size = strlen(gdoc->buffer) + 1;
+    memset(&counts, 0, sizeof(counts));
+    CuAssertTrue(tc, !parse_xml_sax(gdoc, &handler));
+    free_XMLDocument(gdoc);
+}
+
+void test_feed_xml(CuTest* tc) {
+    XMLDocument* file = new_XMLDocument();
+    CuAssertIntEquals(tc, 1, load_file(file, "../tests/example.xml"));
+    size_t length = file->file_size - 1;
+
+    SaxCounts counts;
+    XMLHandler handler = { &counts, sax_start_element, sax_end_element, sax_text, sax_comment, sax_declaration };
+
+    /* Every chunk size reports the same events */
+    size_t chunk_sizes[] = { 1, 2, 3, 17, 4096 };
+    for (int i = 0; i < 5; i++) {
+        gdoc = new_XMLDocument();
+        memset(&counts, 0, sizeof(counts));
+
+        for (size_t offset = 0; offset < length; offset += chunk_sizes[i]) {
+            size_t chunk = length - offset < chunk_sizes[i] ? length - offset : chunk_sizes[i];
+            CuAssertTrue(tc, feed_xml(gdoc, &handler, file->buffer + offset, chunk));
+
+            /* Only the incomplete token is kept */
+            CuAssertTrue(tc, gdoc->lexer_index < 128);
+        }
+        CuAssertTrue(tc, finish_xml(gdoc, &handler));
+
+        CuAssertIntEquals(tc, 13, counts.start_elements);
+        CuAssertIntEquals(tc, 13, counts.end_elements);
+        CuAssertIntEquals(tc, 27, counts.attributes);
+        CuAssertIntEquals(tc, 5, counts.texts);
+        CuAssertIntEquals(tc, 1, counts.comments);
+        CuAssertIntEquals(tc, 2, counts.declarations);
+        CuAssertStrEquals(tc, "Blue", counts.last_text);
+        CuAssertStrEquals(tc, "\"Window 1\'", counts.window_title);
+        free_XMLDocument(gdoc);
+    }
+    free_XMLDocument(file);
+
+    /* Input ending inside a tag is reported by finish_xml */
+    gdoc = new_XMLDocument();
+    CuAssertTrue(tc, feed_xml(gdoc, &handler, "<DOC><p title=\"a>", 17));
+    CuAssertTrue(tc, !finish_xml(gdoc, &handler));
+    free_XMLDocument(gdoc);
+}
+
+void test_reader(CuTest* tc) {
+    gdoc = new_XMLDocument();
+    CuAssertIntEquals(tc, 1, load_file(gdoc, "../tests/example.xml"));
+    XMLReader* reader = new_XMLReader(gdoc);
+
+    int counts[XMLTokenCData + 1] = { 0 };
+    enum XMLTokenType type;
+    while ((type = next_XMLReader(reader)) != XMLTokenNone && type != XMLTokenError)
+        counts[type]++;
+
+    CuAssertIntEquals(tc, XMLTokenNone, type);
+    CuAssertIntEquals(tc, 13, counts[XMLTokenStartElement]);
+    CuAssertIntEquals(tc, 13, counts[XMLTokenEndElement]);
+    CuAssertIntEquals(tc, 29, counts[XMLTokenAttribute]);
+    CuAssertIntEquals(tc, 5, counts[XMLTokenText]);
+    CuAssertIntEquals(tc, 1, counts[XMLTokenComment]);
+    CuAssertIntEquals(tc, 1, counts[XMLTokenDeclaration]);
+    free_XMLReader(reader);
+    free_XMLDocument(gdoc);
+
+    /* Skip the first window and land on the second one */
+    gdoc = new_XMLDocument();
+    CuAssertIntEquals(tc, 1, load_file(gdoc, "../tests/example.xml"));
+    reader = new_XMLReader(gdoc);
+    while ((type = next_XMLReader(reader)) != XMLTokenStartElement || strncmp(reader->token.name.data, "window", 6))
+        CuAssertTrue(tc, type != XMLTokenNone && type != XMLTokenError);
+
+    CuAssertIntEquals(tc, 2, reader->depth);
+    CuAssertIntEquals(tc, XMLTokenAttribute, next_XMLReader(reader));
+    CuAssertIntEquals(tc, 4, reader->token.name.length);
+    CuAssertTrue(tc, !strncmp(reader->token.name.data, "auto", 4));
+    CuAssertPtrEquals(tc, NULL, reader->token.value.data);
+
+    CuAssertTrue(tc, skip_XMLReader(reader));
+    CuAssertIntEquals(tc, 1, reader->depth);
+    CuAssertIntEquals(tc, XMLTokenStartElement, next_XMLReader(reader));
+    CuAssertIntEquals(tc, XMLTokenAttribute, next_XMLReader(reader));
+    CuAssertIntEquals(tc, 8, reader->token.value.length);
+    CuAssertTrue(tc, !strncmp(reader->token.value.data, "Window 2", 8));
+
+    /* Skip from inside the text of the first paragraph */
+    while ((type = next_XMLReader(reader)) != XMLTokenText)
+        CuAssertTrue(tc, type != XMLTokenNone && type != XMLTokenError);
+    CuAssertIntEquals(tc, 37, reader->token.value.length);
+    CuAssertTrue(tc, skip_XMLReader(reader));
+    CuAssertIntEquals(tc, XMLTokenStartElement, next_XMLReader(reader));
+    CuAssertTrue(tc, !strncmp(reader->token.name.data, "br", 2));
+
+    /* Skip the rest of the document element */
+    CuAssertTrue(tc, skip_XMLReader(reader));
+    CuAssertTrue(tc, skip_XMLReader(reader));
+    CuAssertTrue(tc, skip_XMLReader(reader));
+    CuAssertIntEquals(tc, 0, reader->depth);
+    CuAssertIntEquals(tc, XMLTokenNone, next_XMLReader(reader));
+
+    free_XMLReader(reader);
+    free_XMLDocument(gdoc);
+}
+
+void test_normalize_text(CuTest* tc) {
+    const char* raw = "<DOC>   \n\t Text spanning  more than sixteen bytes,\n\n     with\t\truns   everywhere  \r\n </DOC>";
+    const char* normalized = "Text spanning more than sixteen bytes,\nwith\truns everywhere";
+
+    /* Copied, in situ and preserved text */
+    unsigned int options[] = { 0, XMLOptionInSitu, XMLOptionPreserveWhitespace, XMLOptionPreserveWhitespace | XMLOptionInSitu };
+    for (int i = 0; i < 4; i++) {
+        gdoc = new_XMLDocument();
+        gdoc->buffer = _strdup(raw);
+        gdoc->file_size = strlen(raw) + 1;
+        gdoc->options = options[i];
+        groot = parse_xml(gdoc);
+
+        CuAssertPtrNotNull(tc, groot);
+        CuAssertIntEquals(tc, 1, groot->inner_xml->count);
+        XMLValue* text = groot->inner_xml->items[0];
+        if (options[i] & XMLOptionPreserveWhitespace)
+            CuAssertTrue(tc, !strncmp(raw + 5, text->value, strlen(raw) - 11) && strlen(text->value) == strlen(raw) - 11);
+        else
+            CuAssertStrEquals(tc, normalized, (char*)text->value);
+
+        free_XMLDocument(gdoc);
+    }
+}
+
+void test_preserve_whitespace(CuTest* tc) {
+    gdoc = new_XMLDocument();
+    CuAssertIntEquals(tc, 1, load_file(gdoc, "../tests/inner.xml"));
+    gdoc->options |= XMLOptionPreserveWhitespace;
+    groot = parse_xml(gdoc);
+
+    CuAssertPtrNotNull(tc, groot);
+    CuAssertIntEquals(tc, 5, groot->inner_xml->count);
+    CuAssertStrEquals(tc, "\n  Hello this is the first string\n  ", (char*)((XMLValue*)groot->inner_xml->items[0])->value);
+    CuAssertStrEquals(tc, "\n  final string\n", (char*)((XMLValue*)groot->inner_xml->items[4])->value);
+
+    free_XMLDocument(gdoc);
+}
+
+void test_special_nodes(CuTest* tc) {
+    /* Copied and in situ */
+    for (int i = 0; i < 2; i++) {
+        gdoc = new_XMLDocument();
+        CuAssertIntEquals(tc, 1, load_file(gdoc, "../tests/special.xml"));
+        gdoc->options = i ? XMLOptionInSitu : 0;
+        groot = parse_xml(gdoc);
+
+        CuAssertPtrNotNull(tc, groot);
+        CuAssertStrEquals(tc, "DOC", groot->tag);
+        CuAssertIntEquals(tc, 2, groot->children->count);
+        CuAssertIntEquals(tc, 1, gdoc->info->count);
+
+        /* CDATA is kept as it is between the surrounding text */
+        XMLNode* p = groot->children->items[0];
+        CuAssertIntEquals(tc, 3, p->inner_xml->count);
+        CuAssertStrEquals(tc, "Before", (char*)((XMLValue*)p->inner_xml->items[0])->value);
+        CuAssertStrEquals(tc, "<p> raw  </p> ]] >", (char*)((XMLValue*)p->inner_xml->items[1])->value);
+        CuAssertStrEquals(tc, "after", (char*)((XMLValue*)p->inner_xml->items[2])->value);
+
+        /* Empty CDATA adds no text */
+        CuAssertIntEquals(tc, 0, ((XMLNode*)groot->children->items[1])->inner_xml->count);
+
+        free_XMLDocument(gdoc);
+    }
+
+    /* Push parsing byte by byte */
+    XMLDocument* file = new_XMLDocument();
+    CuAssertIntEquals(tc, 1, load_file(file, "../tests/special.xml"));
+    SaxCounts counts;
+    memset(&counts, 0, sizeof(counts));
+    XMLHandler handler = { &counts, sax_start_element, sax_end_element, sax_text, sax_comment, sax_declaration };
+    gdoc = new_XMLDocument();
+    for (size_t i = 0; i + 1 < file->file_size; i++)
+        CuAssertTrue(tc, feed_xml(gdoc, &handler, file->buffer + i, 1));
+    CuAssertTrue(tc, finish_xml(gdoc, &handler));
+    CuAssertIntEquals(tc, 3, counts.start_elements);
+    CuAssertIntEquals(tc, 3, counts.texts);
+    CuAssertIntEquals(tc, 1, counts.comments);
+    CuAssertStrEquals(tc, "after", counts.last_text);
+    free_XMLDocument(gdoc);
+
+    /* Literals of a DOCTYPE and comments of its subset may hold '>', '[', ']' and quotes */
+    const char* doctypes[] = {
+        "<!DOCTYPE x SYSTEM \"a>b\"><x/>",
+        "<!DOCTYPE x PUBLIC 'p[' \"s]>\" [<!ENTITY e \"]>\"><!-- don't -->]><x/>"
+    };
+    for (int i = 0; i < 2; i++) {
+        gdoc = new_XMLDocument();
+        gdoc->buffer = _strdup(doctypes[i]);
+        gdoc->file_size = strlen(doctypes[i]) + 1;
+        groot = parse_xml(gdoc);
+        CuAssertPtrNotNull(tc, groot);
+        CuAssertStrEquals(tc, "x", groot->tag);
+        CuAssertIntEquals(tc, 0, groot->inner_xml->count);
+        free_XMLDocument(gdoc);
+
+        memset(&counts, 0, sizeof(counts));
+        gdoc = new_XMLDocument();
+        for (size_t j = 0; doctypes[i][j]; j++)
+            CuAssertTrue(tc, feed_xml(gdoc, &handler, doctypes[i] + j, 1));
+        CuAssertTrue(tc, finish_xml(gdoc, &handler));
+        CuAssertIntEquals(tc, 1, counts.start_elements);
+        CuAssertIntEquals(tc, 0, counts.texts);
+        free_XMLDocument(gdoc);
+    }
+
+    /* The reader skips over CDATA holding end tags */
+    gdoc = new_XMLDocument();
+    gdoc->buffer = file->buffer;
+    gdoc->file_size = file->file_size;
+    file->buffer = NULL;
+    XMLReader* reader = new_XMLReader(gdoc);
+    enum XMLTokenType type;
+    while ((type = next_XMLReader(reader)) != XMLTokenStartElement || strncmp(reader->token.name.data, "p", 1))
+        CuAssertTrue(tc, type != XMLTokenNone && type != XMLTokenError);
+    CuAssertTrue(tc, skip_XMLReader(reader));
+    CuAssertIntEquals(tc, XMLTokenStartElement, next_XMLReader(reader));
+    CuAssertIntEquals(tc, XMLTokenCData, next_XMLReader(reader));
+    CuAssertIntEquals(tc, 0, reader->token.value.length);
+
+    free_XMLReader(reader);
+    free_XMLDocument(gdoc);
+    free_XMLDocument(file);
+}
+
+/* Returns true if both trees have the same tags, attributes and inner xml. */
+bool equal_XMLNodes(XMLNode* a, XMLNode* b) {
+    XMLList* a_attributes = get_XMLAttributes(a);
+    XMLList* b_attributes = get_XMLAttributes(b);
+    XMLList* a_inner = get_XMLInnerXML(a);
+    XMLList* b_inner = get_XMLInnerXML(b);
+    if (strcmp(a->tag, b->tag) || a_attributes->count != b_attributes->count || a_inner->count != b_inner->count)
+        return false;
+    for (size_t i = 0; i < a_attributes->count; i++) {
+        XMLAttribute* x = a_attributes->items[i];
+        XMLAttribute* y = b_attributes->items[i];
+        if (strcmp(x->key, y->key) || (x->value == NULL) != (y->value == NULL) || (x->value && strcmp(x->value, y->value)))
+            return false;
+    }
+    for (size_t i = 0; i < a_inner->count; i++) {
+        XMLValue* x = a_inner->items[i];
+        XMLValue* y = b_inner->items[i];
+        if (x->type != y->type)
+            return false;
+        if (x->type == XMLTypeText ? strcmp(x->value, y->value) != 0 : !equal_XMLNodes(x->value, y->value))
+            return false;
+        if (x->type == XMLTypeNode && ((XMLNode*)y->value)->parent != b)
+            return false;
+    }
+    return true;
+}
+
+void test_parse_parallel(CuTest* tc) {
+    /* Many records with text, comments, CDATA and inline nodes between them */
+    char record[] = "<record id=\"%d\"><name>Record %d</name><![CDATA[</record>]]><empty/></record>\n"
+        "text %d <!-- <record> --> <br/><?pi <record>?>\n";
+    size_t size = 0;
+    char* xml = malloc(200 * 200 + 64);
+    size += sprintf(xml, "<?xml version=\"1.0\"?>\n<records count=\"200\">\n");
+    for (int i = 0; i < 200; i++)
+        size += sprintf(xml + size, record, i, i, i);
+    size += sprintf(xml + size, "</records>\n");
+
+    XMLDocument* expected = new_XMLDocument();
+    expected->buffer = _strdup(xml);
+    expected->file_size = size + 1;
+    XMLNode* expected_root = parse_xml(expected);
+    CuAssertPtrNotNull(tc, expected_root);
+    CuAssertIntEquals(tc, 400, expected_root->children->count);
+
+    unsigned int options[] = { 0, XMLOptionArena, XMLOptionInSitu, XMLOptionIntern, XMLOptionIntern | XMLOptionInSitu };
+    size_t threads[] = { 1, 2, 3, 8, 64 };
+    for (int i = 0; i < 5; i++) {
+        for (int j = 0; j < 5; j++) {
+            gdoc = new_XMLDocument();
+            gdoc->buffer = _strdup(xml);
+            gdoc->file_size = size + 1;
+            gdoc->options = options[i];
+            groot = parse_xml_parallel(gdoc, threads[j]);
+
+            CuAssertPtrNotNull(tc, groot);
+            CuAssertPtrEquals(tc, NULL, groot->parent);
+            CuAssertTrue(tc, equal_XMLNodes(expected_root, groot));
+            CuAssertStrEquals(tc, "1.0", ((XMLAttribute*)gdoc->info->items[0])->value);
+
+            /* Every chunk interns into the table of the document */
+            if (options[i] & XMLOptionIntern) {
+                const char* record = find_XMLSymbol(gdoc->symbols, "record");
+                for (size_t k = 0; k < groot->children->count; k += 2)
+                    CuAssertPtrEquals(tc, (void*)record, ((XMLNode*)groot->children->items[k])->tag);
+            }
+            free_XMLDocument(gdoc);
+        }
+    }
+
+    /* Elements after the document element are not split into it */
+    char* roots = "<a><x/><x/><x/><x/></a><b><c/><c/><c/><c/><c/><c/></b>";
+    gdoc = new_XMLDocument();
+    gdoc->buffer = _strdup(roots);
+    gdoc->file_size = strlen(roots) + 1;
+    groot = parse_xml_parallel(gdoc, 8);
+    CuAssertPtrNotNull(tc, groot);
+    CuAssertStrEquals(tc, "a", groot->tag);
+    CuAssertIntEquals(tc, 4, groot->children->count);
+    free_XMLDocument(gdoc);
+
+    /* Errors inside a chunk fail the parse */
+    char* broken = strstr(xml + size / 2, "</name>");
+    broken[2] = 'm';
+    gdoc = new_XMLDocument();
+    gdoc->buffer = _strdup(xml);
+    gdoc->file_size = size + 1;
+    CuAssertPtrEquals(tc, NULL, parse_xml_parallel(gdoc, 4));
+    free_XMLDocument(gdoc);
+
+    free_XMLDocument(expected);
+    free(xml);
+}
+
+void test_attribute_index(CuTest* tc) {
+    /* A wide element with a duplicated key and a narrow one */
+    char xml[4096] = "<DOC";
+    for (int i = 0; i < 40; i++)
+        sprintf(xml + strlen(xml), " key%d=\"%d\"", i, i);
+    strcat(xml, " key7=\"duplicate\" flag><narrow a=\"1\" b=\"2\"/></DOC>");
+
+    unsigned int options[] = { 0, XMLOptionArena, XMLOptionInSitu };
+    for (int i = 0; i < 3; i++) {
+        gdoc = new_XMLDocument();
+        gdoc->buffer = _strdup(xml);
+        gdoc->file_size = strlen(xml) + 1;
+        gdoc->options = options[i];
+        groot = parse_xml(gdoc);
+        CuAssertPtrNotNull(tc, groot);
+
+        CuAssertPtrNotNull(tc, groot->attribute_index);
+        CuAssertIntEquals(tc, 42, groot->attributes->count);
+        CuAssertPtrEquals(tc, NULL, ((XMLNode*)groot->children->items[0])->attribute_index);
+
+        /* Source order is kept */
+        CuAssertStrEquals(tc, "key0", ((XMLAttribute*)groot->attributes->items[0])->key);
+        CuAssertStrEquals(tc, "flag", ((XMLAttribute*)groot->attributes->items[41])->key);
+
+        char key[16], value[16];
+        for (int j = 0; j < 40; j++) {
+            sprintf(key, "key%d", j);
+            sprintf(value, "%d", j);
+            XMLKey handle = make_XMLKey(key);
+            CuAssertStrEquals(tc, value, get_XMLAttribute(groot, key)->value);
+            CuAssertPtrEquals(tc, get_XMLAttribute(groot, key), find_XMLAttribute(groot, &handle));
+        }
+        CuAssertPtrEquals(tc, NULL, get_XMLAttribute(groot, "key40"));
+        CuAssertPtrEquals(tc, NULL, get_XMLAttribute(groot, "flag")->value);
+
+        /* Narrow nodes take the same handles */
+        XMLKey b = make_XMLKey("b");
+        CuAssertStrEquals(tc, "2", find_XMLAttribute(groot->children->items[0], &b)->value);
+
+        free_XMLDocument(gdoc);
+    }
+}
+
+void test_intern_symbols(CuTest* tc) {
+    XMLDocument* expected = new_XMLDocument();
+    CuAssertIntEquals(tc, 1, load_file(expected, "../tests/example.xml"));
+    XMLNode* expected_root = parse_xml(expected);
+
+    unsigned int options[] = { XMLOptionIntern, XMLOptionIntern | XMLOptionArena, XMLOptionIntern | XMLOptionInSitu };
+    for (int i = 0; i < 3; i++) {
+        gdoc = new_XMLDocument();
+        CuAssertIntEquals(tc, 1, load_file(gdoc, "../tests/example.xml"));
+        gdoc->options = options[i];
+        groot = parse_xml(gdoc);
+        CuAssertPtrNotNull(tc, groot);
+        CuAssertPtrNotNull(tc, gdoc->symbols);
+        CuAssertTrue(tc, equal_XMLNodes(expected_root, groot));
+
+        /* Equal tags and keys are the same string */
+        XMLNode* first = groot->children->items[0];
+        XMLNode* second = groot->children->items[1];
+        CuAssertPtrEquals(tc, first->tag, second->tag);
+        CuAssertPtrEquals(tc, ((XMLNode*)first->children->items[0])->tag, ((XMLNode*)second->children->items[0])->tag);
+        CuAssertPtrEquals(tc, ((XMLAttribute*)first->attributes->items[1])->key, ((XMLAttribute*)second->attributes->items[0])->key);
+
+        XMLNode* layout = second->children->items[2];
+        XMLNode* slider = layout->children->items[1];
+        CuAssertPtrEquals(tc, slider->tag, ((XMLNode*)layout->children->items[5])->tag);
+        CuAssertPtrEquals(tc, ((XMLAttribute*)slider->attributes->items[0])->key,
+            ((XMLAttribute*)((XMLNode*)layout->children->items[3])->attributes->items[0])->key);
+
+        CuAssertPtrEquals(tc, (void*)find_XMLSymbol(gdoc->symbols, "slider"), slider->tag);
+        CuAssertPtrEquals(tc, NULL, (void*)find_XMLSymbol(gdoc->symbols, "missing"));
+        free_XMLDocument(gdoc);
+    }
+
+    /* A shared table makes tags of different documents equal and outlives them */
+    XMLSymbols* symbols = new_XMLSymbols(NULL, true);
+    XMLDocument* first = new_XMLDocument();
+    XMLDocument* second = new_XMLDocument();
+    CuAssertIntEquals(tc, 1, load_file(first, "../tests/example.xml"));
+    CuAssertIntEquals(tc, 1, load_file(second, "../tests/example.xml"));
+    first->symbols = symbols;
+    second->symbols = symbols;
+    XMLNode* first_root = parse_xml(first);
+    XMLNode* second_root = parse_xml(second);
+    CuAssertPtrEquals(tc, first_root->tag, second_root->tag);
+    free_XMLDocument(first);
+    free_XMLDocument(second);
+    CuAssertStrEquals(tc, "window", find_XMLSymbol(symbols, "window"));
+    free_XMLSymbols(symbols);
+
+    free_XMLDocument(expected);
+}
+
+/* Returns true if a flat node has the same tag, attributes and inner xml as a node. */
+bool equal_XMLFlatNode(XMLFlatTree* tree, XMLFlatNode* flat, XMLNode* node) {
+    if (flat->type != XMLTypeNode || strcmp(flat->value, node->tag) || (size_t)flat->attribute_count != node->attributes->count)
+        return false;
+    for (size_t i = 0; i < node->attributes->count; i++) {
+        XMLAttribute* x = &tree->attributes[flat->attributes + i];
+        XMLAttribute* y = node->attributes->items[i];
+        if (strcmp(x->key, y->key) || (x->value == NULL) != (y->value == NULL) || (x->value && strcmp(x->value, y->value)))
+            return false;
+    }
+
+    /* Text and elements in document order */
+    uint32_t index = flat->first_child;
+    for (size_t i = 0; i < node->inner_xml->count; i++, index = tree->nodes[index].next_sibling) {
+        XMLValue* value = node->inner_xml->items[i];
+        if (index == FLAT_NONE || tree->nodes[index].type != value->type || tree->nodes[index].parent != (uint32_t)(flat - tree->nodes))
+            return false;
+        if (value->type == XMLTypeText ? strcmp(tree->nodes[index].value, value->value) != 0
+            : !equal_XMLFlatNode(tree, &tree->nodes[index], value->value))
+            return false;
+    }
+    return index == FLAT_NONE;
+}
+
+void test_parse_flat(CuTest* tc) {
+    XMLDocument* expected = new_XMLDocument();
+    CuAssertIntEquals(tc, 1, load_file(expected, "../tests/example.xml"));
+    XMLNode* expected_root = parse_xml(expected);
+
+    unsigned int options[] = { 0, XMLOptionInSitu, XMLOptionIntern };
+    for (int i = 0; i < 3; i++) {
+        gdoc = new_XMLDocument();
+        CuAssertIntEquals(tc, 1, load_file(gdoc, "../tests/example.xml"));
+        gdoc->options = options[i];
+        XMLFlatTree* tree = parse_xml_flat(gdoc);
+        CuAssertPtrNotNull(tc, tree);
+        CuAssertPtrEquals(tc, gdoc->flat, tree);
+
+        /* 13 elements and 5 texts in one array */
+        CuAssertIntEquals(tc, 18, tree->node_count);
+        CuAssertIntEquals(tc, 27, tree->attribute_count);
+        CuAssertStrEquals(tc, "1.0", ((XMLAttribute*)gdoc->info->items[0])->value);
+
+        XMLFlatNode* root = get_XMLFlatRoot(tree);
+        CuAssertTrue(tc, equal_XMLFlatNode(tree, root, expected_root));
+
+        /* The accessors walk it like an XMLNode tree */
+        CuAssertIntEquals(tc, 2, count_XMLFlatChildren(tree, root));
+        XMLFlatNode* window = next_XMLFlatSibling(tree, first_XMLFlatChild(tree, root));
+        CuAssertStrEquals(tc, "Window 2", get_XMLFlatAttribute(tree, window, "title")->value);
+        CuAssertPtrEquals(tc, root, get_XMLFlatParent(tree, window));
+        CuAssertPtrEquals(tc, NULL, get_XMLFlatParent(tree, root));
+        CuAssertPtrEquals(tc, NULL, next_XMLFlatSibling(tree, window));
+
+        XMLFlatNode* layout = next_XMLFlatSibling(tree, next_XMLFlatSibling(tree, first_XMLFlatChild(tree, window)));
+        CuAssertStrEquals(tc, "layout", layout->value);
+        CuAssertIntEquals(tc, 6, count_XMLFlatChildren(tree, layout));
+        CuAssertPtrEquals(tc, NULL, get_XMLFlatAttribute(tree, layout, "missing"));
+
+        free_XMLDocument(gdoc);
+    }
+
+    /* Mismatched tags fail */
+    gdoc = new_XMLDocument();
+    gdoc->buffer = _strdup("<a><b></a></b>");
+    gdoc->file_size = strlen(gdoc->buffer) + 1;
+    CuAssertPtrEquals(tc, NULL, parse_xml_flat(gdoc));
+    free_XMLDocument(gdoc);
+
+    free_XMLDocument(expected);
+}
+
+void test_inline_list(CuTest* tc) {
+    int values[5] = { 0, 1, 2, 3, 4 };
+
+    /* Heap and arena lists keep their first items inline and move them when they grow */
+    XMLDocument* arena = new_XMLDocument();
+    arena->arena = new_XMLArena(NULL, NULL);
+    XMLDocument* docs[] = { NULL, arena };
+    for (int i = 0; i < 2; i++) {
+        XMLList* list = new_XMLList(docs[i]);
+        CuAssertPtrEquals(tc, list->inline_items, list->items);
+        for (int j = 0; j < NODE_SIZE; j++)
+            append_XMLItem(docs[i], list, &values[j]);
+        CuAssertPtrEquals(tc, list->inline_items, list->items);
+
+        for (int j = NODE_SIZE; j < 5; j++)
+            append_XMLItem(docs[i], list, &values[j]);
+        CuAssertTrue(tc, list->items != list->inline_items);
+        CuAssertIntEquals(tc, 5, list->count);
+        for (int j = 0; j < 5; j++)
+            CuAssertPtrEquals(tc, &values[j], list->items[j]);
+        free_XMLList(docs[i], list);
+    }
+    free_XMLDocument(arena);
+
+    /* Leaf nodes need no allocation besides their own */
+    gdoc = new_XMLDocument();
+    CuAssertIntEquals(tc, 1, load_file(gdoc, "../tests/example.xml"));
+    groot = parse_xml(gdoc);
+    XMLNode* window = groot->children->items[0];
+    XMLNode* p = window->children->items[0];
+    CuAssertPtrEquals(tc, p->attributes->inline_items, p->attributes->items);
+    CuAssertPtrEquals(tc, p->children->inline_items, p->children->items);
+    CuAssertPtrEquals(tc, p->inner_xml->inline_items, p->inner_xml->items);
+    CuAssertTrue(tc, window->attributes->items != window->attributes->inline_items);
+    CuAssertIntEquals(tc, 7, window->attributes->count);
+    free_XMLDocument(gdoc);
+}
+
+/* Concatenates the attribute n of the matched nodes */
+void join_XMLQueryResult(XMLQueryResult* result, char* joined) {
+    for (size_t i = 0; i < result->count; i++)
+        joined[i] = get_XMLAttribute(result->nodes[i], "n")->value[0];
+    joined[result->count] = '\0';
+}
+
+void test_query(CuTest* tc) {
+    const char* expressions[] = { "/DOC/window", "//slider[@value='69']", "//window[@notitle]", "//window[2]/layout/label",
+        "/DOC/window[2]/*[3]", "//slider[3]", "/DOC//p", "/window", "//missing", "window/p" };
+    size_t counts[] = { 2, 1, 1, 3, 1, 1, 2, 0, 0, 2 };
+    XMLQuery* queries[10];
+    for (int i = 0; i < 10; i++) {
+        queries[i] = compile_XMLQuery(expressions[i]);
+        CuAssertPtrNotNull(tc, queries[i]);
+    }
+
+    /* Compiled once and run on documents with and without interned tags, or with a table of another tree */
+    XMLQueryResult* result = new_XMLQueryResult();
+    XMLSymbols* other = new_XMLSymbols(NULL, false);
+    intern_XMLSymbol(other, "window", 6);
+    unsigned int options[] = { 0, XMLOptionIntern, XMLOptionIntern | XMLOptionInSitu };
+    for (int i = 0; i < 3; i++) {
+        gdoc = new_XMLDocument();
+        CuAssertIntEquals(tc, 1, load_file(gdoc, "../tests/example.xml"));
+        gdoc->options = options[i];
+        groot = parse_xml(gdoc);
+        CuAssertPtrNotNull(tc, groot);
+
+        for (int j = 0; j < 10; j++) {
+            CuAssertIntEquals(tc, counts[j], run_XMLQuery(queries[j], groot, gdoc->symbols, result));
+            CuAssertIntEquals(tc, counts[j], run_XMLQuery(queries[j], groot, other, result));
+        }
+
+        XMLNode* second = groot->children->items[1];
+        XMLNode* layout = second->children->items[2];
+        run_XMLQuery(queries[3], groot, gdoc->symbols, result);
+        CuAssertPtrEquals(tc, layout->children->items[0], result->nodes[0]);
+        CuAssertPtrEquals(tc, layout->children->items[4], result->nodes[2]);
+        run_XMLQuery(queries[4], layout->children->items[0], gdoc->symbols, result);
+        CuAssertPtrEquals(tc, layout, result->nodes[0]);
+        run_XMLQuery(queries[5], groot, gdoc->symbols, result);
+        CuAssertStrEquals(tc, "128", get_XMLAttribute(result->nodes[0], "value")->value);
+        free_XMLDocument(gdoc);
+    }
+    free_XMLSymbols(other);
+    for (int i = 0; i < 10; i++)
+        free_XMLQuery(queries[i]);
+
+    /* Matches below nested nodes come once and in document order */
+    const char* nested = "<r><a><b n='1'/><a><b n='2'/><b n='3'/></a><b n='4'/></a><b n='5'/></r>";
+    const char* nested_expressions[] = { "//a/b", "//a//b", "//a/b[2]", "//b[@n='5']", "a/a/*", "//*[@n][1]" };
+    const char* nested_matches[] = { "1234", "1234", "34", "5", "23", "125" };
+    gdoc = new_XMLDocument();
+    gdoc->buffer = _strdup(nested);
+    gdoc->file_size = strlen(nested) + 1;
+    groot = parse_xml(gdoc);
+    CuAssertPtrNotNull(tc, groot);
+    for (int i = 0; i < 6; i++) {
+        char joined[8];
+        XMLQuery* query = compile_XMLQuery(nested_expressions[i]);
+        CuAssertPtrNotNull(tc, query);
+        run_XMLQuery(query, groot, NULL, result);
+        join_XMLQueryResult(result, joined);
+        CuAssertStrEquals(tc, nested_matches[i], joined);
+        free_XMLQuery(query);
+    }
+    free_XMLDocument(gdoc);
+    free_XMLQueryResult(result);
+
+    const char* malformed[] = { "", "/", "a/", "a[", "a[0]", "a[@x='1]", "a b", "a[@]", "a[1][2][3][4][5]" };
+    for (int i = 0; i < 9; i++)
+        CuAssertPtrEquals(tc, NULL, compile_XMLQuery(malformed[i]));
+}
+
+void test_tag_index(CuTest* tc) {
+    size_t count;
+    unsigned int options[] = { XMLOptionTagIndex, XMLOptionTagIndex | XMLOptionArena,
+        XMLOptionTagIndex | XMLOptionIntern, XMLOptionTagIndex | XMLOptionInSitu };
+    for (int i = 0; i < 4; i++) {
+        gdoc = new_XMLDocument();
+        CuAssertIntEquals(tc, 1, load_file(gdoc, "../tests/example.xml"));
+        gdoc->options = options[i];
+        groot = parse_xml(gdoc);
+        CuAssertPtrNotNull(tc, groot);
+
+        CuAssertPtrEquals(tc, groot, get_XMLNodesByTag(gdoc, "DOC", &count)[0]);
+        CuAssertIntEquals(tc, 1, count);
+        CuAssertPtrEquals(tc, NULL, get_XMLNodesByTag(gdoc, "missing", &count));
+        CuAssertIntEquals(tc, 0, count);
+        CuAssertPtrNotNull(tc, get_XMLNodesByTag(gdoc, "window", &count));
+        CuAssertIntEquals(tc, 2, count);
+
+        /* Document order */
+        XMLNode* layout = ((XMLNode*)groot->children->items[1])->children->items[2];
+        XMLNode** sliders = get_XMLNodesByTag(gdoc, "slider", &count);
+        CuAssertIntEquals(tc, 3, count);
+        for (int j = 0; j < 3; j++)
+            CuAssertPtrEquals(tc, layout->children->items[j * 2 + 1], sliders[j]);
+
+        /* Added nodes and changed tags show up in the next lookup, the arena owns the new tags */
+        if (!gdoc->arena) {
+            free_XMLDocument(gdoc);
+            continue;
+        }
+        XMLNode* slider = new_XMLNode(gdoc, layout);
+        slider->tag = copy_XMLString(gdoc, "slider");
+        CuAssertIntEquals(tc, 4, get_XMLNodesByTag(gdoc, "slider", &count) ? count : 0);
+        CuAssertPtrEquals(tc, slider, get_XMLNodesByTag(gdoc, "slider", &count)[3]);
+
+        XMLNode* window = groot->children->items[0];
+        window->tag = copy_XMLString(gdoc, "frame");
+        invalidate_XMLTagIndex(gdoc);
+        CuAssertPtrEquals(tc, window, get_XMLNodesByTag(gdoc, "frame", &count)[0]);
+        CuAssertPtrEquals(tc, groot->children->items[1], get_XMLNodesByTag(gdoc, "window", &count)[0]);
+        CuAssertIntEquals(tc, 1, count);
+        free_XMLDocument(gdoc);
+    }
+
+    /* Chunks of a parallel parse are joined in document order */
+    size_t size = 0;
+    char* xml = malloc(200 * 64 + 64);
+    size += sprintf(xml, "<records>\n");
+    for (int i = 0; i < 200; i++)
+        size += sprintf(xml + size, "<record id=\"%d\"><name>Record %d</name></record>\n", i, i);
+    size += sprintf(xml + size, "</records>\n");
+
+    gdoc = new_XMLDocument();
+    gdoc->buffer = xml;
+    gdoc->file_size = size + 1;
+    gdoc->options = XMLOptionTagIndex;
+    groot = parse_xml_parallel(gdoc, 4);
+    CuAssertPtrNotNull(tc, groot);
+    XMLNode** records = get_XMLNodesByTag(gdoc, "record", &count);
+    CuAssertIntEquals(tc, 200, count);
+    XMLNode** names = get_XMLNodesByTag(gdoc, "name", &count);
+    CuAssertIntEquals(tc, 200, count);
+    for (int i = 0; i < 200; i++) {
+        CuAssertPtrEquals(tc, groot->children->items[i], records[i]);
+        CuAssertPtrEquals(tc, records[i], names[i]->parent);
+    }
+    free_XMLDocument(gdoc);
+}
+
+bool equal_XMLBlobNode(const XMLBlob* blob, const XMLBlobNode* blob_node, XMLNode* node) {
+    if (blob_node->type != XMLTypeNode || strcmp(get_XMLBlobString(blob, blob_node->value), node->tag)
+        || (size_t)blob_node->attribute_count != node->attributes->count)
+        return false;
+    for (size_t i = 0; i < node->attributes->count; i++) {
+        const XMLBlobAttribute* x = &blob->attributes[blob_node->attributes + i];
+        XMLAttribute* y = node->attributes->items[i];
+        const char* value = get_XMLBlobString(blob, x->value);
+        if (strcmp(get_XMLBlobString(blob, x->key), y->key) || (value == NULL) != (y->value == NULL) || (value && strcmp(value, y->value)))
+            return false;
+    }
+
+    /* Text and elements in document order */
+    uint32_t index = blob_node->first_child;
+    for (size_t i = 0; i < node->inner_xml->count; i++, index = blob->nodes[index].next_sibling) {
+        XMLValue* value = node->inner_xml->items[i];
+        if (index == FLAT_NONE || blob->nodes[index].type != value->type || blob->nodes[index].parent != (uint32_t)(blob_node - blob->nodes))
+            return false;
+        if (value->type == XMLTypeText ? strcmp(get_XMLBlobString(blob, blob->nodes[index].value), value->value) != 0
+            : !equal_XMLBlobNode(blob, &blob->nodes[index], value->value))
+            return false;
+    }
+    return index == FLAT_NONE;
+}
+
+/* Fills path with the name of a new empty file in the temporary directory, so failed tests leave nothing behind in the working one */
+void temp_path(CuTest* tc, char* path) {
+#ifdef _WIN32
+    CuAssertPtrNotNull(tc, tmpnam(path));
+#else
+    strcpy(path, "/tmp/sxml_XXXXXX");
+    int file = mkstemp(path);
+    CuAssertTrue(tc, file >= 0);
+    close(file);
+#endif
+}
+
+void test_blob(CuTest* tc) {
+    char path[L_tmpnam + 32];
+    temp_path(tc, path);
+    gdoc = new_XMLDocument();
+    CuAssertIntEquals(tc, 1, load_file(gdoc, "../tests/example.xml"));
+    groot = parse_xml(gdoc);
+    CuAssertPtrNotNull(tc, groot);
+    CuAssertTrue(tc, write_XMLBlob(groot, path));
+
+    XMLBlob* blob = load_XMLBlob(path);
+    CuAssertPtrNotNull(tc, blob);
+    CuAssertIntEquals(tc, 18, blob->node_count);
+    CuAssertIntEquals(tc, 27, blob->attribute_count);
+    const XMLBlobNode* root = get_XMLBlobRoot(blob);
+    CuAssertTrue(tc, equal_XMLBlobNode(blob, root, groot));
+
+    /* Navigation like the flat tree */
+    const XMLBlobNode* window = next_XMLBlobSibling(blob, first_XMLBlobChild(blob, root));
+    CuAssertStrEquals(tc, "Window 2", get_XMLBlobString(blob, get_XMLBlobAttribute(blob, window, "title")->value));
+    CuAssertPtrEquals(tc, (void*)root, (void*)get_XMLBlobParent(blob, window));
+    CuAssertPtrEquals(tc, NULL, (void*)next_XMLBlobSibling(blob, window));
+    CuAssertPtrEquals(tc, NULL, (void*)get_XMLBlobParent(blob, root));
+    CuAssertPtrEquals(tc, NULL, (void*)get_XMLBlobString(blob, get_XMLBlobAttribute(blob, first_XMLBlobChild(blob, root), "auto")->value));
+    free_XMLBlob(blob);
+    free_XMLDocument(gdoc);
+
+    /* Blobs with a flipped byte in the header or the strings, a link out of the blob or of another version are rejected */
+    FILE* file = fopen(path, "r+b");
+    CuAssertPtrNotNull(tc, file);
+    long offset = (long)offsetof(XMLBlobHeader, node_count);
+    fseek(file, offset, SEEK_SET);
+    int byte = fgetc(file);
+    fseek(file, offset, SEEK_SET);
+    fputc(byte ^ 1, file);
+    fclose(file);
+    CuAssertPtrEquals(tc, NULL, load_XMLBlob(path));
+
+    file = fopen(path, "r+b");
+    fseek(file, offset, SEEK_SET);
+    fputc(byte, file);
+    fseek(file, (long)(sizeof(XMLBlobHeader) + offsetof(XMLBlobNode, first_child)), SEEK_SET);
+    uint32_t first_child;
+    CuAssertIntEquals(tc, 1, (int)fread(&first_child, sizeof(first_child), 1, file));
+    uint32_t outside = 1000;
+    fseek(file, (long)(sizeof(XMLBlobHeader) + offsetof(XMLBlobNode, first_child)), SEEK_SET);
+    fwrite(&outside, sizeof(outside), 1, file);
+    fclose(file);
+    CuAssertPtrEquals(tc, NULL, load_XMLBlob(path));
+
+    file = fopen(path, "r+b");
+    fseek(file, (long)(sizeof(XMLBlobHeader) + offsetof(XMLBlobNode, first_child)), SEEK_SET);
+    fwrite(&first_child, sizeof(first_child), 1, file);
+    fclose(file);
+    blob = load_XMLBlob(path);
+    CuAssertPtrNotNull(tc, blob);
+    free_XMLBlob(blob);
+
+    file = fopen(path, "r+b");
+    fseek(file, -2, SEEK_END);
+    byte = fgetc(file);
+    fseek(file, -2, SEEK_END);
+    fputc(byte ^ 1, file);
+    fclose(file);
+    CuAssertPtrEquals(tc, NULL, load_XMLBlob(path));
+
+    file = fopen(path, "r+b");
+    fseek(file, -2, SEEK_END);
+    fputc(byte, file);
+    fseek(file, 4, SEEK_SET);
+    uint32_t version = BLOB_VERSION + 1;
+    fwrite(&version, sizeof(version), 1, file);
+    fclose(file);
+    CuAssertPtrEquals(tc, NULL, load_XMLBlob(path));
+    remove(path);
+    CuAssertPtrEquals(tc, NULL, load_XMLBlob(path));
+}
+
+void test_writer(CuTest* tc) {
+    const char* xml = "<a x=\"1\" flag><b>t &amp; u</b><c/>text<d><e y=\"2\"/></d></a>";
+    const char* pretty = "<a x=\"1\" flag>\n    <b>t &amp; u</b>\n    <c/>\n    text\n    <d>\n        <e y=\"2\"/>\n    </d>\n</a>\n";
+    gdoc = new_XMLDocument();
+    gdoc->buffer = _strdup(xml);
+    gdoc->file_size = strlen(xml) + 1;
+    groot = parse_xml(gdoc);
+    CuAssertPtrNotNull(tc, groot);
+
+    size_t length;
+    char* written = write_XMLString(groot, XMLFormatCompact, &length);
+    CuAssertStrEquals(tc, xml, written);
+    CuAssertIntEquals(tc, strlen(xml), length);
+    free(written);
+    written = write_XMLString(groot, XMLFormatPretty, NULL);
+    CuAssertStrEquals(tc, pretty, written);
+    free(written);
+
+    /* Quotes in values are escaped the sxml way, text with markup becomes CDATA and references are kept */
+    XMLNode* node = new_XMLNode(NULL, NULL);
+    XMLAttribute* attribute = new_XMLAttribute(NULL);
+    node->tag = _strdup("n");
+    attribute->key = _strdup("v");
+    attribute->value = _strdup("say \"hi\" 'all' \\ <now> & &lt; &#38;");
+    append_XMLItem(NULL, node->attributes, attribute);
+    append_XMLItem(NULL, node->inner_xml, new_XMLValue(NULL, _strdup("1 < 2 && \"ok\""), XMLTypeText));
+    written = write_XMLString(node, XMLFormatCompact, NULL);
+    CuAssertStrEquals(tc, "<n v=\"say \\\"hi\\\" \\'all\\' \\\\ <now> & &lt; &#38;\"><![CDATA[1 < 2 && \"ok\"]]></n>", written);
+
+    /* And parse back into the same node */
+    XMLDocument* copy = new_XMLDocument();
+    copy->buffer = written;
+    copy->file_size = strlen(written) + 1;
+    XMLNode* copy_root = parse_xml(copy);
+    CuAssertPtrNotNull(tc, copy_root);
+    CuAssertTrue(tc, equal_XMLNodes(node, copy_root));
+    free_XMLDocument(copy);
+    free(((XMLValue*)node->inner_xml->items[0])->value);
+    free_XMLAttribute(attribute);
+    free_XMLNode(node);
+    free_XMLDocument(gdoc);
+
+    /* Written documents parse into the same tree, also through a file descriptor */
+    char path[L_tmpnam + 32];
+    temp_path(tc, path);
+    gdoc = new_XMLDocument();
+    CuAssertIntEquals(tc, 1, load_file(gdoc, "../tests/example.xml"));
+    groot = parse_xml(gdoc);
+    enum XMLFormat formats[] = { XMLFormatCompact, XMLFormatPretty };
+    for (int i = 0; i < 2; i++) {
+        written = write_XMLString(groot, formats[i], &length);
+        FILE* file = fopen(path, "wb");
+        CuAssertPtrNotNull(tc, file);
+        CuAssertTrue(tc, write_XMLFile(groot, formats[i], fileno(file)));
+        fclose(file);
+
+        XMLDocument* copy = new_XMLDocument();
+        CuAssertIntEquals(tc, 1, load_file(copy, path));
+        CuAssertIntEquals(tc, length + 1, copy->file_size);
+        CuAssertStrEquals(tc, written, copy->buffer);
+        XMLNode* copy_root = parse_xml(copy);
+        CuAssertPtrNotNull(tc, copy_root);
+        CuAssertTrue(tc, equal_XMLNodes(groot, copy_root));
+        char* rewritten = write_XMLString(copy_root, formats[i], NULL);
+        CuAssertStrEquals(tc, written, rewritten);
+        free(rewritten);
+        free(written);
+        free_XMLDocument(copy);
+    }
+    remove(path);
+    free_XMLDocument(gdoc);
+}
+
+/* Counts what goes through it and refuses every allocation after fail_after of them, or only the next new block when once is set */
+typedef struct TestAllocator {
+    size_t allocations;
+    size_t frees;
+    size_t fail_after;
+    bool once;
+} TestAllocator;
+
+void* test_alloc(void* user, size_t size) {
+    TestAllocator* counter = user;
+    if (counter->allocations == counter->fail_after) {
+        if (counter->once)
+            counter->fail_after = SIZE_MAX;
+        return NULL;
+    }
+    counter->allocations++;
+    return malloc(size);
+}
+
+void* test_realloc(void* user, void* pointer, size_t size) {
+    TestAllocator* counter = user;
+    if (!pointer)
+        return test_alloc(user, size);
+    if (counter->allocations == counter->fail_after && !counter->once)
+        return NULL;
+    return realloc(pointer, size);
+}
+
+void test_free(void* user, void* pointer) {
+    ((TestAllocator*)user)->frees++;
+    free(pointer);
+}
+
+void test_allocator(CuTest* tc) {
+    TestAllocator counter = { 0, 0, SIZE_MAX, false };
+    XMLAllocator allocator = { test_alloc, test_realloc, test_free, &counter };
+    unsigned int options[] = { 0, XMLOptionArena, XMLOptionIntern | XMLOptionTagIndex };
+    size_t totals[3];
+
+    for (int i = 0; i < 3; i++) {
+        counter.allocations = counter.frees = 0;
+        gdoc = new_XMLDocumentAllocator(&allocator);
+        gdoc->options = options[i];
+        CuAssertIntEquals(tc, 1, load_file(gdoc, "../tests/example.xml"));
+        groot = parse_xml(gdoc);
+        CuAssertPtrNotNull(tc, groot);
+        CuAssertStrEquals(tc, "DOC", groot->tag);
+
+        /* Every category is counted, the heap only sees the blocks of an arena */
+        XMLStats* stats = &gdoc->stats;
+        CuAssertIntEquals(tc, 15, stats->calls[XMLMemoryNode]);
+        CuAssertIntEquals(tc, 0, stats->failures);
+        CuAssertTrue(tc, stats->calls[XMLMemoryAttribute] >= 27);
+        CuAssertTrue(tc, stats->bytes[XMLMemoryList] > 0 && stats->bytes[XMLMemoryText] > 0 && stats->bytes[XMLMemoryOther] > 0);
+        CuAssertTrue(tc, counter.allocations > 0 && counter.allocations <= stats->heap_calls);
+        if (options[i] & XMLOptionArena)
+            CuAssertTrue(tc, stats->heap_calls < stats->calls[XMLMemoryNode]);
+        totals[i] = counter.allocations;
+        free_XMLDocument(gdoc);
+        CuAssertIntEquals(tc, counter.allocations, counter.frees);
+    }
+
+    /* Streaming and readers keep their stacks in the allocator as well */
+    SaxCounts counts = { 0 };
+    XMLHandler handler = { &counts, sax_start_element, sax_end_element, sax_text, sax_comment, sax_declaration };
+    counter.allocations = counter.frees = 0;
+    gdoc = new_XMLDocumentAllocator(&allocator);
+    size_t allocations = counter.allocations;
+    CuAssertTrue(tc, feed_xml(gdoc, &handler, "<DOC><p>Hi</p></DOC>", 20));
+    CuAssertTrue(tc, finish_xml(gdoc, &handler));
+    CuAssertTrue(tc, counter.allocations > allocations);
+    CuAssertIntEquals(tc, 2, counts.start_elements);
+
+    allocations = counter.allocations;
+    CuAssertIntEquals(tc, 1, load_file(gdoc, "../tests/example.xml"));
+    XMLReader* reader = new_XMLReader(gdoc);
+    CuAssertPtrNotNull(tc, reader);
+    CuAssertTrue(tc, counter.allocations > allocations);
+    while (next_XMLReader(reader) != XMLTokenNone);
+    free_XMLReader(reader);
+    free_XMLDocument(gdoc);
+    CuAssertIntEquals(tc, counter.allocations, counter.frees);
+
+    /* Symbol tables of a document use its allocator, also when they grow */
+    counter.allocations = counter.frees = 0;
+    gdoc = new_XMLDocumentAllocator(&allocator);
+    allocations = counter.allocations;
+    XMLSymbols* symbols = new_XMLSymbols(gdoc, false);
+    CuAssertPtrNotNull(tc, symbols);
+    char name[16];
+    for (int i = 0; i < SYMBOL_TABLE_SIZE; i++) {
+        sprintf(name, "tag%d", i);
+        CuAssertPtrNotNull(tc, intern_XMLSymbol(symbols, name, strlen(name)));
+    }
+    CuAssertTrue(tc, counter.allocations >= allocations + 4);
+    free_XMLSymbols(symbols);
+    free_XMLDocument(gdoc);
+    CuAssertIntEquals(tc, counter.allocations, counter.frees);
+
+    /* Lists of a document go back to its allocator */
+    counter.allocations = counter.frees = 0;
+    gdoc = new_XMLDocumentAllocator(&allocator);
+    XMLList* list = new_XMLList(gdoc);
+    for (int i = 0; i < 5; i++)
+        CuAssertTrue(tc, append_XMLItem(gdoc, list, gdoc));
+    free_XMLList(gdoc, list);
+    free_XMLDocument(gdoc);
+    CuAssertIntEquals(tc, counter.allocations, counter.frees);
+
+    /* A node that cannot be added leaves its parent as it was */
+    for (size_t fail = 0; fail < 4; fail++) {
+        counter.allocations = counter.frees = 0;
+        counter.fail_after = SIZE_MAX;
+        gdoc = new_XMLDocumentAllocator(&allocator);
+        CuAssertIntEquals(tc, 1, load_file(gdoc, "../tests/example.xml"));
+        groot = parse_xml(gdoc);
+        CuAssertIntEquals(tc, 2, groot->children->count);
+        counter.fail_after = counter.allocations + fail;
+        if (!new_XMLNode(gdoc, groot)) {
+            CuAssertIntEquals(tc, 2, groot->inner_xml->count);
+            CuAssertIntEquals(tc, 2, groot->children->count);
+        }
+        free_XMLDocument(gdoc);
+        CuAssertIntEquals(tc, counter.allocations, counter.frees);
+    }
+    counter.fail_after = SIZE_MAX;
+
+    /* The attribute index is optional, a wide node without one is still found by a linear scan */
+    const char* wide = "<a k0='0' k1='1' k2='2' k3='3' k4='4' k5='5' k6='6' k7='7' k8='8'/>";
+    size_t unindexed = 0;
+    counter.once = true;
+    for (size_t fail_after = 0; fail_after < 64; fail_after++) {
+        counter.allocations = counter.frees = 0;
+        counter.fail_after = fail_after;
+        gdoc = new_XMLDocumentAllocator(&allocator);
+        if (gdoc && (gdoc->buffer = alloc_XMLHeap(gdoc, strlen(wide) + 1, XMLMemoryText))) {
+            strcpy(gdoc->buffer, wide);
+            gdoc->file_size = strlen(wide) + 1;
+            groot = parse_xml(gdoc);
+            if (groot && !groot->attribute_index) {
+                unindexed++;
+                CuAssertIntEquals(tc, 0, gdoc->stats.failures);
+                CuAssertTrue(tc, gdoc->state != XMLStateError);
+                CuAssertStrEquals(tc, "7", get_XMLAttribute(groot, "k7")->value);
+            }
+        }
+        if (gdoc)
+            free_XMLDocument(gdoc);
+        CuAssertIntEquals(tc, counter.allocations, counter.frees);
+    }
+    CuAssertIntEquals(tc, 1, unindexed);
+    counter.once = false;
+    counter.fail_after = SIZE_MAX;
+
+    /* Running out of memory anywhere fails the parse instead of exiting, and leaks nothing */
+    for (int i = 0; i < 3; i++) {
+        for (size_t fail_after = 0; fail_after < totals[i]; fail_after++) {
+            counter.allocations = counter.frees = 0;
+            counter.fail_after = fail_after;
+            gdoc = new_XMLDocumentAllocator(&allocator);
+            if (gdoc) {
+                gdoc->options = options[i];
+                groot = load_file(gdoc, "../tests/example.xml") ? parse_xml(gdoc) : NULL;
+                CuAssertPtrEquals(tc, NULL, groot);
+                CuAssertIntEquals(tc, 1, gdoc->stats.failures);
+                free_XMLDocument(gdoc);
+            }
+            CuAssertIntEquals(tc, counter.allocations, counter.frees);
+        }
+    }
+}
+
+void test_lazy_attributes(CuTest* tc) {
+    const char* xml = "<a x='1' y=\"a\\\"b\" z='>' flag><b k='v'/><c/><d/></a>";
+    gdoc = new_XMLDocument();
+    gdoc->options = XMLOptionLazyAttributes;
+    gdoc->buffer = _strdup(xml);
+    gdoc->file_size = strlen(xml) + 1;
+    groot = parse_xml(gdoc);
+    CuAssertPtrNotNull(tc, groot);
+    CuAssertIntEquals(tc, 3, groot->children->count);
+
+    /* Nothing is decoded before the first access */
+    CuAssertIntEquals(tc, 0, groot->attributes->count);
+    CuAssertPtrNotNull(tc, groot->pending);
+    CuAssertStrEquals(tc, "a\"b", get_XMLAttribute(groot, "y")->value);
+    CuAssertPtrEquals(tc, NULL, groot->pending);
+    CuAssertIntEquals(tc, 4, groot->attributes->count);
+    CuAssertStrEquals(tc, ">", get_XMLAttribute(groot, "z")->value);
+    CuAssertPtrEquals(tc, NULL, get_XMLAttribute(groot, "flag")->value);
+
+    XMLNode* node = groot->children->items[0];
+    CuAssertIntEquals(tc, 1, get_XMLAttributes(node)->count);
+    CuAssertStrEquals(tc, "v", ((XMLAttribute*)node->attributes->items[0])->value);
+    node = groot->children->items[1];
+    CuAssertPtrEquals(tc, NULL, node->pending);
+    CuAssertIntEquals(tc, 0, get_XMLAttributes(node)->count);
+    free_XMLDocument(gdoc);
+
+    /* Wide nodes get their index when they are decoded */
+    xml = "<a k0='0' k1='1' k2='2' k3='3' k4='4' k5='5' k6='6' k7='7' k8='8'/>";
+    gdoc = new_XMLDocument();
+    gdoc->options = XMLOptionLazyAttributes;
+    gdoc->buffer = _strdup(xml);
+    gdoc->file_size = strlen(xml) + 1;
+    groot = parse_xml(gdoc);
+    CuAssertPtrNotNull(tc, groot);
+    CuAssertPtrEquals(tc, NULL, groot->attribute_index);
+    XMLKey key = make_XMLKey("k7");
+    CuAssertStrEquals(tc, "7", find_XMLAttribute(groot, &key)->value);
+    CuAssertPtrNotNull(tc, groot->attribute_index);
+    free_XMLDocument(gdoc);
+
+    /* Malformed attributes are only found when they are decoded */
+    xml = "<a x=1><b/></a>";
+    gdoc = new_XMLDocument();
+    gdoc->options = XMLOptionLazyAttributes;
+    gdoc->buffer = _strdup(xml);
+    gdoc->file_size = strlen(xml) + 1;
+    groot = parse_xml(gdoc);
+    CuAssertPtrNotNull(tc, groot);
+    CuAssertTrue(tc, !decode_XMLAttributes(groot));
+    CuAssertIntEquals(tc, 0, groot->attributes->count);
+    CuAssertTrue(tc, decode_XMLAttributes(groot));
+    free_XMLDocument(gdoc);
+
+    /* Lazy trees decode into the same tree as eager ones with fewer allocations up front */
+    unsigned int options[] = { 0, XMLOptionArena, XMLOptionInSitu, XMLOptionIntern };
+    for (int i = 0; i < 4; i++) {
+        XMLDocument* eager = new_XMLDocument();
+        eager->options = options[i];
+        CuAssertIntEquals(tc, 1, load_file(eager, "../tests/example.xml"));
+        XMLNode* eager_root = parse_xml(eager);
+        CuAssertPtrNotNull(tc, eager_root);
+
+        gdoc = new_XMLDocument();
+        gdoc->options = options[i] | XMLOptionLazyAttributes;
+        CuAssertIntEquals(tc, 1, load_file(gdoc, "../tests/example.xml"));
+        groot = parse_xml(gdoc);
+        CuAssertPtrNotNull(tc, groot);
+        CuAssertTrue(tc, gdoc->stats.calls[XMLMemoryAttribute] < eager->stats.calls[XMLMemoryAttribute]);
+        CuAssertTrue(tc, equal_XMLNodes(eager_root, groot));
+
+        /* Both declarations are decoded while parsing */
+        CuAssertIntEquals(tc, eager->info->count, gdoc->info->count);
+        free_XMLDocument(eager);
+        free_XMLDocument(gdoc);
+    }
+
+    /* Chunks of a parallel parse leave their attributes to the document */
+    size_t size = 0;
+    char* records = malloc(200 * 64 + 64);
+    size += sprintf(records, "<records>");
+    for (int i = 0; i < 200; i++)
+        size += sprintf(records + size, "<r id=\"%d\" odd=\"%d\"><n v=\"%d\"/></r>", i, i % 2, i);
+    size += sprintf(records + size, "</records>");
+    for (int i = 0; i < 2; i++) {
+        gdoc = new_XMLDocument();
+        gdoc->options = XMLOptionLazyAttributes | (i ? XMLOptionArena : 0);
+        gdoc->buffer = _strdup(records);
+        gdoc->file_size = size + 1;
+        groot = parse_xml_parallel(gdoc, 4);
+        CuAssertPtrNotNull(tc, groot);
+        CuAssertIntEquals(tc, 200, groot->children->count);
+        char* written = write_XMLString(groot, XMLFormatCompact, NULL);
+        CuAssertPtrNotNull(tc, written);
+        CuAssertStrEquals(tc, records, written);
+        free(written);
+        XMLNode* record = groot->children->items[123];
+        CuAssertStrEquals(tc, "123", get_XMLAttribute(record, "id")->value);
+        CuAssertStrEquals(tc, "1", get_XMLAttribute(record, "odd")->value);
+        free_XMLDocument(gdoc);
+    }
+    free(records);
+}
+
+void test_lazy_children(CuTest* tc) {
+    const char* xml = "<a x='1'>t<b><c>deep</c></b><d/><e>u<!-- </e> --><f k='v'/></e></a>";
+    gdoc = new_XMLDocument();
+    gdoc->options = XMLOptionLazyChildren;
+    gdoc->buffer = _strdup(xml);
+    gdoc->file_size = strlen(xml) + 1;
+    groot = parse_xml(gdoc);
+    CuAssertPtrNotNull(tc, groot);
+
+    /* Only the document element is built, its attributes are not lazy */
+    CuAssertIntEquals(tc, 1, groot->attributes->count);
+    CuAssertIntEquals(tc, 0, groot->inner_xml->count);
+    CuAssertPtrNotNull(tc, groot->pending);
+    CuAssertIntEquals(tc, 3, get_XMLChildren(groot)->count);
+    CuAssertPtrEquals(tc, NULL, groot->pending);
+    CuAssertIntEquals(tc, 4, groot->inner_xml->count);
+    CuAssertStrEquals(tc, "t", ((XMLValue*)groot->inner_xml->items[0])->value);
+
+    /* Children are expanded one level at a time */
+    XMLNode* node = groot->children->items[0];
+    CuAssertPtrEquals(tc, groot, node->parent);
+    CuAssertIntEquals(tc, 0, node->children->count);
+    node = get_XMLChildren(node)->items[0];
+    CuAssertStrEquals(tc, "c", node->tag);
+    CuAssertStrEquals(tc, "deep", ((XMLValue*)get_XMLInnerXML(node)->items[0])->value);
+    node = groot->children->items[1];
+    CuAssertPtrEquals(tc, NULL, node->pending);
+    CuAssertIntEquals(tc, 0, get_XMLInnerXML(node)->count);
+
+    /* Queries expand the nodes they step into */
+    XMLQuery* query = compile_XMLQuery("/a/e/f[@k='v']");
+    XMLQueryResult* result = new_XMLQueryResult();
+    CuAssertIntEquals(tc, 1, run_XMLQuery(query, groot, NULL, result));
+    CuAssertPtrEquals(tc, ((XMLNode*)groot->children->items[2])->children->items[0], result->nodes[0]);
+    free_XMLQueryResult(result);
+    free_XMLQuery(query);
+    free_XMLDocument(gdoc);
+
+    /* The tag index expands what is still lazy and keeps document order, whatever was expanded before */
+    xml = "<a><b><x/></b><x/><c><x/></c></a>";
+    gdoc = new_XMLDocument();
+    gdoc->options = XMLOptionLazyChildren | XMLOptionTagIndex;
+    gdoc->buffer = _strdup(xml);
+    gdoc->file_size = strlen(xml) + 1;
+    groot = parse_xml(gdoc);
+    CuAssertPtrNotNull(tc, groot);
+    XMLNode* c = get_XMLChildren(groot)->items[2];
+    CuAssertIntEquals(tc, 1, get_XMLChildren(c)->count);
+    size_t count;
+    XMLNode** nodes = get_XMLNodesByTag(gdoc, "x", &count);
+    CuAssertIntEquals(tc, 3, count);
+    XMLNode* b = groot->children->items[0];
+    CuAssertIntEquals(tc, 1, b->children->count);
+    CuAssertPtrEquals(tc, b->children->items[0], nodes[0]);
+    CuAssertPtrEquals(tc, groot->children->items[1], nodes[1]);
+    CuAssertPtrEquals(tc, c->children->items[0], nodes[2]);
+    CuAssertIntEquals(tc, 1, get_XMLNodesByTag(gdoc, "c", &count) ? count : 0);
+    free_XMLDocument(gdoc);
+
+    /* Skipping only counts depth, the names of end tags are compared when expanding */
+    xml = "<a><b></c></a>";
+    gdoc = new_XMLDocument();
+    gdoc->options = XMLOptionLazyChildren;
+    gdoc->buffer = _strdup(xml);
+    gdoc->file_size = strlen(xml) + 1;
+    groot = parse_xml(gdoc);
+    CuAssertPtrNotNull(tc, groot);
+    CuAssertTrue(tc, expand_XMLNode(groot));
+    CuAssertTrue(tc, !expand_XMLNode(groot->children->items[0]));
+    free_XMLDocument(gdoc);
+
+    /* Expanded trees are the same as eager ones, which allocate more up front */
+    unsigned int options[] = { 0, XMLOptionArena, XMLOptionInSitu, XMLOptionIntern | XMLOptionLazyAttributes };
+    for (int i = 0; i < 4; i++) {
+        XMLDocument* eager = new_XMLDocument();
+        eager->options = options[i] & ~XMLOptionLazyAttributes;
+        CuAssertIntEquals(tc, 1, load_file(eager, "../tests/example.xml"));
+        XMLNode* eager_root = parse_xml(eager);
+        CuAssertPtrNotNull(tc, eager_root);
+
+        gdoc = new_XMLDocument();
+        gdoc->options = options[i] | XMLOptionLazyChildren;
+        CuAssertIntEquals(tc, 1, load_file(gdoc, "../tests/example.xml"));
+        groot = parse_xml(gdoc);
+        CuAssertPtrNotNull(tc, groot);
+        CuAssertTrue(tc, gdoc->stats.calls[XMLMemoryNode] < eager->stats.calls[XMLMemoryNode]);
+        char* written = write_XMLString(groot, XMLFormatCompact, NULL);
+        char* eager_written = write_XMLString(eager_root, XMLFormatCompact, NULL);
+        CuAssertStrEquals(tc, eager_written, written);
+        CuAssertTrue(tc, equal_XMLNodes(eager_root, groot));
+        free(written);
+        free(eager_written);
+        free_XMLDocument(eager);
+        free_XMLDocument(gdoc);
+    }
+
+    /* Records split by a parallel parse stay lazy */
+    size_t size = 0;
+    char* records = malloc(200 * 64 + 64);
+    size += sprintf(records, "<records>");
+    for (int i = 0; i < 200; i++)
+        size += sprintf(records + size, "<r id=\"%d\"><n>%d</n><m/></r>", i, i);
+    size += sprintf(records + size, "</records>");
+    gdoc = new_XMLDocument();
+    gdoc->options = XMLOptionLazyChildren;
+    gdoc->buffer = _strdup(records);
+    gdoc->file_size = size + 1;
+    groot = parse_xml_parallel(gdoc, 4);
+    CuAssertPtrNotNull(tc, groot);
+    CuAssertIntEquals(tc, 200, groot->children->count);
+    node = groot->children->items[123];
+    CuAssertIntEquals(tc, 0, node->children->count);
+    node = get_XMLChildren(node)->items[0];
+    CuAssertStrEquals(tc, "123", ((XMLValue*)get_XMLInnerXML(node)->items[0])->value);
+    char* written = write_XMLString(groot, XMLFormatCompact, NULL);
+    CuAssertStrEquals(tc, records, written);
+    free(written);
+    free_XMLDocument(gdoc);
+    free(records);
+}
+
+void test_projection(CuTest* tc) {
+    const char* paths[] = { "DOC/window/layout/slider", "/DOC/*/p" };
+    XMLProjection* projection = compile_XMLProjection(paths, 2);
+    CuAssertPtrNotNull(tc, projection);
+
+    XMLDocument* eager = new_XMLDocument();
+    CuAssertIntEquals(tc, 1, load_file(eager, "../tests/example.xml"));
+    XMLNode* eager_root = parse_xml(eager);
+    CuAssertPtrNotNull(tc, eager_root);
+    XMLNode* eager_windows[] = { eager_root->children->items[0], eager_root->children->items[1] };
+
+    /* Ancestors keep their attributes but no text, matched elements keep everything */
+    gdoc = new_XMLDocument();
+    gdoc->projection = projection;
+    CuAssertIntEquals(tc, 1, load_file(gdoc, "../tests/example.xml"));
+    groot = parse_xml(gdoc);
+    CuAssertPtrNotNull(tc, groot);
+    CuAssertTrue(tc, gdoc->stats.calls[XMLMemoryNode] < eager->stats.calls[XMLMemoryNode]);
+    CuAssertStrEquals(tc, "DOC", groot->tag);
+    CuAssertIntEquals(tc, 1, groot->attributes->count);
+    CuAssertIntEquals(tc, 2, groot->inner_xml->count);
+    XMLNode* window = groot->children->items[0];
+    CuAssertIntEquals(tc, 7, window->attributes->count);
+    CuAssertIntEquals(tc, 1, window->children->count);
+    CuAssertTrue(tc, equal_XMLNodes(eager_windows[0]->children->items[0], window->children->items[0]));
+    window = groot->children->items[1];
+    CuAssertIntEquals(tc, 2, window->children->count);
+    CuAssertTrue(tc, equal_XMLNodes(eager_windows[1]->children->items[0], window->children->items[0]));
+    XMLNode* layout = window->children->items[1];
+    CuAssertStrEquals(tc, "layout", layout->tag);
+    CuAssertIntEquals(tc, 3, layout->inner_xml->count);
+    CuAssertStrEquals(tc, "69", get_XMLAttribute(layout->children->items[1], "value")->value);
+    free_XMLDocument(gdoc);
+
+    /* Ancestors nothing was found below are taken out again, also from the tag index */
+    free_XMLProjection(projection);
+    projection = compile_XMLProjection(paths, 1);
+    gdoc = new_XMLDocument();
+    gdoc->options = XMLOptionTagIndex;
+    gdoc->projection = projection;
+    CuAssertIntEquals(tc, 1, load_file(gdoc, "../tests/example.xml"));
+    groot = parse_xml(gdoc);
+    CuAssertPtrNotNull(tc, groot);
+    CuAssertIntEquals(tc, 1, groot->children->count);
+    window = groot->children->items[0];
+    CuAssertStrEquals(tc, "Window 2", get_XMLAttribute(window, "title")->value);
+    CuAssertIntEquals(tc, 1, window->children->count);
+    size_t count;
+    get_XMLNodesByTag(gdoc, "window", &count);
+    CuAssertIntEquals(tc, 1, count);
+    get_XMLNodesByTag(gdoc, "slider", &count);
+    CuAssertIntEquals(tc, 3, count);
+    free_XMLDocument(gdoc);
+    free_XMLProjection(projection);
+    free_XMLDocument(eager);
+
+    /* The document element is built even when it is on no path */
+    const char* other[] = { "other/window" };
+    projection = compile_XMLProjection(other, 1);
+    gdoc = new_XMLDocument();
+    gdoc->projection = projection;
+    CuAssertIntEquals(tc, 1, load_file(gdoc, "../tests/example.xml"));
+    groot = parse_xml(gdoc);
+    CuAssertPtrNotNull(tc, groot);
+    CuAssertIntEquals(tc, 0, groot->inner_xml->count);
+    free_XMLDocument(gdoc);
+    free_XMLProjection(projection);
+
+    /* One projection is reused across documents, options and parsers */
+    const char* names[] = { "records/r/n" };
+    projection = compile_XMLProjection(names, 1);
+    size_t size = 0;
+    char* records = malloc(100 * 64 + 64);
+    size += sprintf(records, "<records>");
+    for (int i = 0; i < 100; i++)
+        size += sprintf(records + size, "<r id=\"%d\"><n>%d<b/></n><m>x</m></r>", i, i);
+    size += sprintf(records + size, "</records>");
+    unsigned int options[] = { 0, XMLOptionArena | XMLOptionLazyChildren, XMLOptionInSitu | XMLOptionLazyAttributes };
+    for (int i = 0; i < 6; i++) {
+        gdoc = new_XMLDocument();
+        gdoc->options = options[i % 3];
+        gdoc->projection = projection;
+        gdoc->buffer = _strdup(records);
+        gdoc->file_size = size + 1;
+        groot = i < 3 ? parse_xml(gdoc) : parse_xml_parallel(gdoc, 4);
+        CuAssertPtrNotNull(tc, groot);
+        CuAssertIntEquals(tc, 100, groot->children->count);
+        XMLNode* record = groot->children->items[42];
+        CuAssertStrEquals(tc, "42", get_XMLAttribute(record, "id")->value);
+        CuAssertIntEquals(tc, 1, record->inner_xml->count);
+        XMLNode* name = record->children->items[0];
+        CuAssertIntEquals(tc, 2, get_XMLInnerXML(name)->count);
+        CuAssertStrEquals(tc, "42", ((XMLValue*)name->inner_xml->items[0])->value);
+        CuAssertStrEquals(tc, "b", ((XMLNode*)name->children->items[0])->tag);
+        free_XMLDocument(gdoc);
+    }
+    free(records);
+    free_XMLProjection(projection);
+
+    /* Steps are only followed down by name */
+    const char* descendant[] = { "a//b" };
+    const char* predicate[] = { "a/b[@k]" };
+    CuAssertPtrEquals(tc, NULL, compile_XMLProjection(descendant, 1));
+    CuAssertPtrEquals(tc, NULL, compile_XMLProjection(predicate, 1));
+}
+
+#ifdef SXML_STATS
+void test_parse_stats(CuTest* tc) {
+    const char* xml = "<?xml version='1.0'?><!DOCTYPE a><!-- c --><a x='1' y='2'><b>t</b><?pi x?><c/><![CDATA[d]]></a>";
+    gdoc = new_XMLDocument();
+    gdoc->buffer = _strdup(xml);
+    gdoc->file_size = strlen(xml) + 1;
+    groot = parse_xml(gdoc);
+    CuAssertPtrNotNull(tc, groot);
+
+    /* The declaration has an attribute too, the skipped bytes are the DOCTYPE, the comment and the processing instruction */
+    XMLParseStats* stats = &gdoc->parse;
+    CuAssertIntEquals(tc, strlen(xml), stats->bytes);
+    CuAssertIntEquals(tc, 3, stats->elements);
+    CuAssertIntEquals(tc, 3, stats->attributes);
+    CuAssertIntEquals(tc, 2, stats->texts);
+    CuAssertIntEquals(tc, 2, stats->max_depth);
+    CuAssertIntEquals(tc, 0, stats->depth);
+    CuAssertIntEquals(tc, 30, stats->skipped);
+    CuAssertTrue(tc, stats->list_growths >= 1);
+    CuAssertTrue(tc, stats->tokenize_ns + stats->build_ns > 0);
+    free_XMLDocument(gdoc);
+
+    /* Chunks of a parallel parse add up to the counts of a sequential one */
+    size_t size = 0;
+    char* records = malloc(100 * 64 + 64);
+    size += sprintf(records, "<records>");
+    for (int i = 0; i < 100; i++)
+        size += sprintf(records + size, "<r id=\"%d\"><n>%d</n><!-- %d --><e/></r>", i, i, i);
+    size += sprintf(records + size, "</records>");
+
+    XMLParseStats expected;
+    for (int i = 0; i < 2; i++) {
+        gdoc = new_XMLDocument();
+        gdoc->buffer = _strdup(records);
+        gdoc->file_size = size + 1;
+        groot = i ? parse_xml_parallel(gdoc, 4) : parse_xml(gdoc);
+        CuAssertPtrNotNull(tc, groot);
+        stats = &gdoc->parse;
+        if (!i)
+            expected = *stats;
+        CuAssertIntEquals(tc, size, stats->bytes);
+        CuAssertIntEquals(tc, 301, stats->elements);
+        CuAssertIntEquals(tc, expected.attributes, stats->attributes);
+        CuAssertIntEquals(tc, expected.texts, stats->texts);
+        CuAssertIntEquals(tc, 3, stats->max_depth);
+        CuAssertIntEquals(tc, 0, stats->depth);
+        CuAssertIntEquals(tc, expected.skipped, stats->skipped);
+        free_XMLDocument(gdoc);
+    }
+    free(records);
+
+    /* Chunks larger than the lexer grow it */
+    SaxCounts counts;
+    memset(&counts, 0, sizeof(counts));
+    XMLHandler handler = { &counts, sax_start_element, sax_end_element, sax_text, sax_comment, sax_declaration };
+    char* text = calloc(EXPAND_LEXER_SIZE * 2 + 8, 1);
+    memcpy(text, "<a>", 3);
+    memset(text + 3, 'x', EXPAND_LEXER_SIZE * 2);
+    memcpy(text + 3 + EXPAND_LEXER_SIZE * 2, "</a>", 4);
+    gdoc = new_XMLDocument();
+    CuAssertTrue(tc, feed_xml(gdoc, &handler, text, strlen(text)));
+    CuAssertTrue(tc, finish_xml(gdoc, &handler));
+    CuAssertIntEquals(tc, 1, gdoc->parse.lexer_growths);
+    free_XMLDocument(gdoc);
+    free(text);
 }
+#endif
 
 /* Add all the tests to the test suite. */
 CuSuite* test_suite() {
@@ -236,7 +1831,32 @@ CuSuite* test_suite() {
     SUITE_ADD_TEST(suite, test_parse_inline);
     SUITE_ADD_TEST(suite, test_inner_xml);
     SUITE_ADD_TEST(suite, test_parse_example);
-    SUITE_ADD_TEST(suite, test_free_XMLStacks);
+    SUITE_ADD_TEST(suite, test_parse_reentrant);
+    SUITE_ADD_TEST(suite, test_parse_arena);
+    SUITE_ADD_TEST(suite, test_parse_in_situ);
+    SUITE_ADD_TEST(suite, test_map_file);
+    SUITE_ADD_TEST(suite, test_parse_sax);
+    SUITE_ADD_TEST(suite, test_feed_xml);
+    SUITE_ADD_TEST(suite, test_reader);
+    SUITE_ADD_TEST(suite, test_normalize_text);
+    SUITE_ADD_TEST(suite, test_preserve_whitespace);
+    SUITE_ADD_TEST(suite, test_special_nodes);
+    SUITE_ADD_TEST(suite, test_parse_parallel);
+    SUITE_ADD_TEST(suite, test_attribute_index);
+    SUITE_ADD_TEST(suite, test_intern_symbols);
+    SUITE_ADD_TEST(suite, test_parse_flat);
+    SUITE_ADD_TEST(suite, test_inline_list);
+    SUITE_ADD_TEST(suite, test_query);
+    SUITE_ADD_TEST(suite, test_tag_index);
+    SUITE_ADD_TEST(suite, test_blob);
+    SUITE_ADD_TEST(suite, test_writer);
+    SUITE_ADD_TEST(suite, test_allocator);
+    SUITE_ADD_TEST(suite, test_lazy_attributes);
+    SUITE_ADD_TEST(suite, test_lazy_children);
+    SUITE_ADD_TEST(suite, test_projection);
+#ifdef SXML_STATS
+    SUITE_ADD_TEST(suite, test_parse_stats);
+#endif
     return suite;
 }
 